@@ -12,5 +12,9 @@
 
 void access_setup(char *, char *);
 int  access_host(struct sockaddr_in *);
+void access_proxy_setup(char *);
+int  access_proxy(struct sockaddr_in *);
+void access_dest_setup(char *, char *);
+int  access_dest(struct sockaddr_in *, const char *);
 
 #endif /* ACCESS_H */
@@ -0,0 +1,33 @@
+/*
+ * accesslog.h
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#define ACCESSLOG_VERSION 1	/* Of the binary records */
+
+/* Why a connection closed */
+#define ACCESSLOG_CLOSED       0	/* By either end, after relaying */
+#define ACCESSLOG_CLIENT_ERROR 1
+#define ACCESSLOG_TARGET_ERROR 2
+#define ACCESSLOG_REJECTED     3	/* By the access lists */
+#define ACCESSLOG_FAILED       4	/* Negotiation, for the stats cause */
+#define ACCESSLOG_ERROR        5	/* Anything else */
+#define ACCESSLOG_NREASONS     6
+
+#define ACCESSLOG_NOCAUSE 0xff
+
+extern char *accesslog_file;
+extern char *accesslog_format;	/* "json" or "binary" */
+extern int   accesslog_size;	/* Kilobytes before rotating; 0 never */
+
+void accesslog_setup(void);
+void accesslog_start(struct negdesc *);
+void accesslog_reason(int);
+void accesslog_reject(struct sockaddr_in *);
+
+#endif /* ACCESSLOG_H */
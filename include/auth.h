@@ -0,0 +1,34 @@
+/*
+ * auth.h
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#ifndef AUTH_H
+#define AUTH_H
+
+#define AUTH_HASHSZ 256
+
+extern char *auth_file;		/* "user:crypt(3) hash" lines */
+extern int   auth_cache_time;	/* Seconds a verified password is trusted */
+
+/* Lives in memory shared with the children, who fill it in */
+struct auth_cache {
+	u_int64_t tag;		/* Keyed hash of the password */
+	time_t    expires;
+};
+
+struct auth_user {
+	char                  *name;
+	char                  *hash;
+	u_int                  slot;	/* In the cache */
+	TAILQ_ENTRY(auth_user) next;
+};
+
+TAILQ_HEAD(auth_userh, auth_user);
+
+void auth_setup(void);
+int  auth_check(const char *, const char *);
+
+#endif /* AUTH_H */
@@ -0,0 +1,30 @@
+/*
+ * breaker.h
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#ifndef BREAKER_H
+#define BREAKER_H
+
+#define BREAKER_SETS 1024
+#define BREAKER_WAYS 4
+
+extern int breaker_failures;	/* Consecutive failures that trip it; 0 off */
+extern int breaker_time;	/* Seconds to fail fast before a probe */
+
+/* Lives in memory shared with the children, who fill it in */
+struct breaker_entry {
+	in_addr_t addr;
+	u_int16_t port;
+	u_int16_t failures;
+	time_t    until;	/* Failing fast until then, if tripped */
+	time_t    last;		/* Last failure, for eviction */
+};
+
+void breaker_setup(void);
+int  breaker_allow(struct sockaddr_in *);
+void breaker_done(struct sockaddr_in *, int);
+
+#endif /* BREAKER_H */
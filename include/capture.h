@@ -0,0 +1,24 @@
+/*
+ * capture.h
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#define CAPTURE_FROM_CLIENT 0
+#define CAPTURE_FROM_REMOTE 1
+
+extern char *capture_file;	/* pcapng */
+extern char *capture_filter;	/* Destinations always captured */
+extern int   capture_sample;	/* Capture one connection in this many */
+extern int   capture_bytes;	/* Per connection and direction */
+extern int   capture_buffer;	/* Kilobytes held by each child */
+
+void capture_setup(void);
+int  capture_start(struct negdesc *);
+void capture_data(int, u_char *, size_t);
+
+#endif /* CAPTURE_H */
@@ -0,0 +1,39 @@
+/*
+ * chain.h
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ */
+
+#ifndef CHAIN_H
+#define CHAIN_H
+
+extern int chain_check_interval;	/* Seconds between probes; 0 disables */
+
+struct chain_hop {
+	struct addrinfo *ai;
+	char            *name;
+	int              up;
+	u_int            rtt;		/* Handshake latency EWMA, usec */
+	u_int            probes;
+	u_int            probefails;
+	int              probesock;
+	u_char           probebuf[2];
+	size_t           probelen;
+	struct timeval   probestart;
+	struct event     probeev;
+	struct chain    *chain;
+};
+
+struct chain {
+	int               nhops;
+	struct chain_hop *hops;
+	struct conndesc  *conn;
+};
+
+struct chain *chain_new(char *);
+void          chain_start(struct chain *, struct conndesc *);
+void          chain_report(struct chain *);
+int           chain_connect(struct conndesc *, struct sockaddr *, socklen_t);
+
+#endif /* CHAIN_H */
@@ -0,0 +1,54 @@
+/*
+ * dest.h
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#ifndef DEST_H
+#define DEST_H
+
+/*
+ * Tables keyed on the destination of a connection.  Rules match an
+ * address prefix or a domain and all its subdomains, each optionally
+ * for a port or range of ports.
+ */
+
+struct dest_value {
+	u_int16_t               lo;	/* Ports, inclusive */
+	u_int16_t               hi;
+	void                   *value;
+	SLIST_ENTRY(dest_value) next;
+};
+
+SLIST_HEAD(dest_valueh, dest_value);
+
+/* Binary trie on the address bits */
+struct dest_node {
+	struct dest_node  *child[2];
+	struct dest_valueh values;
+};
+
+struct dest_suffix {
+	char                     *name;
+	struct dest_valueh        values;
+	SLIST_ENTRY(dest_suffix)  next;
+};
+
+SLIST_HEAD(dest_suffixh, dest_suffix);
+
+struct dest_table {
+	struct dest_node     root;
+	struct dest_suffixh *suffixes;
+	u_int                nbuckets;
+	u_int                nsuffixes;
+	u_int                nrules;
+};
+
+struct dest_table *dest_new(void);
+void               dest_free(struct dest_table *);
+int                dest_add(struct dest_table *, const char *, void *);
+void              *dest_lookup(struct dest_table *, struct sockaddr_in *,
+                       const char *);
+
+#endif /* DEST_H */
@@ -0,0 +1,24 @@
+/*
+ * hosts.h
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#ifndef HOSTS_H
+#define HOSTS_H
+
+struct hosts_entry {
+	char                     *name;	/* Without the "*." of wildcards */
+	int                       wild;
+	struct in_addr            addr;
+	SLIST_ENTRY(hosts_entry)  next;	/* In a bucket */
+	SLIST_ENTRY(hosts_entry)  all;
+};
+
+SLIST_HEAD(hosts_entryh, hosts_entry);
+
+void hosts_setup(void);
+int  hosts_resolve(const char *, struct in_addr *);
+
+#endif /* HOSTS_H */
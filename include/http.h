@@ -0,0 +1,13 @@
+/*
+ * http.h
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#ifndef HTTP_H
+#define HTTP_H
+
+int http_negotiate(struct negdesc *, struct conndesc *);
+
+#endif /* HTTP_H */
@@ -0,0 +1,16 @@
+/*
+ * metrics.h
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+extern char *metrics_listen;	/* Unix socket path or loopback port */
+
+void metrics_setup(void);
+void metrics_forked(void);
+
+#endif /* METRICS_H */
@@ -9,6 +9,86 @@
 #ifndef MIRROR_H
 #define MIRROR_H
 
-int mirror_setup(struct conndesc *);
+/* Backend selection policies */
+#define MIRROR_ROUNDROBIN 0
+#define MIRROR_LEASTCONN  1
+#define MIRROR_WEIGHTED   2
+#define MIRROR_HASH       3
+
+/* Exit status of a process that could not connect to its backend */
+#define MIRROR_EXIT_CONNFAIL 3
+
+/* Health checking; see mirror.c for the defaults */
+struct mirror_health {
+	int interval;		/* Seconds between probes; 0 disables */
+	int timeout;		/* Probe connect timeout */
+	int rise;		/* Successful probes to come back up */
+	int fall;		/* Failed probes to go down */
+	int eject_errors;	/* Consecutive connect failures to eject */
+	int eject_time;		/* Seconds an ejected backend sits out */
+};
+
+extern struct mirror_health mirror_health;
+
+/* Warm pool of connections to each backend */
+extern int mirror_pool_size;		/* Per backend; 0 disables */
+extern int mirror_pool_idle;		/* Seconds before recycling */
+
+struct mirror_pooled {
+	int                         sock;
+	int                         connected;
+	struct event                ev;
+	struct mirror_backend      *mb;
+	TAILQ_ENTRY(mirror_pooled)  next;
+};
+
+TAILQ_HEAD(mirror_poolh, mirror_pooled);
+
+struct mirror_backend {
+	struct addrinfo *ai;
+	char            *name;		/* As configured */
+	int              weight;
+	int              current;	/* Smooth weighted round robin */
+	u_int            active;	/* Connections being served */
+	int              up;		/* As seen by the active probes */
+	int              rise;		/* Consecutive probe successes */
+	int              fall;		/* Consecutive probe failures */
+	u_int            connfails;	/* Consecutive connect failures */
+	time_t           ejected;	/* Sits out until */
+	u_int            probes;
+	u_int            probefails;
+	u_int            ejections;
+	int              probesock;
+	struct event     probeev;
+	struct mirror_poolh pool;
+	u_int            npool;		/* Including connects underway */
+	struct event     poolev;	/* Refill */
+	struct mirror   *mirror;
+};
+
+struct mirror_point {
+	u_int32_t              hash;
+	struct mirror_backend *mb;
+};
+
+struct mirror {
+	int                    policy;
+	u_int                  nbackends;
+	struct mirror_backend *backends;
+	u_int                  rr;
+	u_int                  npoints;
+	struct mirror_point   *ring;	/* Consistent hashing */
+	struct conndesc       *conn;
+};
+
+struct mirror         *mirror_new(char *, char *);
+void                   mirror_start(struct mirror *, struct conndesc *);
+void                   mirror_report(struct mirror *);
+struct mirror_backend *mirror_select(struct mirror *, struct sockaddr_in *);
+void                   mirror_started(struct mirror *, struct mirror_backend *,
+                           pid_t);
+void                   mirror_reap(pid_t, int);
+int                    mirror_pool_take(struct mirror_backend *);
+int                    mirror_setup(struct negdesc *, struct conndesc *);
 
 #endif /* MIRROR_H */
@@ -13,20 +13,91 @@
 
 #define NET_SUPPORT_SOCKS4 0x01
 #define NET_SUPPORT_SOCKS5 0x02
+#define NET_SUPPORT_HTTP   0x04	/* HTTP CONNECT */
+
+/* Listener and upstream socket options */
+#define NET_OPT_FASTOPEN         0x01	/* TCP Fast Open on the listener */
+#define NET_OPT_FASTOPEN_CONNECT 0x02	/* TCP Fast Open on connects */
+#define NET_OPT_REDIRECT         0x04	/* Transparent, iptables REDIRECT */
+#define NET_OPT_TPROXY           0x08	/* Transparent, iptables TPROXY */
+#define NET_OPT_TRANSPARENT      (NET_OPT_REDIRECT | NET_OPT_TPROXY)
+#define NET_OPT_PROXYHDR         0x10	/* Clients send a PROXY header */
+#define NET_OPT_MIRROR_PROXYHDR  0x20	/* Send backends a PROXY header */
 
 /* Return codes from negotation routines. */
 #define NET_FAIL -1		/* Negotiation failed */
 #define NET_NOPROXY -2		/* Negotiation succeeded - but don't proxy. */
 
+/*
+ * Return codes from the request parsers.  A positive return is the
+ * number of bytes consumed.
+ */
+#define NET_PARSE_FAIL -1	/* Malformed request */
+#define NET_PARSE_MORE 0	/* Request incomplete; need more data */
+
+#define NET_NEGBUFSZ 2048
+
+struct mirror;
+struct mirror_backend;
+struct chain;
+struct tunnel;
+struct dest_table;
+
+#define NET_SOURCE_ROUNDROBIN 0
+#define NET_SOURCE_HASH       1	/* By destination address */
+
+/* An address outgoing connections are made from */
+struct net_source {
+	struct addrinfo *ai;
+	char            *if_name;	/* Given as an interface */
+};
+
 struct conndesc {
-	struct addrinfo *mirror_ai;
-	struct addrinfo *bind_ai;
-    char * bind_if_name;
-	struct addrinfo *serv_ai;
-	struct addrinfo *chain_ai;
-	int              support;
+	struct mirror     *mirror;
+	struct net_source *sources;
+	int                nsources;
+	int                source_policy;
+	u_int              source_next;
+	struct dest_table *routes;	/* Destination to net_source */
+	struct addrinfo   *serv_ai;
+	struct chain      *chain;
+	struct tunnel     *tunnel;
+	int                support;
+	int                options;
 };
 
-int net_setup(char *, char *, char *, char *, char *, int);
+/*
+ * Negotiation state for one client.  Everything received from the
+ * client goes into buf; the parsers consume from off and never block,
+ * so negotiation can be resumed whenever more data arrives.
+ */
+struct negdesc {
+	int                    sock;
+	u_char                 buf[NET_NEGBUFSZ];
+	size_t                 len;	/* Bytes received */
+	size_t                 off;	/* Bytes consumed */
+	struct sockaddr_in     cli_in;	/* Client */
+	struct sockaddr_in     srv_in;	/* Where the client connected */
+	struct sockaddr_in     rem_in;	/* Target, once known */
+	char                   rem_host[256];	/* Target name, if given */
+	char                   user[256];	/* Authenticated as */
+	struct mirror_backend *mb;	/* Mirror mode backend */
+	int                    presock;	/* Pooled backend connection */
+	int                    listener;	/* For the statistics */
+	u_int64_t              accepted;	/* stats_clock() */
+};
+
+int net_setup(char *, char *, char *, char *, char *, int, int);
+void net_report(void);
+
+struct addrinfo *get_ai_from_addrpair(char *);
+struct net_source *net_source(struct conndesc *, struct sockaddr *,
+        const char *);
+int net_socket(struct conndesc *, struct sockaddr *, const char *);
+int net_connect(struct conndesc *, struct sockaddr *, socklen_t,
+        struct negdesc *);
+int net_negfill(struct negdesc *);
+int net_negparse(struct negdesc *,
+        int (*)(const u_char *, size_t, void *), void *);
 
 #endif /* NET_H */
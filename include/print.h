@@ -9,10 +9,14 @@
 #ifndef PRINT_H
 #define PRINT_H
 
+extern char *print_file;	/* Log to this file instead */
+extern int   print_rate;	/* Messages per second per process; 0 any */
+
 void print_setup(int, int);
 void errv(int, int, const char *, ...);
 void errxv(int, int, const char *, ...);
 void warnv(int, const char *, ...);
 void warnxv(int, const char *, ...);
+void print_dump(u_char *, int);
 
 #endif /* PRINT_H */
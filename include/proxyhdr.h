@@ -0,0 +1,19 @@
+/*
+ * proxyhdr.h
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#ifndef PROXYHDR_H
+#define PROXYHDR_H
+
+/* Longest v1 header, and the v2 header we send */
+#define PROXYHDR_V1_MAX 107
+#define PROXYHDR_V2_LEN (16 + 12)
+
+int proxyhdr_parse(const u_char *, size_t, struct sockaddr_in *,
+        struct sockaddr_in *);
+int proxyhdr_v2(u_char *, struct sockaddr_in *, struct sockaddr_in *);
+
+#endif /* PROXYHDR_H */
@@ -9,6 +9,6 @@
 #ifndef SOCKS4_H
 #define SOCKS4_H
 
-int socks4_negotiate(int, struct conndesc *);
+int socks4_negotiate(struct negdesc *, struct conndesc *);
 
 #endif /* SOCKS4_H */
@@ -9,6 +9,8 @@
 #ifndef SOCKS5_H
 #define SOCKS5_H
 
-int socks5_negotiate(int, struct conndesc *);
+int    socks5_negotiate(struct negdesc *, struct conndesc *);
+u_char socks5_rep(int);
+int    socks5_errno(u_char);
 
 #endif /* SOCKS5_H */
@@ -0,0 +1,140 @@
+/*
+ * stats.h
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#define STATS_WORKERS   1024	/* Children counted at a time */
+#define STATS_LISTENERS 16
+
+/* Per worker counters */
+#define STATS_BYTES_CLIENT   0	/* Relayed from clients */
+#define STATS_BYTES_REMOTE   1	/* Relayed from targets */
+#define STATS_DNS_ERRORS     2
+#define STATS_CONNECT_ERRORS 3
+#define STATS_NCOUNTERS      4
+
+/* What a worker is serving */
+#define STATS_MODE_NEGOTIATING 0
+#define STATS_MODE_SOCKS4      1
+#define STATS_MODE_SOCKS5      2
+#define STATS_MODE_HTTP        3
+#define STATS_MODE_MIRROR      4
+#define STATS_MODE_TRANSPARENT 5
+#define STATS_NMODES           6
+
+/* Why a negotiation failed */
+#define STATS_NEG_PROTOCOL 0	/* Malformed or unsupported request */
+#define STATS_NEG_EOF      1	/* Client went away */
+#define STATS_NEG_AUTH     2
+#define STATS_NEG_DENIED   3	/* Destination not allowed */
+#define STATS_NEG_DNS      4
+#define STATS_NEG_CONNECT  5
+#define STATS_NNEG         6
+
+/* Latency histograms, each kept for both outcomes */
+#define STATS_HIST_REPLY        0	/* Accept to the reply to the request */
+#define STATS_HIST_DNS          1
+#define STATS_HIST_CONNECT      2
+#define STATS_HIST_ACL          3	/* Accept to the access lists passed */
+#define STATS_HIST_HANDSHAKE    4	/* Fork to the request understood */
+#define STATS_HIST_FIRST_CLIENT 5	/* Reply to first byte relayed */
+#define STATS_HIST_FIRST_REMOTE 6
+#define STATS_NHISTS            7
+
+/* When each phase of a connection started or ended */
+#define STATS_T_ACCEPT       0
+#define STATS_T_ACL          1
+#define STATS_T_FORK         2
+#define STATS_T_DNS          3
+#define STATS_T_DNS_DONE     4
+#define STATS_T_CONNECT      5
+#define STATS_T_CONNECTED    6
+#define STATS_T_REPLY        7
+#define STATS_T_FIRST_CLIENT 8	/* First byte relayed from the client */
+#define STATS_T_FIRST_REMOTE 9
+#define STATS_NSTAMPS        10
+
+#define STATS_OK        0
+#define STATS_FAIL      1
+#define STATS_NOUTCOMES 2
+
+#define STATS_NBUCKETS 14	/* Plus one for the rest */
+
+extern char *stats_listen;	/* Unix socket path or loopback port */
+
+/* Fixed buckets, so recording a time is a few additions */
+struct stats_hist {
+	u_int64_t buckets[STATS_NBUCKETS + 1];
+	u_int64_t sum;		/* Microseconds */
+};
+
+/* Everything counted for one listener and mode */
+struct stats_total {
+	u_int64_t         counters[STATS_NCOUNTERS];
+	u_int64_t         negfails[STATS_NNEG];
+	u_int64_t         closed[STATS_NOUTCOMES];
+	struct stats_hist hists[STATS_NHISTS][STATS_NOUTCOMES];
+};
+
+/*
+ * One per child; only that child writes to it, except for the
+ * listening process claiming and freeing it around the child's life.
+ */
+struct stats_worker {
+	pid_t              pid;		/* 0 if free, -1 while forking */
+	int                listener;
+	int                mode;
+	int                cause;	/* Of a negotiation failure, so far */
+	int                failed;
+	struct stats_total total;
+};
+
+/* Written by the listening process only */
+struct stats_listener {
+	char      name[64];
+	u_int64_t accepts;
+	u_int64_t rejects;
+};
+
+/* Lives in memory shared with the children */
+struct stats_shm {
+	struct stats_listener listeners[STATS_LISTENERS];
+	int                   nlisteners;
+	u_int64_t             untracked;	/* Children without a slot */
+	struct stats_total    retired[STATS_LISTENERS][STATS_NMODES];
+	struct stats_worker   workers[STATS_WORKERS];
+};
+
+extern const char      *stats_modes[STATS_NMODES];
+extern const char      *stats_causes[STATS_NNEG];
+extern const u_int64_t  stats_bounds[STATS_NBUCKETS];
+
+void              stats_setup(void);
+int               stats_socket(const char *);
+void              stats_unlink(const char *);
+int               stats_listener(const char *);
+void              stats_accept(int, int);
+int               stats_fork(int);
+void              stats_forked(int, pid_t);
+void              stats_reap(pid_t);
+struct stats_worker *stats_self(void);
+void              stats_mode(int);
+void              stats_cause(int);
+void              stats_negfail(void);
+void              stats_add(int, u_int64_t);
+u_int64_t         stats_clock(void);
+void              stats_time(int, int, u_int64_t);
+void              stats_stamps_start(u_int64_t);
+u_int64_t         stats_stamp(int);
+void              stats_replied(int);
+void              stats_first(int);
+void              stats_phases(char *, size_t);
+struct stats_shm *stats_sum(struct stats_total [][STATS_NMODES],
+                      u_int [][STATS_NMODES]);
+
+#endif /* STATS_H */
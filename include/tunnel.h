@@ -0,0 +1,91 @@
+/*
+ * tunnel.h
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ */
+
+#ifndef TUNNEL_H
+#define TUNNEL_H
+
+/*
+ * Frames are a header of type, a pad byte, payload length and stream
+ * id, all in network byte order, followed by the payload.
+ */
+#define TUNNEL_HDRLEN  8
+#define TUNNEL_MAXDATA 16384
+
+#define TUNNEL_OPEN    1	/* SOCKS5 ATYP, address and port */
+#define TUNNEL_OPENED  2	/* SOCKS5 reply code */
+#define TUNNEL_DATA    3
+#define TUNNEL_WINDOW  4	/* 32 bit window increment */
+#define TUNNEL_CLOSE   5	/* No more data from the sender */
+#define TUNNEL_RESET   6
+
+/* Bytes in flight per stream and direction */
+#define TUNNEL_STREAMWIN 65536
+#define TUNNEL_HASHSZ    64
+
+extern int tunnel_conns;	/* Connections to keep to the peer */
+
+struct tunnel_conn;
+
+struct tunnel_stream {
+	u_int32_t                  id;
+	int                        fd;
+	int                        state;
+	int                        flags;
+	u_int32_t                  sendwin;	/* We may send this much */
+	u_int32_t                  unacked;	/* Delivered, not announced */
+	u_char                    *buf;		/* Towards fd */
+	size_t                     off;
+	size_t                     len;
+	struct event               rev;
+	struct event               wev;
+	struct tunnel_conn        *tc;
+	struct tunnel             *t;
+	TAILQ_ENTRY(tunnel_stream) next;
+};
+
+TAILQ_HEAD(tunnel_streamh, tunnel_stream);
+
+struct tunnel_conn {
+	int                      fd;
+	int                      outgoing;
+	int                      connected;
+	int                      blocked;	/* A stream waits for space */
+	u_int                    nstreams;
+	u_int32_t                nextid;
+	u_char                  *in;
+	size_t                   inlen;
+	u_char                  *out;
+	size_t                   outoff;
+	size_t                   outlen;
+	struct event             rev;
+	struct event             wev;
+	struct tunnel_streamh    streams[TUNNEL_HASHSZ];
+	struct tunnel           *t;
+	TAILQ_ENTRY(tunnel_conn) next;
+};
+
+struct tunnel {
+	struct addrinfo        *peer_ai;	/* We open streams to it */
+	char                   *peer;
+	int                     listensock;	/* Peers open streams to us */
+	struct event            listenev;
+	struct event            retryev;
+	int                     childsock;	/* Around fork() */
+	int                     parentsock;
+	TAILQ_HEAD(, tunnel_conn) conns;
+	struct tunnel_streamh   waiting;	/* For a request from a child */
+	struct conndesc        *conn;
+};
+
+struct tunnel *tunnel_new(char *, char *);
+void           tunnel_start(struct tunnel *, struct conndesc *);
+int            tunnel_prefork(struct tunnel *);
+void           tunnel_postfork(struct tunnel *, pid_t);
+int            tunnel_connect(struct tunnel *, struct sockaddr *, socklen_t);
+void           tunnel_report(struct tunnel *);
+
+#endif /* TUNNEL_H */
@@ -0,0 +1,17 @@
+/*
+ * udp.h
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#ifndef UDP_H
+#define UDP_H
+
+struct udp_assoc;
+
+struct udp_assoc *udp_setup(int, struct sockaddr_in *, struct conndesc *,
+                      struct sockaddr_in *);
+void              udp_relay(struct udp_assoc *);
+
+#endif /* UDP_H */
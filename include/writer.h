@@ -0,0 +1,19 @@
+/*
+ * writer.h
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif /* MSG_NOSIGNAL */
+
+int  writer_spawn(const char *, int, void (*)(int));
+void writer_loop(int, size_t, int, void (*)(u_char *, size_t),
+         void (*)(void));
+
+#endif /* WRITER_H */
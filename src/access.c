@@ -22,6 +22,7 @@
 #include "config.h"
 #endif /* HAVE_CONFIG_H */
 
+#include "dest.h"
 #include "expanda.h"
 #include "print.h"
 
@@ -33,8 +34,17 @@ struct ip_chain {
 
 static TAILQ_HEAD(ip_chainh, ip_chain) allow_chain, deny_chain;
 
+/* Load balancers trusted to send a PROXY header */
+static struct ip_chainh proxy_chain = TAILQ_HEAD_INITIALIZER(proxy_chain);
+
+/* Destination rules; the values only tell allow from deny */
+static struct dest_table *dest_rules;
+static char               dest_allow, dest_deny;
+
 static int  makechain(void *, char **);
+static int  inchain(struct ip_chainh *, struct sockaddr_in *);
 static void destroychain(void *);
+static void makedest(char *, void *);
 
 void
 access_setup(char *allow, char *deny)
@@ -60,27 +70,77 @@ access_setup(char *allow, char *deny)
 int
 access_host(struct sockaddr_in *in)
 {
-	int a = 0;
- 	struct ip_chain *node;
-	struct ip_chainh *ip_list[] = {&deny_chain, &allow_chain, NULL};
-	struct ip_chainh **il = ip_list;
+	if (inchain(&deny_chain, in))
+		return (0);
+	if (inchain(&allow_chain, in))
+		return (1);
 
-	do {
-		TAILQ_FOREACH(node, *il, next) {
-			in_addr_t addr_in, addr_node;
+	if (TAILQ_EMPTY(&allow_chain))
+		return (1);
 
-			addr_in = in->sin_addr.s_addr & htonl(node->mask.s_addr);
-			addr_node = node->addr.s_addr & htonl(node->mask.s_addr);
+	return (0);
+}
 
-			if (memcmp(&addr_in, &addr_node, sizeof(addr_in)) == 0)
-				return (a);
-		}
-		a = 1;
-	} while (*(++il));
+void
+access_proxy_setup(char *from)
+{
+	char **arr;
 
-	if (TAILQ_EMPTY(&allow_chain))
+	if ((arr = expanda(from)) == NULL)
+		errxv(0, 1, "Error expanding PROXY header list");
+	if (makechain(&proxy_chain, arr) == -1)
+		errxv(0, 1, "Error making PROXY header list");
+	freea(arr);
+}
+
+/*
+ * Whether the peer, as accept() saw it, may name the client in a
+ * PROXY header.
+ */
+int
+access_proxy(struct sockaddr_in *in)
+{
+	return (inchain(&proxy_chain, in));
+}
+
+/*
+ * Destinations are allowed unless the most specific rule matching them
+ * is in the deny list; see dest_add() for the syntax.
+ */
+void
+access_dest_setup(char *allow, char *deny)
+{
+	if ((allow == NULL || *allow == '\0') &&
+	    (deny == NULL || *deny == '\0'))
+		return;
+
+	if ((dest_rules = dest_new()) == NULL)
+		errv(0, 1, "dest_new()");
+	if (allow != NULL)
+		makedest(allow, &dest_allow);
+	if (deny != NULL)
+		makedest(deny, &dest_deny);
+}
+
+int
+access_dest(struct sockaddr_in *in, const char *host)
+{
+	if (dest_rules == NULL)
+		return (1);
+
+	/* The rules only know IPv4; nothing else gets past them */
+	if (in->sin_family != AF_INET) {
+		warnxv(1, "Destination %s denied, not IPv4",
+		    host != NULL && *host != '\0' ? host : "-");
+		return (0);
+	}
+
+	if (dest_lookup(dest_rules, in, host) != &dest_deny)
 		return (1);
 
+	warnxv(1, "Destination %s:%d (%s) denied", inet_ntoa(in->sin_addr),
+	    ntohs(in->sin_port), host != NULL && *host != '\0' ? host : "-");
+
 	return (0);
 }
 
@@ -140,6 +200,23 @@ makechain(void *_head, char **hostlist)
 	return (-1);
 }
 
+static int
+inchain(struct ip_chainh *head, struct sockaddr_in *in)
+{
+	struct ip_chain *node;
+	in_addr_t addr_in, addr_node;
+
+	TAILQ_FOREACH(node, head, next) {
+		addr_in = in->sin_addr.s_addr & htonl(node->mask.s_addr);
+		addr_node = node->addr.s_addr & htonl(node->mask.s_addr);
+
+		if (addr_in == addr_node)
+			return (1);
+	}
+
+	return (0);
+}
+
 static void
 destroychain(void *_head)
 {
@@ -151,3 +228,16 @@ destroychain(void *_head)
 		free(node);
 	}	
 }
+
+static void
+makedest(char *list, void *value)
+{
+	char **arr, **a;
+
+	if ((arr = expanda(list)) == NULL)
+		errxv(0, 1, "Error expanding destination list");
+	for (a = arr; *a != NULL; a++)
+		if (dest_add(dest_rules, *a, value) == -1)
+			errxv(0, 1, "Bad or duplicate destination: %s", *a);
+	freea(arr);
+}
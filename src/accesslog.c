@@ -0,0 +1,423 @@
+/*
+ * accesslog.c
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "net.h"
+#include "print.h"
+#include "stats.h"
+#include "accesslog.h"
+#include "writer.h"
+
+/*
+ * One record for every connection when it closes, written by a
+ * process of its own: children send their record over a socket pair
+ * as they exit, and the writer appends whatever has arrived in one
+ * write, rotating the file when it grows past accesslog_size.
+ *
+ * The binary records are, in network byte order:
+ *
+ *	u16 record length	u8 version	u8 mode
+ *	u8 reason		u8 cause	u64 time closed (usec)
+ *	u32 duration (msec)	u32 client addr	u16 client port
+ *	u32 target addr		u16 target port	u64 bytes from client
+ *	u64 bytes from target	u8 name length	name
+ *	u8 user length		user
+ */
+
+#define ACCESSLOG_RECSZ 4096
+#define ACCESSLOG_BUFSZ (64 * 1024)
+
+char *accesslog_file;
+char *accesslog_format = "json";
+int   accesslog_size;
+
+static const char *accesslog_reasons[ACCESSLOG_NREASONS] = {
+	"closed", "client-error", "target-error", "rejected", "failed", "error"
+};
+
+static int             accesslog_binary;
+static int             accesslog_fd = -1;
+static int             accesslog_sock = -1;	/* To the writer */
+static struct negdesc *accesslog_nd;		/* In a child */
+static int             accesslog_why = -1;
+
+/* In the writer */
+static u_char          accesslog_buf[ACCESSLOG_BUFSZ];
+static size_t          accesslog_off;
+static off_t           accesslog_len;	/* Of the file */
+
+static void   accesslog_exit(void);
+static void   accesslog_send(u_char *, size_t, int);
+static size_t accesslog_record(u_char *, size_t, struct sockaddr_in *,
+                  struct negdesc *, struct stats_worker *, int);
+static size_t accesslog_json(char *, size_t, const char *);
+static void   accesslog_writer(int);
+static void   accesslog_take(u_char *, size_t);
+static void   accesslog_write(void);
+static void   accesslog_rotate(void);
+static void   accesslog_reopen(void);
+
+void
+accesslog_setup(void)
+{
+	if (strcmp(accesslog_format, "json") == 0)
+		accesslog_binary = 0;
+	else if (strcmp(accesslog_format, "binary") == 0)
+		accesslog_binary = 1;
+	else
+		errxv(0, 1, "Unknown access log format: %s", accesslog_format);
+
+	if ((accesslog_fd = open(accesslog_file,
+		 O_WRONLY | O_APPEND | O_CREAT, 0640)) == -1)
+		errv(0, 1, "open(): %s", accesslog_file);
+	/* A restart on SIGHUP opens it again */
+	fcntl(accesslog_fd, F_SETFD, FD_CLOEXEC);
+
+	/* Appended to directly, and never rotated, without a writer */
+	if ((accesslog_sock = writer_spawn("the access log", 0,
+		 accesslog_writer)) == -1)
+		return;
+
+	close(accesslog_fd);
+	accesslog_fd = -1;
+
+	warnxv(1, "Access log in %s", accesslog_file);
+}
+
+/*
+ * In a child serving nd; its record is sent when it exits, however
+ * that happens.
+ */
+void
+accesslog_start(struct negdesc *nd)
+{
+	if (accesslog_file == NULL)
+		return;
+
+	accesslog_nd = nd;
+	if (atexit(accesslog_exit) != 0)
+		warnv(0, "atexit()");
+}
+
+/* Why the child is about to exit */
+void
+accesslog_reason(int reason)
+{
+	accesslog_why = reason;
+}
+
+/* A client turned away by the listening process */
+void
+accesslog_reject(struct sockaddr_in *cli_in)
+{
+	u_char rec[ACCESSLOG_RECSZ];
+	size_t len;
+
+	if (accesslog_file == NULL)
+		return;
+
+	len = accesslog_record(rec, sizeof(rec), cli_in, NULL, NULL,
+	    ACCESSLOG_REJECTED);
+	accesslog_send(rec, len, 0);
+}
+
+static void
+accesslog_exit(void)
+{
+	struct stats_worker *sw = stats_self();
+	u_char rec[ACCESSLOG_RECSZ];
+	size_t len;
+	int reason = accesslog_why;
+
+	if (reason == -1)
+		reason = sw != NULL && sw->failed ?
+		    ACCESSLOG_FAILED : ACCESSLOG_ERROR;
+
+	len = accesslog_record(rec, sizeof(rec), &accesslog_nd->cli_in,
+	    accesslog_nd, sw, reason);
+	accesslog_send(rec, len, 1);
+}
+
+/* Only the listening process must not wait for the writer */
+static void
+accesslog_send(u_char *rec, size_t len, int wait)
+{
+	ssize_t ret;
+
+	if (len == 0)
+		return;
+
+	if (accesslog_sock == -1) {
+		if (accesslog_fd != -1 && write(accesslog_fd, rec, len) == -1)
+			warnv(1, "write(): %s", accesslog_file);
+		return;
+	}
+
+	do
+		ret = send(accesslog_sock, rec, len,
+		    MSG_NOSIGNAL | (wait ? 0 : MSG_DONTWAIT));
+	while (ret == -1 && errno == EINTR);
+
+	if (ret == -1)
+		warnv(1, "Access log record dropped");
+}
+
+#define PUT16(p, v) do {						\
+	u_int16_t _v = htons(v);					\
+	memcpy((p), &_v, 2);						\
+	(p) += 2;							\
+} while (0)
+#define PUT32(p, v) do {						\
+	u_int32_t _v = htonl(v);					\
+	memcpy((p), &_v, 4);						\
+	(p) += 4;							\
+} while (0)
+#define PUT64(p, v) do {						\
+	PUT32((p), (u_int32_t)((u_int64_t)(v) >> 32));			\
+	PUT32((p), (u_int32_t)(v));					\
+} while (0)
+
+/*
+ * The record for a connection in the configured format; nd and sw
+ * are NULL for a client that was rejected.
+ */
+static size_t
+accesslog_record(u_char *buf, size_t size, struct sockaddr_in *cli_in,
+    struct negdesc *nd, struct stats_worker *sw, int reason)
+{
+	struct sockaddr_in *rem_in = NULL;
+	struct timeval tv;
+	u_int64_t now, up = 0, down = 0, duration = 0;
+	const char *host = "", *user = "";
+	char cli[32], rem[32], *p = (char *)buf;
+	int mode = STATS_MODE_NEGOTIATING, cause = ACCESSLOG_NOCAUSE;
+	size_t n, hlen, ulen;
+	u_char *q;
+
+	gettimeofday(&tv, NULL);
+	now = (u_int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+	if (nd != NULL) {
+		if (nd->rem_in.sin_family == AF_INET)
+			rem_in = &nd->rem_in;
+		host = nd->rem_host;
+		user = nd->user;
+		duration = stats_clock() - nd->accepted;
+	}
+	if (sw != NULL) {
+		mode = sw->mode;
+		up = sw->total.counters[STATS_BYTES_CLIENT];
+		down = sw->total.counters[STATS_BYTES_REMOTE];
+		if (reason == ACCESSLOG_FAILED)
+			cause = sw->cause;
+	}
+
+	if (accesslog_binary) {
+		hlen = strlen(host);
+		ulen = strlen(user);
+		if (46 + 1 + hlen + 1 + ulen > size || hlen > 255 || ulen > 255)
+			return (0);
+
+		q = buf + 2;
+		*q++ = ACCESSLOG_VERSION;
+		*q++ = mode;
+		*q++ = reason;
+		*q++ = cause;
+		PUT64(q, now);
+		PUT32(q, duration / 1000);
+		memcpy(q, &cli_in->sin_addr, 4);
+		q += 4;
+		memcpy(q, &cli_in->sin_port, 2);
+		q += 2;
+		if (rem_in != NULL) {
+			memcpy(q, &rem_in->sin_addr, 4);
+			memcpy(q + 4, &rem_in->sin_port, 2);
+		} else
+			memset(q, 0, 6);
+		q += 6;
+		PUT64(q, up);
+		PUT64(q, down);
+		*q++ = hlen;
+		memcpy(q, host, hlen);
+		q += hlen;
+		*q++ = ulen;
+		memcpy(q, user, ulen);
+		q += ulen;
+
+		n = q - buf;
+		q = buf;
+		PUT16(q, n);
+		return (n);
+	}
+
+	snprintf(cli, sizeof(cli), "%s:%d", inet_ntoa(cli_in->sin_addr),
+	    ntohs(cli_in->sin_port));
+	if (rem_in != NULL)
+		snprintf(rem, sizeof(rem), "%s:%d",
+		    inet_ntoa(rem_in->sin_addr), ntohs(rem_in->sin_port));
+
+	n = snprintf(p, size, "{\"time\":%llu.%06llu,\"client\":\"%s\",",
+	    (unsigned long long)(now / 1000000),
+	    (unsigned long long)(now % 1000000), cli);
+
+	/* The target as asked for, and where it was found */
+	if (host[0] != '\0') {
+		n += snprintf(p + n, size - n, "\"target\":\"");
+		n += accesslog_json(p + n, size - n, host);
+		if (rem_in != NULL)
+			n += snprintf(p + n, size - n, ":%d",
+			    ntohs(rem_in->sin_port));
+		n += snprintf(p + n, size - n, "\",");
+	} else if (rem_in != NULL)
+		n += snprintf(p + n, size - n, "\"target\":\"%s\",", rem);
+	if (rem_in != NULL)
+		n += snprintf(p + n, size - n, "\"address\":\"%s\",", rem);
+	if (user[0] != '\0') {
+		n += snprintf(p + n, size - n, "\"user\":\"");
+		n += accesslog_json(p + n, size - n, user);
+		n += snprintf(p + n, size - n, "\",");
+	}
+	n += snprintf(p + n, size - n, "\"mode\":\"%s\",\"bytes_up\":%llu,"
+	    "\"bytes_down\":%llu,\"duration\":%llu.%06llu,\"reason\":\"%s\"",
+	    stats_modes[mode], (unsigned long long)up,
+	    (unsigned long long)down,
+	    (unsigned long long)(duration / 1000000),
+	    (unsigned long long)(duration % 1000000),
+	    accesslog_reasons[reason]);
+	if (cause != ACCESSLOG_NOCAUSE)
+		n += snprintf(p + n, size - n, ",\"cause\":\"%s\"",
+		    stats_causes[cause]);
+	n += snprintf(p + n, size - n, "}\n");
+
+	/* Whole lines only */
+	return (n < size ? n : 0);
+}
+
+/* s escaped for a JSON string; names and users may hold anything */
+static size_t
+accesslog_json(char *buf, size_t size, const char *s)
+{
+	const u_char *c;
+	size_t n = 0;
+
+	if (size == 0)
+		return (0);
+
+	for (c = (const u_char *)s; *c != '\0' && n + 8 < size; c++) {
+		if (*c == '"' || *c == '\\') {
+			buf[n++] = '\\';
+			buf[n++] = *c;
+		} else if (*c < 0x20 || *c >= 0x7f)
+			n += snprintf(buf + n, size - n, "\\u%04x", *c);
+		else
+			buf[n++] = *c;
+	}
+	buf[n] = '\0';
+
+	return (n);
+}
+
+/*
+ * The writer: buffers the records that have arrived and writes them
+ * out together.
+ */
+static void
+accesslog_writer(int sock)
+{
+	struct stat sb;
+
+	if (fstat(accesslog_fd, &sb) == 0)
+		accesslog_len = sb.st_size;
+
+	writer_loop(sock, ACCESSLOG_RECSZ, ACCESSLOG_BUFSZ / ACCESSLOG_RECSZ,
+	    accesslog_take, accesslog_write);
+}
+
+static void
+accesslog_take(u_char *rec, size_t len)
+{
+	memcpy(accesslog_buf + accesslog_off, rec, len);
+	accesslog_off += len;
+}
+
+static void
+accesslog_write(void)
+{
+	struct stat sb, cur;
+
+	/* Moved by the writer from before a restart on SIGHUP */
+	if (fstat(accesslog_fd, &sb) == 0 &&
+	    stat(accesslog_file, &cur) == 0 &&
+	    (sb.st_dev != cur.st_dev || sb.st_ino != cur.st_ino))
+		accesslog_reopen();
+
+	if (accesslog_size > 0 && accesslog_len > 0 &&
+	    accesslog_len + accesslog_off > (off_t)accesslog_size * 1024)
+		accesslog_rotate();
+	if (write(accesslog_fd, accesslog_buf, accesslog_off) == -1)
+		warnv(0, "write(): %s", accesslog_file);
+	else
+		accesslog_len += accesslog_off;
+	accesslog_off = 0;
+}
+
+/*
+ * The old log is kept as file.0.  After a restart, the writer from
+ * before it stays for the connections that were open, and shares the
+ * file with the new one.
+ */
+static void
+accesslog_rotate(void)
+{
+	char old[1024];
+
+	snprintf(old, sizeof(old), "%s.0", accesslog_file);
+	if (rename(accesslog_file, old) == -1) {
+		warnv(0, "rename(): %s", accesslog_file);
+		return;
+	}
+
+	accesslog_reopen();
+}
+
+static void
+accesslog_reopen(void)
+{
+	struct stat sb;
+	int fd;
+
+	if ((fd = open(accesslog_file, O_WRONLY | O_APPEND | O_CREAT,
+		 0640)) == -1) {
+		/* Carry on in the old one */
+		warnv(0, "open(): %s", accesslog_file);
+		return;
+	}
+
+	close(accesslog_fd);
+	accesslog_fd = fd;
+	accesslog_len = fstat(fd, &sb) == 0 ? sb.st_size : 0;
+}
@@ -0,0 +1,289 @@
+/*
+ * auth.c
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/mman.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "auth.h"
+#include "print.h"
+
+/*
+ * Username/password credentials for SOCKS5 (RFC 1929).  The whole file
+ * is read into a hash table by the listening process, so a child
+ * looking up a user never touches the disk.  Passwords are kept as
+ * crypt(3) hashes, which are slow to check on purpose; a successful
+ * check is remembered for a while in memory shared by all children.
+ */
+
+struct auth_db {
+	struct auth_userh  users[AUTH_HASHSZ];
+	u_int              nusers;
+	struct auth_cache *cache;
+	size_t             cachesz;
+	char              *dummy;	/* Checked for unknown users */
+};
+
+char *auth_file;
+int   auth_cache_time = 60;
+
+static struct auth_db *auth_db;
+static u_int64_t       auth_key[2];
+
+static struct auth_db   *auth_load(const char *);
+static void              auth_free(struct auth_db *);
+static struct auth_user *auth_lookup(const char *);
+static int               auth_cmp(const char *, const char *);
+static u_int64_t         auth_siphash(const void *, size_t);
+
+void
+auth_setup(void)
+{
+	int fd;
+
+	/* Keys the cache tags and the table against chosen names */
+	if ((fd = open("/dev/urandom", O_RDONLY)) == -1 ||
+	    read(fd, auth_key, sizeof(auth_key)) != sizeof(auth_key)) {
+		warnv(1, "/dev/urandom");
+		auth_key[0] = (u_int64_t)time(NULL) << 32 | getpid();
+		auth_key[1] = (u_int64_t)getppid() << 32 | clock();
+	}
+	if (fd != -1)
+		close(fd);
+
+	if ((auth_db = auth_load(auth_file)) == NULL)
+		errxv(0, 1, "Error loading credentials from %s", auth_file);
+}
+
+/*
+ * Returns 0 if pass is the password of user.
+ */
+int
+auth_check(const char *user, const char *pass)
+{
+	struct auth_user *au;
+	struct auth_cache *ac = NULL;
+	u_int64_t tag = 0;
+	time_t now;
+	char *hash;
+
+	if ((au = auth_lookup(user)) == NULL) {
+		/* Take as long as for a user that exists */
+		if (auth_db->dummy != NULL)
+			crypt(pass, auth_db->dummy);
+		return (-1);
+	}
+
+	now = time(NULL);
+	if (auth_db->cache != NULL) {
+		ac = &auth_db->cache[au->slot];
+		tag = auth_siphash(pass, strlen(pass));
+		if (ac->tag == tag && ac->expires > now)
+			return (0);
+	}
+
+	if ((hash = crypt(pass, au->hash)) == NULL ||
+	    auth_cmp(hash, au->hash) != 0)
+		return (-1);
+
+	if (ac != NULL) {
+		ac->tag = tag;
+		ac->expires = now + auth_cache_time;
+	}
+
+	return (0);
+}
+
+static struct auth_db *
+auth_load(const char *path)
+{
+	struct auth_db *db;
+	struct auth_user *au;
+	char line[1024], *name, *hash, *p;
+	u_int lineno = 0, h;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		warnv(0, "%s", path);
+		return (NULL);
+	}
+
+	if ((db = calloc(1, sizeof(*db))) == NULL) {
+		warnv(0, "calloc()");
+		fclose(fp);
+		return (NULL);
+	}
+	for (h = 0; h < AUTH_HASHSZ; h++)
+		TAILQ_INIT(&db->users[h]);
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+
+		p = line;
+		name = strsep(&p, ":");
+		hash = strsep(&p, ":");
+		if (hash == NULL || *name == '\0' || *hash == '\0' ||
+		    strlen(name) > 255) {
+			warnxv(0, "%s:%u: Bad credential line", path, lineno);
+			continue;
+		}
+
+		h = auth_siphash(name, strlen(name)) % AUTH_HASHSZ;
+		TAILQ_FOREACH(au, &db->users[h], next)
+			if (strcmp(au->name, name) == 0)
+				break;
+		if (au != NULL) {
+			warnxv(0, "%s:%u: Duplicate user %s", path, lineno,
+			    name);
+			continue;
+		}
+
+		if ((au = calloc(1, sizeof(*au))) == NULL ||
+		    (au->name = strdup(name)) == NULL ||
+		    (au->hash = strdup(hash)) == NULL) {
+			warnv(0, "strdup()");
+			if (au != NULL) {
+				free(au->name);
+				free(au);
+			}
+			goto fail;
+		}
+		au->slot = db->nusers++;
+		db->dummy = au->hash;
+		TAILQ_INSERT_TAIL(&db->users[h], au, next);
+	}
+
+	if (ferror(fp)) {
+		warnv(0, "%s", path);
+		goto fail;
+	}
+	fclose(fp);
+
+	if (auth_cache_time > 0 && db->nusers > 0) {
+		db->cachesz = db->nusers * sizeof(*db->cache);
+		db->cache = mmap(NULL, db->cachesz, PROT_READ | PROT_WRITE,
+		    MAP_ANON | MAP_SHARED, -1, 0);
+		if (db->cache == MAP_FAILED) {
+			warnv(0, "mmap()");
+			db->cache = NULL;
+		}
+	}
+
+	warnxv(1, "Loaded %u users from %s", db->nusers, path);
+
+	return (db);
+
+ fail:
+	fclose(fp);
+	auth_free(db);
+	return (NULL);
+}
+
+static void
+auth_free(struct auth_db *db)
+{
+	struct auth_user *au;
+	u_int h;
+
+	for (h = 0; h < AUTH_HASHSZ; h++)
+		while ((au = TAILQ_FIRST(&db->users[h])) != NULL) {
+			TAILQ_REMOVE(&db->users[h], au, next);
+			free(au->name);
+			free(au->hash);
+			free(au);
+		}
+
+	if (db->cache != NULL)
+		munmap(db->cache, db->cachesz);
+	free(db);
+}
+
+static struct auth_user *
+auth_lookup(const char *name)
+{
+	struct auth_user *au;
+	u_int h;
+
+	h = auth_siphash(name, strlen(name)) % AUTH_HASHSZ;
+	TAILQ_FOREACH(au, &auth_db->users[h], next)
+		if (strcmp(au->name, name) == 0)
+			return (au);
+
+	return (NULL);
+}
+
+/* Compare without giving away where the first difference is */
+static int
+auth_cmp(const char *a, const char *b)
+{
+	size_t alen = strlen(a), blen = strlen(b), i;
+	u_char diff = alen != blen;
+
+	for (i = 0; i < alen && i < blen; i++)
+		diff |= a[i] ^ b[i];
+
+	return (diff);
+}
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND do {							\
+	v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32);	\
+	v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;				\
+	v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;				\
+	v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32);	\
+} while (0)
+
+/* SipHash-2-4 */
+static u_int64_t
+auth_siphash(const void *data, size_t len)
+{
+	const u_char *p = data;
+	u_int64_t v0 = 0x736f6d6570736575ULL ^ auth_key[0];
+	u_int64_t v1 = 0x646f72616e646f6dULL ^ auth_key[1];
+	u_int64_t v2 = 0x6c7967656e657261ULL ^ auth_key[0];
+	u_int64_t v3 = 0x7465646279746573ULL ^ auth_key[1];
+	u_int64_t m;
+	size_t i, total = len;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		for (m = 0, i = 0; i < 8; i++)
+			m |= (u_int64_t)p[i] << (8 * i);
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	for (m = (u_int64_t)(total & 0xff) << 56, i = 0; i < len; i++)
+		m |= (u_int64_t)p[i] << (8 * i);
+	v3 ^= m;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= m;
+
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+
+	return (v0 ^ v1 ^ v2 ^ v3);
+}
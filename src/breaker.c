@@ -0,0 +1,162 @@
+/*
+ * breaker.c
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "breaker.h"
+#include "print.h"
+
+/*
+ * Remembers destinations that keep failing to connect.  Once one has
+ * failed breaker_failures times in a row, connects to it fail at once
+ * for breaker_time seconds; then a single connect is let through to
+ * probe it, and either closes the breaker or trips it for another
+ * period.  The table is shared by all children, so one child's
+ * timeouts spare the others.  Updates are not locked: a race costs at
+ * most an extra probe or a failure counted twice.
+ */
+
+int breaker_failures;
+int breaker_time = 30;
+
+static struct breaker_entry *breaker_table;
+
+static struct breaker_entry *breaker_find(struct sockaddr_in *, int);
+
+void
+breaker_setup(void)
+{
+	breaker_table = mmap(NULL, BREAKER_SETS * BREAKER_WAYS *
+	    sizeof(*breaker_table), PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_SHARED, -1, 0);
+	if (breaker_table == MAP_FAILED)
+		errv(0, 1, "mmap()");
+}
+
+/*
+ * Returns 0 if a connect to in should fail right away.
+ */
+int
+breaker_allow(struct sockaddr_in *in)
+{
+	struct breaker_entry *be;
+	time_t now;
+
+	if (breaker_table == NULL ||
+	    (be = breaker_find(in, 0)) == NULL ||
+	    be->failures < breaker_failures)
+		return (1);
+
+	now = time(NULL);
+	if (be->until > now)
+		return (0);
+
+	/* Half open: this one probes, the rest keep failing */
+	be->until = now + breaker_time;
+	warnxv(2, "Probing %s:%d", inet_ntoa(in->sin_addr),
+	    ntohs(in->sin_port));
+
+	return (1);
+}
+
+/*
+ * Note how a connect to in went: error is 0 or its errno.  Only
+ * errors that cost a wait or say the host is gone count; a refusal
+ * comes back quickly anyway.
+ */
+void
+breaker_done(struct sockaddr_in *in, int error)
+{
+	struct breaker_entry *be;
+
+	if (breaker_table == NULL)
+		return;
+
+	switch (error) {
+	case ETIMEDOUT:
+	case EINPROGRESS:	/* SO_SNDTIMEO ran out */
+	case EHOSTUNREACH:
+	case ENETUNREACH:
+		break;
+	case 0:
+		if ((be = breaker_find(in, 0)) != NULL) {
+			if (be->failures >= breaker_failures)
+				warnxv(1, "%s:%d reachable again",
+				    inet_ntoa(in->sin_addr),
+				    ntohs(in->sin_port));
+			memset(be, 0, sizeof(*be));
+		}
+		return;
+	default:
+		return;
+	}
+
+	if ((be = breaker_find(in, 1)) == NULL)
+		return;
+
+	be->last = time(NULL);
+	if (be->failures < 0xffff)
+		be->failures++;
+	if (be->failures >= breaker_failures) {
+		if (be->failures == breaker_failures)
+			warnxv(1, "%s:%d unreachable; failing fast for %d "
+			    "seconds", inet_ntoa(in->sin_addr),
+			    ntohs(in->sin_port), breaker_time);
+		be->until = be->last + breaker_time;
+	}
+}
+
+/*
+ * Each destination hashes to a set of a few entries.  With create, a
+ * destination not there takes a free entry, or the one that failed
+ * longest ago.
+ */
+static struct breaker_entry *
+breaker_find(struct sockaddr_in *in, int create)
+{
+	struct breaker_entry *set, *be, *victim = NULL;
+	u_int32_t h;
+	int i;
+
+	h = (ntohl(in->sin_addr.s_addr) ^ ntohs(in->sin_port) << 16) *
+	    2654435769U;
+	set = &breaker_table[(h >> 16) % BREAKER_SETS * BREAKER_WAYS];
+
+	for (i = 0; i < BREAKER_WAYS; i++) {
+		be = &set[i];
+		if (be->failures > 0 &&
+		    be->addr == in->sin_addr.s_addr &&
+		    be->port == in->sin_port)
+			return (be);
+		if (victim == NULL || (victim->failures > 0 &&
+		    (be->failures == 0 || be->last < victim->last)))
+			victim = be;
+	}
+
+	if (!create)
+		return (NULL);
+
+	memset(victim, 0, sizeof(*victim));
+	victim->addr = in->sin_addr.s_addr;
+	victim->port = in->sin_port;
+
+	return (victim);
+}
@@ -0,0 +1,471 @@
+/*
+ * capture.c
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "dest.h"
+#include "expanda.h"
+#include "net.h"
+#include "print.h"
+#include "stats.h"
+#include "capture.h"
+#include "writer.h"
+
+/*
+ * Payload capture for a sample of connections, or those to chosen
+ * destinations.  A child that captures keeps what it relays in a
+ * ring of its own, as pcapng packet blocks, overwriting the oldest
+ * when the ring is full.  The ring is handed to a writer process
+ * through a socket pair when it is half full, every second, and on
+ * exit, without waiting for the writer except on exit; without a
+ * writer, the child appends to the file itself.  Connections not
+ * captured only pay for a test in the relay.
+ *
+ * Each read becomes an IPv4/TCP packet between the client and the
+ * target with running sequence numbers, so that tools can follow the
+ * stream; the TCP checksum is left out.
+ */
+
+#define CAPTURE_CHUNK (32 * 1024)	/* Largest message to the writer */
+#define CAPTURE_EPBSZ 32		/* Packet block without the data */
+#define CAPTURE_HDRSZ 40		/* IPv4 and TCP headers */
+#define CAPTURE_MAXPKT 8192		/* Payload per packet */
+
+#define LINKTYPE_RAW 101
+
+char *capture_file;
+char *capture_filter;
+int   capture_sample;
+int   capture_bytes = 65536;
+int   capture_buffer = 256;
+
+static struct dest_table *capture_rules;
+static int                capture_match;	/* Value in capture_rules */
+static int                capture_sock = -1;	/* To the writer */
+static int                capture_fd = -1;	/* Without one */
+static u_char             capture_buf[8 * CAPTURE_CHUNK];	/* Writer */
+static size_t             capture_off;
+
+/* In a child that captures */
+static struct negdesc    *capture_nd;
+static u_char            *capture_ring;
+static size_t             capture_size;
+static size_t             capture_head;	/* Oldest block */
+static size_t             capture_tail;	/* Where the next goes */
+static size_t             capture_end;	/* Of the blocks before tail */
+static int                capture_wrapped;
+static u_int32_t          capture_seq[2];
+static size_t             capture_left[2];
+static u_int              capture_dropped;
+static struct event       capture_ev;
+
+static void   capture_header(void);
+static void   capture_writer(int);
+static void   capture_take(u_char *, size_t);
+static void   capture_write(void);
+static void   capture_exit(void);
+static void   capture_timer(int, short, void *);
+static void   capture_put(u_char *, size_t);
+static void   capture_flush(int);
+static size_t capture_used(void);
+static size_t capture_blocklen(size_t);
+
+void
+capture_setup(void)
+{
+	char **arr, **a;
+
+	if (capture_filter != NULL && *capture_filter != '\0') {
+		if ((capture_rules = dest_new()) == NULL)
+			errv(0, 1, "dest_new()");
+		if ((arr = expanda(capture_filter)) == NULL)
+			errxv(0, 1, "Error expanding capture filter");
+		for (a = arr; *a != NULL; a++)
+			if (dest_add(capture_rules, *a, &capture_match) == -1)
+				errxv(0, 1, "Bad or duplicate destination: %s",
+				    *a);
+		freea(arr);
+	}
+	if (capture_rules == NULL && capture_sample <= 0)
+		warnxv(0, "Neither Capture-Filter nor Capture-Sample given; "
+		    "capturing nothing");
+	if (capture_buffer <= 0)
+		errxv(0, 1, "Bad Capture-Buffer: %d", capture_buffer);
+
+	/* Only dumping, with verbose_dump */
+	if (capture_file == NULL)
+		return;
+
+	if ((capture_fd = open(capture_file,
+		 O_WRONLY | O_APPEND | O_CREAT, 0640)) == -1)
+		errv(0, 1, "open(): %s", capture_file);
+
+	if ((capture_sock = writer_spawn("the capture", 4 * CAPTURE_CHUNK,
+		 capture_writer)) == -1) {
+		/* A restart on SIGHUP opens it again */
+		fcntl(capture_fd, F_SETFD, FD_CLOEXEC);
+		capture_header();
+	} else {
+		close(capture_fd);
+		capture_fd = -1;
+	}
+
+	warnxv(1, "Capturing to %s", capture_file);
+}
+
+/*
+ * In a child about to relay for nd: returns 1 if it is to capture.
+ */
+int
+capture_start(struct negdesc *nd)
+{
+	struct timeval tv;
+	extern int verbose_dump;
+
+	if (capture_sock == -1 && capture_fd == -1 && !verbose_dump)
+		return (0);
+
+	if (capture_sample > 0)
+		srandom(getpid() ^ time(NULL));
+	if ((capture_rules == NULL || nd->rem_in.sin_family != AF_INET ||
+		dest_lookup(capture_rules, &nd->rem_in,
+		    nd->rem_host) == NULL) &&
+	    (capture_sample <= 0 || random() % capture_sample != 0))
+		return (0);
+
+	capture_nd = nd;
+	capture_seq[0] = capture_seq[1] = 1;
+	capture_left[0] = capture_left[1] = capture_bytes;
+
+	if (capture_sock == -1 && capture_fd == -1)
+		return (1);
+
+	capture_size = (size_t)capture_buffer * 1024;
+	if ((capture_ring = malloc(capture_size)) == NULL) {
+		warnv(0, "malloc()");
+		return (0);
+	}
+
+	if (atexit(capture_exit) != 0)
+		warnv(0, "atexit()");
+
+	evtimer_set(&capture_ev, capture_timer, NULL);
+	timerclear(&tv);
+	tv.tv_sec = 1;
+	evtimer_add(&capture_ev, &tv);
+
+	return (1);
+}
+
+/*
+ * Len bytes read from one side, at buf.
+ */
+void
+capture_data(int from, u_char *buf, size_t len)
+{
+	static u_char blk[CAPTURE_EPBSZ + CAPTURE_HDRSZ + CAPTURE_MAXPKT];
+	struct sockaddr_in *src, *dst;
+	struct timeval tv;
+	u_int32_t v32, caplen, blklen;
+	u_int16_t v16, *ip;
+	u_char *p;
+	size_t n;
+	u_int sum;
+	int i;
+	extern int verbose_dump;
+
+	if (capture_left[from] == 0)
+		return;
+	if (len > capture_left[from])
+		len = capture_left[from];
+	capture_left[from] -= len;
+
+	if (verbose_dump)
+		print_dump(buf, len);
+	if (capture_ring == NULL)
+		return;
+
+	if (from == CAPTURE_FROM_CLIENT) {
+		src = &capture_nd->cli_in;
+		dst = &capture_nd->rem_in;
+	} else {
+		src = &capture_nd->rem_in;
+		dst = &capture_nd->cli_in;
+	}
+
+	gettimeofday(&tv, NULL);
+
+	for (; len > 0; buf += n, len -= n) {
+		n = len < CAPTURE_MAXPKT ? len : CAPTURE_MAXPKT;
+		caplen = CAPTURE_HDRSZ + n;
+		blklen = CAPTURE_EPBSZ + ((caplen + 3) & ~3);
+
+		/* Enhanced packet block, in host byte order */
+		p = blk;
+		memset(p, 0, blklen);
+		v32 = 6;
+		memcpy(p, &v32, 4);
+		memcpy(p + 4, &blklen, 4);
+		v32 = ((u_int64_t)tv.tv_sec * 1000000 + tv.tv_usec) >> 32;
+		memcpy(p + 12, &v32, 4);
+		v32 = (u_int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+		memcpy(p + 16, &v32, 4);
+		memcpy(p + 20, &caplen, 4);
+		memcpy(p + 24, &caplen, 4);
+		memcpy(p + blklen - 4, &blklen, 4);
+
+		/* IPv4 header */
+		p += 28;
+		p[0] = 0x45;
+		v16 = htons(caplen);
+		memcpy(p + 2, &v16, 2);
+		p[6] = 0x40;		/* Don't fragment */
+		p[8] = 64;
+		p[9] = IPPROTO_TCP;
+		memcpy(p + 12, &src->sin_addr, 4);
+		memcpy(p + 16, &dst->sin_addr, 4);
+		ip = (u_int16_t *)p;
+		for (sum = 0, i = 0; i < 10; i++)
+			sum += ntohs(ip[i]);
+		sum = (sum >> 16) + (sum & 0xffff);
+		sum += sum >> 16;
+		v16 = htons(~sum & 0xffff);
+		memcpy(p + 10, &v16, 2);
+
+		/* TCP header, PSH and ACK */
+		p += 20;
+		memcpy(p, &src->sin_port, 2);
+		memcpy(p + 2, &dst->sin_port, 2);
+		v32 = htonl(capture_seq[from]);
+		memcpy(p + 4, &v32, 4);
+		v32 = htonl(capture_seq[!from]);
+		memcpy(p + 8, &v32, 4);
+		p[12] = 5 << 4;
+		p[13] = 0x18;
+		v16 = htons(65535);
+		memcpy(p + 14, &v16, 2);
+		memcpy(p + 20, buf, n);
+		capture_seq[from] += n;
+
+		capture_put(blk, blklen);
+	}
+
+	if (capture_used() >= capture_size / 2)
+		capture_flush(0);
+}
+
+/*
+ * Into the ring, after the newest block.  Blocks never wrap around;
+ * the ring ends early at capture_end instead.
+ */
+static void
+capture_put(u_char *blk, size_t len)
+{
+	if (len > capture_size) {
+		capture_dropped++;
+		return;
+	}
+
+	for (;;) {
+		if (capture_wrapped && capture_head == capture_end) {
+			capture_head = 0;
+			capture_wrapped = 0;
+		}
+		if (!capture_wrapped) {
+			if (capture_tail + len <= capture_size)
+				break;
+			capture_end = capture_tail;
+			capture_tail = 0;
+			capture_wrapped = 1;
+			continue;
+		}
+		if (capture_tail + len <= capture_head)
+			break;
+		/* Make room over the oldest */
+		capture_head += capture_blocklen(capture_head);
+		capture_dropped++;
+	}
+
+	memcpy(capture_ring + capture_tail, blk, len);
+	capture_tail += len;
+}
+
+static size_t
+capture_blocklen(size_t off)
+{
+	u_int32_t len;
+
+	memcpy(&len, capture_ring + off + 4, 4);
+	return (len);
+}
+
+static size_t
+capture_used(void)
+{
+	if (capture_wrapped)
+		return (capture_end - capture_head + capture_tail);
+	return (capture_tail - capture_head);
+}
+
+/*
+ * Hand the oldest blocks to the writer, as many whole blocks at a
+ * time as fit in a message.  Stops when the writer has no room,
+ * unless told to wait.
+ */
+static void
+capture_flush(int wait)
+{
+	size_t limit, n;
+	ssize_t ret;
+
+	while (capture_sock != -1 || capture_fd != -1) {
+		if (capture_wrapped && capture_head == capture_end) {
+			capture_head = 0;
+			capture_wrapped = 0;
+		}
+		if (!capture_wrapped && capture_head == capture_tail) {
+			capture_head = capture_tail = 0;
+			break;
+		}
+
+		limit = capture_wrapped ? capture_end : capture_tail;
+		for (n = 0; capture_head + n < limit &&
+		    n + capture_blocklen(capture_head + n) <= CAPTURE_CHUNK;
+		    n += capture_blocklen(capture_head + n))
+			;
+
+		if (capture_sock == -1) {
+			if (write(capture_fd, capture_ring + capture_head,
+				n) == -1) {
+				warnv(1, "write(): %s", capture_file);
+				capture_fd = -1;
+				break;
+			}
+			capture_head += n;
+			continue;
+		}
+
+		do
+			ret = send(capture_sock, capture_ring + capture_head, n,
+			    MSG_NOSIGNAL | (wait ? 0 : MSG_DONTWAIT));
+		while (ret == -1 && errno == EINTR);
+
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == ENOBUFS)
+				break;
+			warnv(1, "Capture writer gone");
+			close(capture_sock);
+			capture_sock = -1;
+			break;
+		}
+		capture_head += n;
+	}
+}
+
+static void
+capture_timer(int fd, short ev, void *data)
+{
+	struct timeval tv;
+
+	capture_flush(0);
+
+	timerclear(&tv);
+	tv.tv_sec = 1;
+	evtimer_add(&capture_ev, &tv);
+}
+
+static void
+capture_exit(void)
+{
+	capture_flush(1);
+	if (capture_dropped > 0)
+		warnxv(1, "Capture: %u packets dropped", capture_dropped);
+}
+
+/*
+ * The writer: starts a new section in the file, then appends the
+ * blocks it gets, a batch at a time.
+ */
+static void
+capture_writer(int sock)
+{
+	capture_header();
+	writer_loop(sock, CAPTURE_CHUNK, sizeof(capture_buf) / CAPTURE_CHUNK,
+	    capture_take, capture_write);
+}
+
+static void
+capture_take(u_char *blks, size_t len)
+{
+	memcpy(capture_buf + capture_off, blks, len);
+	capture_off += len;
+}
+
+static void
+capture_write(void)
+{
+	if (capture_off > 0 && write(capture_fd, capture_buf,
+		capture_off) == -1)
+		warnv(0, "write(): %s", capture_file);
+	capture_off = 0;
+}
+
+/* A new section, for this run */
+static void
+capture_header(void)
+{
+	u_char hdr[28 + 20];
+	u_int32_t v32;
+	u_int16_t v16;
+	int64_t v64 = -1;
+
+	/* Section header block */
+	memset(hdr, 0, sizeof(hdr));
+	v32 = 0x0a0d0d0a;
+	memcpy(hdr, &v32, 4);
+	v32 = 28;
+	memcpy(hdr + 4, &v32, 4);
+	memcpy(hdr + 24, &v32, 4);
+	v32 = 0x1a2b3c4d;
+	memcpy(hdr + 8, &v32, 4);
+	v16 = 1;
+	memcpy(hdr + 12, &v16, 2);
+	memcpy(hdr + 16, &v64, 8);	/* Length not known */
+
+	/* Interface description block */
+	v32 = 1;
+	memcpy(hdr + 28, &v32, 4);
+	v32 = 20;
+	memcpy(hdr + 32, &v32, 4);
+	memcpy(hdr + 44, &v32, 4);
+	v16 = LINKTYPE_RAW;
+	memcpy(hdr + 36, &v16, 2);
+
+	if (write(capture_fd, hdr, sizeof(hdr)) == -1)
+		warnv(0, "write(): %s", capture_file);
+}
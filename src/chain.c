@@ -0,0 +1,550 @@
+/*
+ * chain.c
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <event.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "cleanup.h"
+#include "expanda.h"
+#include "net.h"
+#include "chain.h"
+#include "print.h"
+#include "socks5.h"
+
+/* Handshake deadline when no Connect-Timeout is set */
+#define CHAIN_TIMEOUT       30
+#define CHAIN_PROBE_TIMEOUT 5
+
+/*
+ * Outgoing connections are made through one of a list of upstream
+ * SOCKS5 proxies, trying the others in turn if it fails.  The
+ * listening process keeps a moving average of how long each upstream
+ * takes to answer a greeting; children inherit it when they fork and
+ * try the quickest upstream that is up first.
+ */
+int chain_check_interval = 10;
+
+extern cleanup_t *cleanup;
+
+static int  chain_hopcmp(const void *, const void *);
+static int  chain_negotiate(struct conndesc *, struct chain_hop *,
+                struct sockaddr *, socklen_t, struct timeval *, int *);
+static int  chain_io(int, u_char *, size_t, int, struct timeval *);
+static void chain_probe(int, short, void *);
+static void chain_probe_write(int, short, void *);
+static void chain_probe_read(int, short, void *);
+static void chain_probe_result(struct chain_hop *, int);
+static void chain_probe_schedule(struct chain_hop *, int);
+static void chain_cleanup(void *);
+
+/*
+ * addrs is a list of "host:port" upstream SOCKS5 proxies.
+ */
+struct chain *
+chain_new(char *addrs)
+{
+	struct chain *ch;
+	struct chain_hop *hop;
+	char **arr, **a;
+
+	if ((ch = calloc(1, sizeof(*ch))) == NULL)
+		errv(0, 1, "calloc()");
+
+	if ((arr = expanda(addrs)) == NULL)
+		errxv(0, 1, "Error expanding upstream address list");
+
+	for (a = arr; *a != NULL; a++)
+		ch->nhops++;
+	if (ch->nhops == 0)
+		errxv(0, 1, "Empty upstream address list");
+
+	if ((ch->hops = calloc(ch->nhops, sizeof(*ch->hops))) == NULL)
+		errv(0, 1, "calloc()");
+
+	for (a = arr, hop = ch->hops; *a != NULL; a++, hop++) {
+		hop->chain = ch;
+		hop->up = 1;
+		hop->probesock = -1;
+		if ((hop->ai = get_ai_from_addrpair(*a)) == NULL)
+			errxv(0, 1, "Error resolving host:pair address");
+		if ((hop->name = strdup(*a)) == NULL)
+			errv(0, 1, "strdup()");
+	}
+
+	freea(arr);
+
+	return (ch);
+}
+
+void
+chain_start(struct chain *ch, struct conndesc *conn)
+{
+	int i;
+
+	ch->conn = conn;
+
+	if (cleanup_add(cleanup, chain_cleanup, ch) == -1)
+		errxv(0, 1, "cleanup_add()");
+
+	if (chain_check_interval <= 0)
+		return;
+
+	for (i = 0; i < ch->nhops; i++)
+		chain_probe_schedule(&ch->hops[i], 0);
+}
+
+void
+chain_report(struct chain *ch)
+{
+	struct chain_hop *hop;
+	int i;
+
+	for (i = 0; i < ch->nhops; i++) {
+		hop = &ch->hops[i];
+		warnxv(0, "Upstream %s: %s, handshake %u.%03u ms, "
+		    "%u/%u probes failed", hop->name, hop->up ? "up" : "down",
+		    hop->rtt / 1000, hop->rtt % 1000, hop->probefails,
+		    hop->probes);
+	}
+}
+
+/*
+ * Connect to sa through the upstream proxies.  Runs in the process
+ * serving the client; the upstream handshake is done on a
+ * non-blocking socket so that a stalled upstream only costs the
+ * remainder of the deadline before the next one is tried.
+ */
+int
+chain_connect(struct conndesc *conn, struct sockaddr *sa, socklen_t salen)
+{
+	struct chain *ch = conn->chain;
+	struct chain_hop **order;
+	struct timeval deadline;
+	int i, sock = -1, final = 0;
+	extern int connect_timeout;
+
+	if ((order = calloc(ch->nhops, sizeof(*order))) == NULL) {
+		warnv(0, "calloc()");
+		return (-1);
+	}
+	for (i = 0; i < ch->nhops; i++)
+		order[i] = &ch->hops[i];
+	qsort(order, ch->nhops, sizeof(*order), chain_hopcmp);
+
+	gettimeofday(&deadline, NULL);
+	deadline.tv_sec += connect_timeout > 0 ? connect_timeout : CHAIN_TIMEOUT;
+
+	for (i = 0; i < ch->nhops && sock == -1 && !final; i++)
+		if ((sock = chain_negotiate(conn, order[i], sa, salen,
+			 &deadline, &final)) == -1)
+			warnv(1, "Upstream %s", order[i]->name);
+
+	free(order);
+
+	return (sock);
+}
+
+/* Upstreams that are up first, quickest first */
+static int
+chain_hopcmp(const void *_a, const void *_b)
+{
+	const struct chain_hop *a = *(struct chain_hop **)_a;
+	const struct chain_hop *b = *(struct chain_hop **)_b;
+
+	if (a->up != b->up)
+		return (b->up - a->up);
+	if (a->rtt != b->rtt)
+		return (a->rtt < b->rtt ? -1 : 1);
+	return (a < b ? -1 : 1);
+}
+
+/*
+ * Run a SOCKS5 CONNECT to sa through one upstream.  *final is set
+ * when the upstream itself refused the request, as asking another
+ * upstream is unlikely to help.
+ */
+static int
+chain_negotiate(struct conndesc *conn, struct chain_hop *hop,
+    struct sockaddr *sa, socklen_t salen, struct timeval *deadline,
+    int *final)
+{
+	u_char buf[32];
+	size_t len;
+	socklen_t errlen;
+	int sock, flags, error, xerrno;
+
+	if ((sock = net_socket(conn, hop->ai->ai_addr, NULL)) == -1)
+		return (-1);
+
+	if ((flags = fcntl(sock, F_GETFL)) == -1 ||
+	    fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1)
+		goto fail;
+
+	if (connect(sock, hop->ai->ai_addr, hop->ai->ai_addrlen) == -1) {
+		if (errno != EINPROGRESS ||
+		    chain_io(sock, NULL, 0, POLLOUT, deadline) == -1)
+			goto fail;
+		errlen = sizeof(error);
+		if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error,
+			&errlen) == -1)
+			goto fail;
+		if (error != 0) {
+			errno = error;
+			goto fail;
+		}
+	}
+
+	/* Greeting; no authentication */
+	buf[0] = 0x05;
+	buf[1] = 0x01;
+	buf[2] = 0x00;
+	if (chain_io(sock, buf, 3, POLLOUT, deadline) == -1 ||
+	    chain_io(sock, buf, 2, POLLIN, deadline) == -1)
+		goto fail;
+	if (buf[0] != 0x05 || buf[1] != 0x00) {
+		errno = EPROTO;
+		goto fail;
+	}
+
+	buf[0] = 0x05;
+	buf[1] = 0x01;
+	buf[2] = 0x00;
+	switch (sa->sa_family) {
+	case AF_INET: {
+		struct sockaddr_in *sin = (struct sockaddr_in *)sa;
+
+		buf[3] = 0x01;
+		memcpy(buf + 4, &sin->sin_addr, 4);
+		memcpy(buf + 8, &sin->sin_port, 2);
+		len = 10;
+		break;
+	}
+	case AF_INET6: {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)sa;
+
+		buf[3] = 0x04;
+		memcpy(buf + 4, &sin6->sin6_addr, 16);
+		memcpy(buf + 20, &sin6->sin6_port, 2);
+		len = 22;
+		break;
+	}
+	default:
+		errno = EAFNOSUPPORT;
+		goto fail;
+	}
+
+	if (chain_io(sock, buf, len, POLLOUT, deadline) == -1 ||
+	    chain_io(sock, buf, 5, POLLIN, deadline) == -1)
+		goto fail;
+	if (buf[0] != 0x05) {
+		errno = EPROTO;
+		goto fail;
+	}
+
+	switch (buf[1]) {
+	case 0x00:
+		break;
+	case 0x02:
+	case 0x03:
+	case 0x04:
+	case 0x05:
+		/* Another hop would get the same answer */
+		*final = 1;
+		errno = socks5_errno(buf[1]);
+		goto fail;
+	default:
+		errno = ECONNABORTED;
+		goto fail;
+	}
+
+	/* Rest of BND.ADDR and BND.PORT; one byte has been read */
+	switch (buf[3]) {
+	case 0x01:
+		len = 4 + 2 - 1;
+		break;
+	case 0x04:
+		len = 16 + 2 - 1;
+		break;
+	case 0x03:
+		len = buf[4] + 2;
+		break;
+	default:
+		errno = EPROTO;
+		goto fail;
+	}
+	if (chain_io(sock, buf, len, POLLIN, deadline) == -1)
+		goto fail;
+
+	if (fcntl(sock, F_SETFL, flags) == -1)
+		goto fail;
+
+	return (sock);
+
+ fail:
+	xerrno = errno;
+	close(sock);
+	errno = xerrno;
+	return (-1);
+}
+
+/*
+ * Read or write exactly len bytes before the deadline.  With len 0,
+ * just wait for the socket to become ready.
+ */
+static int
+chain_io(int sock, u_char *buf, size_t len, int events, struct timeval *deadline)
+{
+	struct pollfd pfd;
+	struct timeval now, tv;
+	size_t off = 0;
+	ssize_t ret;
+
+	for (;;) {
+		gettimeofday(&now, NULL);
+		if (!timercmp(&now, deadline, <)) {
+			errno = ETIMEDOUT;
+			return (-1);
+		}
+		timersub(deadline, &now, &tv);
+
+		pfd.fd = sock;
+		pfd.events = events;
+		switch (poll(&pfd, 1, tv.tv_sec * 1000 + tv.tv_usec / 1000 + 1)) {
+		case -1:
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		case 0:
+			continue;
+		default:
+			break;
+		}
+
+		if (len == 0)
+			return (0);
+
+		if (events == POLLIN)
+			ret = recv(sock, buf + off, len - off, 0);
+		else
+			ret = send(sock, buf + off, len - off, 0);
+
+		if (ret == 0) {
+			errno = ECONNRESET;
+			return (-1);
+		}
+		if (ret == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return (-1);
+		}
+		if ((off += ret) == len)
+			return (0);
+	}
+}
+
+static void
+chain_probe_schedule(struct chain_hop *hop, int secs)
+{
+	struct timeval tv;
+
+	timerclear(&tv);
+	tv.tv_sec = secs;
+
+	evtimer_set(&hop->probeev, chain_probe, hop);
+	if (evtimer_add(&hop->probeev, &tv) == -1)
+		warnv(0, "evtimer_add()");
+}
+
+/*
+ * Time a SOCKS5 greeting with each upstream, from the listening
+ * process's event loop.
+ */
+static void
+chain_probe(int fd, short ev, void *data)
+{
+	struct chain_hop *hop = data;
+	struct timeval tv;
+	int sock;
+
+	if ((sock = net_socket(hop->chain->conn, hop->ai->ai_addr,
+		 NULL)) == -1) {
+		chain_probe_schedule(hop, chain_check_interval);
+		return;
+	}
+
+	gettimeofday(&hop->probestart, NULL);
+
+	if (fcntl(sock, F_SETFL, O_NONBLOCK) == -1 ||
+	    (connect(sock, hop->ai->ai_addr, hop->ai->ai_addrlen) == -1 &&
+		errno != EINPROGRESS)) {
+		warnv(2, "Probe for upstream %s", hop->name);
+		close(sock);
+		chain_probe_result(hop, 0);
+		return;
+	}
+
+	hop->probesock = sock;
+	hop->probelen = 0;
+
+	timerclear(&tv);
+	tv.tv_sec = CHAIN_PROBE_TIMEOUT;
+
+	event_set(&hop->probeev, sock, EV_WRITE, chain_probe_write, hop);
+	if (event_add(&hop->probeev, &tv) == -1) {
+		warnv(0, "event_add()");
+		chain_probe_result(hop, 0);
+	}
+}
+
+static void
+chain_probe_write(int fd, short ev, void *data)
+{
+	struct chain_hop *hop = data;
+	u_char greeting[] = { 0x05, 0x01, 0x00 };
+	struct timeval tv;
+	socklen_t len;
+	int error = ETIMEDOUT;
+
+	if (ev & EV_WRITE) {
+		len = sizeof(error);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+			error = errno;
+	}
+
+	if (error == 0 &&
+	    send(fd, greeting, sizeof(greeting), 0) != sizeof(greeting))
+		error = errno;
+
+	if (error != 0) {
+		errno = error;
+		warnv(2, "Probe for upstream %s", hop->name);
+		chain_probe_result(hop, 0);
+		return;
+	}
+
+	timerclear(&tv);
+	tv.tv_sec = CHAIN_PROBE_TIMEOUT;
+
+	event_set(&hop->probeev, fd, EV_READ, chain_probe_read, hop);
+	if (event_add(&hop->probeev, &tv) == -1) {
+		warnv(0, "event_add()");
+		chain_probe_result(hop, 0);
+	}
+}
+
+static void
+chain_probe_read(int fd, short ev, void *data)
+{
+	struct chain_hop *hop = data;
+	struct timeval tv;
+	ssize_t ret;
+
+	if (ev & EV_TIMEOUT) {
+		warnxv(2, "Probe for upstream %s timed out", hop->name);
+		chain_probe_result(hop, 0);
+		return;
+	}
+
+	ret = recv(fd, hop->probebuf + hop->probelen,
+	    sizeof(hop->probebuf) - hop->probelen, 0);
+	if (ret == -1 && (errno == EINTR || errno == EAGAIN))
+		ret = 0;
+	else if (ret <= 0) {
+		chain_probe_result(hop, 0);
+		return;
+	}
+	hop->probelen += ret;
+
+	if (hop->probelen < sizeof(hop->probebuf)) {
+		timerclear(&tv);
+		tv.tv_sec = CHAIN_PROBE_TIMEOUT;
+		if (event_add(&hop->probeev, &tv) == -1) {
+			warnv(0, "event_add()");
+			chain_probe_result(hop, 0);
+		}
+		return;
+	}
+
+	chain_probe_result(hop,
+	    hop->probebuf[0] == 0x05 && hop->probebuf[1] == 0x00);
+}
+
+static void
+chain_probe_result(struct chain_hop *hop, int ok)
+{
+	struct timeval now, tv;
+	u_int rtt;
+
+	if (hop->probesock != -1) {
+		close(hop->probesock);
+		hop->probesock = -1;
+	}
+
+	hop->probes++;
+
+	if (ok) {
+		gettimeofday(&now, NULL);
+		timersub(&now, &hop->probestart, &tv);
+		rtt = tv.tv_sec * 1000000 + tv.tv_usec;
+
+		/* Weight of 1/4 for the latest sample */
+		if (hop->rtt == 0)
+			hop->rtt = rtt;
+		else
+			hop->rtt = hop->rtt - hop->rtt / 4 + rtt / 4;
+
+		if (!hop->up)
+			warnxv(0, "Upstream %s is up", hop->name);
+		hop->up = 1;
+	} else {
+		hop->probefails++;
+		if (hop->up)
+			warnxv(0, "Upstream %s is down", hop->name);
+		hop->up = 0;
+	}
+
+	chain_probe_schedule(hop, chain_check_interval);
+}
+
+static void
+chain_cleanup(void *data)
+{
+	struct chain *ch = data;
+	struct chain_hop *hop;
+	int i;
+
+	/*
+	 * Close before deleting the event, see mirror_cleanup().
+	 */
+	for (i = 0; i < ch->nhops; i++) {
+		hop = &ch->hops[i];
+		if (hop->probesock != -1) {
+			close(hop->probesock);
+			hop->probesock = -1;
+		}
+		if (chain_check_interval > 0)
+			event_del(&hop->probeev);
+	}
+}
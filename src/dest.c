@@ -0,0 +1,348 @@
+/*
+ * dest.c
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "dest.h"
+
+/*
+ * A lookup walks at most 32 trie nodes for the address and hashes the
+ * name once, however many rules there are.  The hash runs from the end
+ * of the name, so every suffix starting at a label has its hash ready
+ * on the way to the front.
+ */
+
+#define DEST_MINBUCKETS 64
+
+#define DEST_HASHINIT   2166136261U	/* FNV-1a */
+#define DEST_HASHSTEP(h, c) (((h) ^ (u_char)(c)) * 16777619U)
+
+static int                 dest_value_add(struct dest_valueh *, u_int16_t,
+                               u_int16_t, void *);
+static struct dest_value  *dest_value_find(struct dest_valueh *, u_int16_t);
+static struct dest_suffix *dest_suffix_find(struct dest_table *,
+                               const char *, size_t, u_int32_t);
+static int                 dest_suffix_grow(struct dest_table *);
+static void                dest_node_free(struct dest_node *);
+static void                dest_values_free(struct dest_valueh *);
+static u_int32_t           dest_hash(const char *, size_t);
+
+struct dest_table *
+dest_new(void)
+{
+	struct dest_table *dt;
+	u_int i;
+
+	if ((dt = calloc(1, sizeof(*dt))) == NULL)
+		return (NULL);
+
+	dt->nbuckets = DEST_MINBUCKETS;
+	if ((dt->suffixes = calloc(dt->nbuckets,
+		 sizeof(*dt->suffixes))) == NULL) {
+		free(dt);
+		return (NULL);
+	}
+	for (i = 0; i < dt->nbuckets; i++)
+		SLIST_INIT(&dt->suffixes[i]);
+	SLIST_INIT(&dt->root.values);
+
+	return (dt);
+}
+
+/* The values are the caller's */
+void
+dest_free(struct dest_table *dt)
+{
+	struct dest_suffix *ds;
+	u_int i;
+
+	for (i = 0; i < dt->nbuckets; i++)
+		while ((ds = SLIST_FIRST(&dt->suffixes[i])) != NULL) {
+			SLIST_REMOVE_HEAD(&dt->suffixes[i], next);
+			dest_values_free(&ds->values);
+			free(ds->name);
+			free(ds);
+		}
+	free(dt->suffixes);
+
+	dest_node_free(dt->root.child[0]);
+	dest_node_free(dt->root.child[1]);
+	dest_values_free(&dt->root.values);
+	free(dt);
+}
+
+/*
+ * match is "address[/bits][:ports]", "*:ports" for any address, or
+ * "[.]domain[:ports]" for a domain and its subdomains, where ports is
+ * a port or a range "low-high".  Returns -1 if match cannot be parsed
+ * or is there already.
+ */
+int
+dest_add(struct dest_table *dt, const char *match, void *value)
+{
+	struct dest_node *dn;
+	struct dest_suffix *ds;
+	struct in_addr in;
+	char buf[256], *p, *ep;
+	u_int32_t addr, h;
+	long lo = 0, hi = 65535, bits = 32;
+	size_t len, j;
+	int i, b;
+
+	if (strlcpy(buf, match, sizeof(buf)) >= sizeof(buf))
+		return (-1);
+
+	if ((p = strrchr(buf, ':')) != NULL) {
+		*p++ = '\0';
+		lo = hi = strtol(p, &ep, 10);
+		if (*ep == '-')
+			hi = strtol(ep + 1, &ep, 10);
+		if (*p == '\0' || *ep != '\0' || lo < 1 || hi > 65535 ||
+		    lo > hi)
+			return (-1);
+	}
+
+	if (strcmp(buf, "*") == 0 || buf[0] == '\0') {
+		in.s_addr = INADDR_ANY;
+		bits = 0;
+	} else {
+		if ((p = strchr(buf, '/')) != NULL) {
+			*p++ = '\0';
+			bits = strtol(p, &ep, 10);
+			if (*p == '\0' || *ep != '\0' || bits < 0 || bits > 32)
+				return (-1);
+		}
+		if (inet_aton(buf, &in) == 0) {
+			if (p != NULL)
+				return (-1);
+			goto domain;
+		}
+	}
+
+	addr = ntohl(in.s_addr);
+	for (dn = &dt->root, i = 0; i < bits; i++) {
+		b = (addr >> (31 - i)) & 1;
+		if (dn->child[b] == NULL) {
+			if ((dn->child[b] = calloc(1,
+				 sizeof(*dn->child[b]))) == NULL)
+				return (-1);
+			SLIST_INIT(&dn->child[b]->values);
+		}
+		dn = dn->child[b];
+	}
+
+	if (dest_value_add(&dn->values, lo, hi, value) == -1)
+		return (-1);
+	dt->nrules++;
+
+	return (0);
+
+ domain:
+	p = buf[0] == '.' ? buf + 1 : buf;
+	if ((len = strlen(p)) == 0)
+		return (-1);
+	for (j = 0; j < len; j++)
+		p[j] = tolower((u_char)p[j]);
+
+	h = dest_hash(p, len);
+	if ((ds = dest_suffix_find(dt, p, len, h)) == NULL) {
+		if (dt->nsuffixes >= dt->nbuckets && dest_suffix_grow(dt) == -1)
+			return (-1);
+		if ((ds = calloc(1, sizeof(*ds))) == NULL)
+			return (-1);
+		if ((ds->name = strdup(p)) == NULL) {
+			free(ds);
+			return (-1);
+		}
+		SLIST_INIT(&ds->values);
+		SLIST_INSERT_HEAD(&dt->suffixes[h % dt->nbuckets], ds, next);
+		dt->nsuffixes++;
+	}
+
+	if (dest_value_add(&ds->values, lo, hi, value) == -1)
+		return (-1);
+	dt->nrules++;
+
+	return (0);
+}
+
+/*
+ * The most specific rule for the port wins: the longest matching
+ * domain if host is known, otherwise the longest matching prefix.  On
+ * the same domain or prefix, the narrowest port range wins.  Either of
+ * in and host may be NULL.
+ */
+void *
+dest_lookup(struct dest_table *dt, struct sockaddr_in *in, const char *host)
+{
+	struct dest_node *dn;
+	struct dest_suffix *ds;
+	struct dest_value *dv, *found = NULL;
+	char name[256];
+	u_int16_t port = in != NULL ? ntohs(in->sin_port) : 0;
+	u_int32_t addr, h;
+	size_t len, j;
+	int i;
+
+	if (host != NULL && *host != '\0') {
+		for (len = 0; host[len] != '\0' && len < sizeof(name) - 1;
+		     len++)
+			name[len] = tolower((u_char)host[len]);
+		name[len] = '\0';
+		if (len > 0 && name[len - 1] == '.')
+			name[--len] = '\0';
+
+		/* Shortest suffix first; the last match is the longest */
+		for (h = DEST_HASHINIT, j = len; j-- > 0;) {
+			h = DEST_HASHSTEP(h, name[j]);
+			if (j > 0 && name[j - 1] != '.')
+				continue;
+			if ((ds = dest_suffix_find(dt, name + j, len - j,
+				 h)) != NULL &&
+			    (dv = dest_value_find(&ds->values, port)) != NULL)
+				found = dv;
+		}
+		if (found != NULL)
+			return (found->value);
+	}
+
+	if (in == NULL)
+		return (NULL);
+
+	addr = ntohl(in->sin_addr.s_addr);
+	for (dn = &dt->root, i = 0; dn != NULL; i++) {
+		if ((dv = dest_value_find(&dn->values, port)) != NULL)
+			found = dv;
+		if (i == 32)
+			break;
+		dn = dn->child[(addr >> (31 - i)) & 1];
+	}
+
+	return (found != NULL ? found->value : NULL);
+}
+
+static int
+dest_value_add(struct dest_valueh *head, u_int16_t lo, u_int16_t hi,
+    void *value)
+{
+	struct dest_value *dv;
+
+	SLIST_FOREACH(dv, head, next)
+		if (dv->lo == lo && dv->hi == hi)
+			return (-1);
+
+	if ((dv = calloc(1, sizeof(*dv))) == NULL)
+		return (-1);
+	dv->lo = lo;
+	dv->hi = hi;
+	dv->value = value;
+	SLIST_INSERT_HEAD(head, dv, next);
+
+	return (0);
+}
+
+static void
+dest_node_free(struct dest_node *dn)
+{
+	if (dn == NULL)
+		return;
+
+	dest_node_free(dn->child[0]);
+	dest_node_free(dn->child[1]);
+	dest_values_free(&dn->values);
+	free(dn);
+}
+
+static void
+dest_values_free(struct dest_valueh *head)
+{
+	struct dest_value *dv;
+
+	while ((dv = SLIST_FIRST(head)) != NULL) {
+		SLIST_REMOVE_HEAD(head, next);
+		free(dv);
+	}
+}
+
+/* The narrowest range holding port; port 0 only matches any port */
+static struct dest_value *
+dest_value_find(struct dest_valueh *head, u_int16_t port)
+{
+	struct dest_value *dv, *best = NULL;
+
+	SLIST_FOREACH(dv, head, next)
+		if (dv->lo <= port && port <= dv->hi &&
+		    (best == NULL || dv->hi - dv->lo < best->hi - best->lo))
+			best = dv;
+
+	return (best);
+}
+
+static struct dest_suffix *
+dest_suffix_find(struct dest_table *dt, const char *name, size_t len,
+    u_int32_t h)
+{
+	struct dest_suffix *ds;
+
+	SLIST_FOREACH(ds, &dt->suffixes[h % dt->nbuckets], next)
+		if (strncmp(ds->name, name, len) == 0 && ds->name[len] == '\0')
+			return (ds);
+
+	return (NULL);
+}
+
+/* Keep chains short as domains are added */
+static int
+dest_suffix_grow(struct dest_table *dt)
+{
+	struct dest_suffixh *buckets;
+	struct dest_suffix *ds;
+	u_int i, n = dt->nbuckets * 2;
+
+	if ((buckets = calloc(n, sizeof(*buckets))) == NULL)
+		return (-1);
+	for (i = 0; i < n; i++)
+		SLIST_INIT(&buckets[i]);
+
+	for (i = 0; i < dt->nbuckets; i++)
+		while ((ds = SLIST_FIRST(&dt->suffixes[i])) != NULL) {
+			SLIST_REMOVE_HEAD(&dt->suffixes[i], next);
+			SLIST_INSERT_HEAD(&buckets[dest_hash(ds->name,
+			    strlen(ds->name)) % n], ds, next);
+		}
+
+	free(dt->suffixes);
+	dt->suffixes = buckets;
+	dt->nbuckets = n;
+
+	return (0);
+}
+
+/* Back to front, see above */
+static u_int32_t
+dest_hash(const char *name, size_t len)
+{
+	u_int32_t h = DEST_HASHINIT;
+
+	while (len-- > 0)
+		h = DEST_HASHSTEP(h, name[len]);
+
+	return (h);
+}
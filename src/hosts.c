@@ -0,0 +1,232 @@
+/*
+ * hosts.c
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <ctype.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "dest.h"
+#include "hosts.h"
+#include "print.h"
+#include "stats.h"
+
+/*
+ * Names clients ask for that resolve to fixed addresses, without
+ * asking the resolver.  Exact names are hashed; "*.domain" wildcards
+ * cover the subdomains of domain and go into a destination table.
+ * An exact name wins over a wildcard.
+ */
+
+struct hosts_map {
+	struct hosts_entryh *buckets;
+	u_int                nbuckets;
+	struct dest_table   *wild;
+	struct hosts_entryh  entries;
+	u_int                nentries;
+};
+
+static struct hosts_map *hosts_map;
+
+static struct hosts_map *hosts_load(const char *);
+static void              hosts_free(struct hosts_map *);
+static u_int32_t         hosts_hash(const char *);
+
+void
+hosts_setup(void)
+{
+	extern char *hosts_file;
+
+	if ((hosts_map = hosts_load(hosts_file)) == NULL)
+		errxv(0, 1, "Error loading host map from %s", hosts_file);
+}
+
+/*
+ * Resolve name through the map, then the resolver.  On failure h_errno
+ * tells why.
+ */
+int
+hosts_resolve(const char *name, struct in_addr *in)
+{
+	struct hosts_entry *he;
+	struct hostent *hent;
+	u_int64_t start;
+	char lname[256];
+	const char *p;
+	size_t i;
+
+	if (hosts_map != NULL) {
+		for (i = 0; name[i] != '\0' && i < sizeof(lname) - 1; i++)
+			lname[i] = tolower((u_char)name[i]);
+		lname[i] = '\0';
+		if (i > 0 && lname[i - 1] == '.')
+			lname[i - 1] = '\0';
+
+		SLIST_FOREACH(he, &hosts_map->buckets[hosts_hash(lname) %
+		    hosts_map->nbuckets], next)
+			if (strcmp(he->name, lname) == 0)
+				goto found;
+
+		/* A wildcard for a parent domain */
+		if ((p = strchr(lname, '.')) != NULL &&
+		    (he = dest_lookup(hosts_map->wild, NULL, p + 1)) != NULL)
+			goto found;
+	}
+
+	start = stats_stamp(STATS_T_DNS);
+	hent = gethostbyname(name);
+	stats_time(STATS_HIST_DNS, hent != NULL ? STATS_OK : STATS_FAIL,
+	    stats_stamp(STATS_T_DNS_DONE) - start);
+	if (hent == NULL) {
+		stats_add(STATS_DNS_ERRORS, 1);
+		stats_cause(STATS_NEG_DNS);
+		return (-1);
+	}
+	memcpy(in, hent->h_addr, sizeof(*in));
+
+	return (0);
+
+ found:
+	memcpy(in, &he->addr, sizeof(*in));
+	return (0);
+}
+
+static struct hosts_map *
+hosts_load(const char *path)
+{
+	struct hosts_map *hm;
+	struct hosts_entry *he;
+	struct in_addr addr;
+	char line[1024], *p, *name;
+	u_int lineno = 0, h;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		warnv(0, "%s", path);
+		return (NULL);
+	}
+
+	if ((hm = calloc(1, sizeof(*hm))) == NULL ||
+	    (hm->wild = dest_new()) == NULL) {
+		warnv(0, "calloc()");
+		free(hm);
+		fclose(fp);
+		return (NULL);
+	}
+	SLIST_INIT(&hm->entries);
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		for (p = line; *p != '\0'; p++)
+			*p = tolower((u_char)*p);
+
+		p = line;
+		while ((name = strsep(&p, " \t\r\n")) != NULL &&
+		    *name == '\0')
+			;
+		if (name == NULL)
+			continue;
+		if (inet_aton(name, &addr) == 0) {
+			warnxv(0, "%s:%u: Bad address %s", path, lineno, name);
+			continue;
+		}
+
+		while ((name = strsep(&p, " \t\r\n")) != NULL) {
+			if (*name == '\0')
+				continue;
+			if ((he = calloc(1, sizeof(*he))) == NULL) {
+				warnv(0, "calloc()");
+				goto fail;
+			}
+			he->wild = strncmp(name, "*.", 2) == 0;
+			if ((he->name = strdup(he->wild ? name + 2 : name)) ==
+			    NULL) {
+				warnv(0, "strdup()");
+				free(he);
+				goto fail;
+			}
+			he->addr = addr;
+			SLIST_INSERT_HEAD(&hm->entries, he, all);
+			hm->nentries++;
+
+			if (he->wild && dest_add(hm->wild, he->name, he) == -1)
+				warnxv(0, "%s:%u: Bad or duplicate wildcard %s",
+				    path, lineno, name);
+		}
+	}
+	fclose(fp);
+
+	/* Sized once, as the map does not change after loading */
+	for (hm->nbuckets = 16; hm->nbuckets < hm->nentries;
+	     hm->nbuckets *= 2)
+		;
+	if ((hm->buckets = calloc(hm->nbuckets,
+		 sizeof(*hm->buckets))) == NULL) {
+		warnv(0, "calloc()");
+		goto fail_closed;
+	}
+	for (h = 0; h < hm->nbuckets; h++)
+		SLIST_INIT(&hm->buckets[h]);
+	/* The list runs backwards, so the first line for a name wins */
+	SLIST_FOREACH(he, &hm->entries, all)
+		if (!he->wild)
+			SLIST_INSERT_HEAD(&hm->buckets[hosts_hash(he->name) %
+			    hm->nbuckets], he, next);
+
+	warnxv(1, "Loaded %u host names from %s", hm->nentries, path);
+
+	return (hm);
+
+ fail:
+	fclose(fp);
+ fail_closed:
+	hosts_free(hm);
+	return (NULL);
+}
+
+static void
+hosts_free(struct hosts_map *hm)
+{
+	struct hosts_entry *he;
+
+	while ((he = SLIST_FIRST(&hm->entries)) != NULL) {
+		SLIST_REMOVE_HEAD(&hm->entries, all);
+		free(he->name);
+		free(he);
+	}
+	dest_free(hm->wild);
+	free(hm->buckets);
+	free(hm);
+}
+
+/* FNV-1a */
+static u_int32_t
+hosts_hash(const char *name)
+{
+	u_int32_t h = 2166136261U;
+
+	while (*name != '\0') {
+		h ^= (u_char)*name++;
+		h *= 16777619U;
+	}
+
+	return (h);
+}
@@ -0,0 +1,182 @@
+/*
+ * http.c
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "atomicio.h"
+#include "hosts.h"
+#include "print.h"
+#include "net.h"
+#include "http.h"
+
+/*
+ * HTTP CONNECT, for clients that do not speak SOCKS.  Only the
+ * request line matters; the headers are skipped.
+ */
+struct http_request {
+	int       connect;		/* Method is CONNECT */
+	int       minor;		/* HTTP/1.minor */
+	char      hostname[256];
+	u_int16_t port;
+};
+
+static int http_parse_request(const u_char *, size_t, void *);
+static int http_reply(int, struct http_request *, int, const char *);
+
+int
+http_negotiate(struct negdesc *nd, struct conndesc *conn)
+{
+	struct http_request req;
+	struct sockaddr_in rem_in;
+	int remsock;
+
+	if (net_negparse(nd, http_parse_request, &req) == -1) {
+		http_reply(nd->sock, NULL, 400, "Bad Request");
+		return (-1);
+	}
+
+	if (!req.connect) {
+		warnxv(1, "HTTP request is not CONNECT");
+		http_reply(nd->sock, &req, 405, "Method Not Allowed");
+		return (-1);
+	}
+
+	memset(&rem_in, 0, sizeof(rem_in));
+	rem_in.sin_family = AF_INET;
+	rem_in.sin_port = htons(req.port);
+
+	if (inet_aton(req.hostname, &rem_in.sin_addr) == 0) {
+		strlcpy(nd->rem_host, req.hostname, sizeof(nd->rem_host));
+		if (hosts_resolve(req.hostname, &rem_in.sin_addr) == -1) {
+			/* XXX no hstrerror() on solaris */
+#ifndef __sun__
+			warnxv(1, "gethostbyname(): %s", hstrerror(h_errno));
+#endif /* __sun__ */
+			http_reply(nd->sock, &req, 502, "Bad Gateway");
+			return (-1);
+		}
+	}
+
+	/* Any data the client pipelined goes out with the connect */
+	if ((remsock = net_connect(conn, (struct sockaddr *)&rem_in,
+		 sizeof(rem_in), nd)) == -1) {
+		if (errno == EACCES)
+			http_reply(nd->sock, &req, 403, "Forbidden");
+		else
+			http_reply(nd->sock, &req,
+			    errno == ETIMEDOUT ? 504 : 502,
+			    errno == ETIMEDOUT ?
+			    "Gateway Timeout" : "Bad Gateway");
+		return (-1);
+	}
+
+	if (http_reply(nd->sock, &req, 200, "Connection established") == -1) {
+		close(remsock);
+		return (-1);
+	}
+
+	return (remsock);
+}
+
+/*
+ * "CONNECT host:port HTTP/1.x" followed by headers and an empty
+ * line.  Everything after the empty line belongs to the tunnel.
+ */
+static int
+http_parse_request(const u_char *buf, size_t len, void *arg)
+{
+	struct http_request *req = arg;
+	const char *p, *end, *sp, *host, *colon;
+	size_t hlen, i;
+	long port;
+
+	/* Find the end of the headers */
+	for (i = 0; i < len; i++)
+		if (buf[i] == '\n' &&
+		    ((i >= 1 && buf[i - 1] == '\n') ||
+			(i >= 3 && memcmp(buf + i - 3, "\r\n\r\n", 4) == 0)))
+			break;
+	if (i == len)
+		return (NET_PARSE_MORE);
+
+	p = (const char *)buf;
+	end = memchr(p, '\n', i + 1);
+
+	memset(req, 0, sizeof(*req));
+	req->minor = 1;
+
+	/* Method */
+	if ((sp = memchr(p, ' ', end - p)) == NULL)
+		return (NET_PARSE_FAIL);
+	req->connect = sp - p == 7 && memcmp(p, "CONNECT", 7) == 0;
+
+	/* Target */
+	host = sp + 1;
+	if ((sp = memchr(host, ' ', end - host)) == NULL)
+		return (NET_PARSE_FAIL);
+
+	/* Version */
+	if (end - sp < 9 || memcmp(sp + 1, "HTTP/1.", 7) != 0)
+		return (NET_PARSE_FAIL);
+	if (sp[8] == '0')
+		req->minor = 0;
+
+	if (!req->connect)
+		return (i + 1);
+
+	if ((colon = memchr(host, ':', sp - host)) == NULL)
+		return (NET_PARSE_FAIL);
+	hlen = colon - host;
+	if (hlen == 0 || hlen >= sizeof(req->hostname))
+		return (NET_PARSE_FAIL);
+	memcpy(req->hostname, host, hlen);
+	req->hostname[hlen] = '\0';
+
+	for (port = 0, p = colon + 1; p < sp; p++) {
+		if (*p < '0' || *p > '9' || (port = port * 10 + *p - '0') > 65535)
+			return (NET_PARSE_FAIL);
+	}
+	if (port == 0)
+		return (NET_PARSE_FAIL);
+	req->port = port;
+
+	return (i + 1);
+}
+
+static int
+http_reply(int sock, struct http_request *req, int code, const char *reason)
+{
+	char buf[128];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "HTTP/1.%d %d %s\r\n%s\r\n",
+	    req != NULL ? req->minor : 1, code, reason,
+	    code == 200 ? "" : "Connection: close\r\n");
+
+	if (atomicio(write, sock, buf, len) != len) {
+		warnv(1, "write()");
+		return (-1);
+	}
+
+	return (0);
+}
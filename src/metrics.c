@@ -0,0 +1,453 @@
+/*
+ * metrics.c
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "cleanup.h"
+#include "print.h"
+#include "stats.h"
+#include "metrics.h"
+
+/*
+ * The counters of stats.c in the Prometheus text format, over just
+ * enough HTTP for a scraper.  Each scrape is served from the event
+ * loop of the listening process without blocking it.
+ */
+
+#define METRICS_REQSZ   1024
+#define METRICS_TIMEOUT 10	/* Seconds for a scrape to finish */
+
+struct metrics_conn {
+	int           sock;
+	struct event  ev;
+	char          req[METRICS_REQSZ];
+	size_t        reqlen;
+	char         *buf;	/* The response */
+	size_t        len;
+	size_t        off;
+	size_t        size;
+	TAILQ_ENTRY(metrics_conn) next;
+};
+
+char *metrics_listen;
+
+extern cleanup_t *cleanup;
+
+static int          metrics_sock = -1;
+static struct event metrics_ev;
+
+/* Closed in forked clients too, or they would hold scrapes open */
+static TAILQ_HEAD(metrics_connh, metrics_conn) metrics_conns =
+    TAILQ_HEAD_INITIALIZER(metrics_conns);
+
+static const char *metrics_hists[STATS_NHISTS] = {
+	"nylon_reply_duration_seconds",
+	"nylon_dns_duration_seconds",
+	"nylon_connect_duration_seconds",
+	"nylon_acl_duration_seconds",
+	"nylon_handshake_duration_seconds",
+	"nylon_first_byte_client_seconds",
+	"nylon_first_byte_remote_seconds"
+};
+static const char *metrics_outcomes[STATS_NOUTCOMES] = { "ok", "fail" };
+
+static void metrics_accept(int, short, void *);
+static void metrics_read(int, short, void *);
+static void metrics_write(int, short, void *);
+static void metrics_render(struct metrics_conn *);
+static void metrics_printf(struct metrics_conn *, const char *, ...);
+static void metrics_close(struct metrics_conn *);
+static void metrics_cleanup(void *);
+static void metrics_drop(void);
+
+void
+metrics_setup(void)
+{
+	metrics_sock = stats_socket(metrics_listen);
+	if (cleanup_add(cleanup, metrics_cleanup, NULL) == -1)
+		errxv(0, 1, "cleanup_add()");
+
+	event_set(&metrics_ev, metrics_sock, EV_READ | EV_PERSIST,
+	    metrics_accept, NULL);
+	if (event_add(&metrics_ev, NULL) == -1)
+		errv(0, 1, "event_add()");
+
+	warnxv(1, "Metrics on %s", metrics_listen);
+}
+
+static void
+metrics_accept(int fd, short ev, void *data)
+{
+	struct metrics_conn *mc;
+	struct timeval tv;
+	int sock;
+
+	if ((sock = accept(fd, NULL, NULL)) == -1) {
+		if (errno != EAGAIN && errno != EINTR)
+			warnv(0, "accept()");
+		return;
+	}
+
+	if (fcntl(sock, F_SETFL, O_NONBLOCK) == -1 ||
+	    (mc = calloc(1, sizeof(*mc))) == NULL) {
+		warnv(0, "metrics_accept()");
+		close(sock);
+		return;
+	}
+	mc->sock = sock;
+	TAILQ_INSERT_TAIL(&metrics_conns, mc, next);
+
+	timerclear(&tv);
+	tv.tv_sec = METRICS_TIMEOUT;
+	event_set(&mc->ev, sock, EV_READ, metrics_read, mc);
+	if (event_add(&mc->ev, &tv) == -1) {
+		warnv(0, "event_add()");
+		metrics_close(mc);
+	}
+}
+
+/* The request is read up to its blank line; only its first line counts */
+static void
+metrics_read(int fd, short ev, void *data)
+{
+	struct metrics_conn *mc = data;
+	struct timeval tv;
+	ssize_t ret;
+
+	if (ev & EV_TIMEOUT) {
+		metrics_close(mc);
+		return;
+	}
+
+	ret = recv(fd, mc->req + mc->reqlen,
+	    sizeof(mc->req) - 1 - mc->reqlen, 0);
+	if (ret == -1 && (errno == EINTR || errno == EAGAIN))
+		goto again;
+	if (ret <= 0) {
+		metrics_close(mc);
+		return;
+	}
+	mc->reqlen += ret;
+	mc->req[mc->reqlen] = '\0';
+
+	if (strstr(mc->req, "\r\n\r\n") == NULL &&
+	    strstr(mc->req, "\n\n") == NULL &&
+	    mc->reqlen < sizeof(mc->req) - 1)
+		goto again;
+
+	metrics_render(mc);
+	if (mc->buf == NULL) {
+		metrics_close(mc);
+		return;
+	}
+
+	timerclear(&tv);
+	tv.tv_sec = METRICS_TIMEOUT;
+	event_set(&mc->ev, fd, EV_WRITE, metrics_write, mc);
+	if (event_add(&mc->ev, &tv) == -1) {
+		warnv(0, "event_add()");
+		metrics_close(mc);
+	}
+	return;
+
+ again:
+	timerclear(&tv);
+	tv.tv_sec = METRICS_TIMEOUT;
+	if (event_add(&mc->ev, &tv) == -1) {
+		warnv(0, "event_add()");
+		metrics_close(mc);
+	}
+}
+
+static void
+metrics_write(int fd, short ev, void *data)
+{
+	struct metrics_conn *mc = data;
+	struct timeval tv;
+	ssize_t ret;
+
+	if (ev & EV_TIMEOUT) {
+		metrics_close(mc);
+		return;
+	}
+
+	ret = write(fd, mc->buf + mc->off, mc->len - mc->off);
+	if (ret == -1 && errno != EINTR && errno != EAGAIN) {
+		metrics_close(mc);
+		return;
+	}
+	if (ret > 0)
+		mc->off += ret;
+	if (mc->off == mc->len) {
+		metrics_close(mc);
+		return;
+	}
+
+	timerclear(&tv);
+	tv.tv_sec = METRICS_TIMEOUT;
+	if (event_add(&mc->ev, &tv) == -1) {
+		warnv(0, "event_add()");
+		metrics_close(mc);
+	}
+}
+
+/*
+ * Build the whole response.  Series are only given for the modes a
+ * listener has served.
+ */
+static void
+metrics_render(struct metrics_conn *mc)
+{
+	static struct stats_total totals[STATS_LISTENERS][STATS_NMODES];
+	u_int active[STATS_LISTENERS][STATS_NMODES];
+	struct stats_shm *st;
+	struct stats_total *t;
+	struct stats_hist *sh;
+	char lab[128];
+	u_int64_t n;
+	int i, j, k, o, b;
+
+	if (strncmp(mc->req, "GET /metrics ", 13) != 0 &&
+	    strncmp(mc->req, "GET / ", 6) != 0) {
+		metrics_printf(mc, "HTTP/1.0 404 Not Found\r\n"
+		    "Content-Type: text/plain\r\n\r\nNot Found\n");
+		return;
+	}
+
+	/* HTTP/1.0, so closing the connection ends the body */
+	metrics_printf(mc, "HTTP/1.0 200 OK\r\n"
+	    "Content-Type: text/plain; version=0.0.4\r\n\r\n");
+
+	st = stats_sum(totals, active);
+
+#define USED(i, j) (active[i][j] > 0 ||					\
+	totals[i][j].closed[STATS_OK] + totals[i][j].closed[STATS_FAIL] > 0)
+
+	metrics_printf(mc, "# HELP nylon_accepts_total Connections "
+	    "accepted.\n# TYPE nylon_accepts_total counter\n");
+	for (i = 0; i < st->nlisteners; i++)
+		metrics_printf(mc, "nylon_accepts_total{listener=\"%s\"} "
+		    "%llu\n", st->listeners[i].name,
+		    (unsigned long long)st->listeners[i].accepts);
+	metrics_printf(mc, "# HELP nylon_rejects_total Connections "
+	    "refused by the access lists.\n"
+	    "# TYPE nylon_rejects_total counter\n");
+	for (i = 0; i < st->nlisteners; i++)
+		metrics_printf(mc, "nylon_rejects_total{listener=\"%s\"} "
+		    "%llu\n", st->listeners[i].name,
+		    (unsigned long long)st->listeners[i].rejects);
+	metrics_printf(mc, "# HELP nylon_untracked_total Connections "
+	    "served without a statistics slot.\n"
+	    "# TYPE nylon_untracked_total counter\n"
+	    "nylon_untracked_total %llu\n",
+	    (unsigned long long)st->untracked);
+
+	metrics_printf(mc, "# HELP nylon_active_connections Connections "
+	    "being served.\n# TYPE nylon_active_connections gauge\n");
+	for (i = 0; i < st->nlisteners; i++)
+		for (j = 0; j < STATS_NMODES; j++)
+			metrics_printf(mc, "nylon_active_connections{"
+			    "listener=\"%s\",mode=\"%s\"} %u\n",
+			    st->listeners[i].name, stats_modes[j],
+			    active[i][j]);
+
+	metrics_printf(mc, "# HELP nylon_connections_total Connections "
+	    "closed, by whether negotiation succeeded.\n"
+	    "# TYPE nylon_connections_total counter\n");
+	for (i = 0; i < st->nlisteners; i++)
+		for (j = 0; j < STATS_NMODES; j++) {
+			if (!USED(i, j))
+				continue;
+			for (o = 0; o < STATS_NOUTCOMES; o++)
+				metrics_printf(mc, "nylon_connections_total{"
+				    "listener=\"%s\",mode=\"%s\","
+				    "outcome=\"%s\"} %llu\n",
+				    st->listeners[i].name, stats_modes[j],
+				    metrics_outcomes[o], (unsigned long long)
+				    totals[i][j].closed[o]);
+		}
+
+	metrics_printf(mc, "# HELP nylon_bytes_total Bytes relayed, by "
+	    "the side that sent them.\n# TYPE nylon_bytes_total counter\n");
+	for (i = 0; i < st->nlisteners; i++)
+		for (j = 0; j < STATS_NMODES; j++) {
+			if (!USED(i, j))
+				continue;
+			t = &totals[i][j];
+			metrics_printf(mc, "nylon_bytes_total{listener=\"%s\","
+			    "mode=\"%s\",direction=\"client\"} %llu\n"
+			    "nylon_bytes_total{listener=\"%s\","
+			    "mode=\"%s\",direction=\"remote\"} %llu\n",
+			    st->listeners[i].name, stats_modes[j],
+			    (unsigned long long)
+			    t->counters[STATS_BYTES_CLIENT],
+			    st->listeners[i].name, stats_modes[j],
+			    (unsigned long long)
+			    t->counters[STATS_BYTES_REMOTE]);
+		}
+
+	metrics_printf(mc, "# HELP nylon_negotiation_failures_total "
+	    "Failed negotiations, by cause.\n"
+	    "# TYPE nylon_negotiation_failures_total counter\n");
+	for (i = 0; i < st->nlisteners; i++)
+		for (j = 0; j < STATS_NMODES; j++) {
+			if (!USED(i, j))
+				continue;
+			for (k = 0; k < STATS_NNEG; k++)
+				metrics_printf(mc,
+				    "nylon_negotiation_failures_total{"
+				    "listener=\"%s\",mode=\"%s\","
+				    "cause=\"%s\"} %llu\n",
+				    st->listeners[i].name, stats_modes[j],
+				    stats_causes[k], (unsigned long long)
+				    totals[i][j].negfails[k]);
+		}
+
+	metrics_printf(mc, "# HELP nylon_errors_total Failed name "
+	    "lookups and connects.\n# TYPE nylon_errors_total counter\n");
+	for (i = 0; i < st->nlisteners; i++)
+		for (j = 0; j < STATS_NMODES; j++) {
+			if (!USED(i, j))
+				continue;
+			t = &totals[i][j];
+			metrics_printf(mc, "nylon_errors_total{listener=\"%s\","
+			    "mode=\"%s\",kind=\"dns\"} %llu\n"
+			    "nylon_errors_total{listener=\"%s\","
+			    "mode=\"%s\",kind=\"connect\"} %llu\n",
+			    st->listeners[i].name, stats_modes[j],
+			    (unsigned long long)t->counters[STATS_DNS_ERRORS],
+			    st->listeners[i].name, stats_modes[j],
+			    (unsigned long long)
+			    t->counters[STATS_CONNECT_ERRORS]);
+		}
+
+	for (k = 0; k < STATS_NHISTS; k++) {
+		metrics_printf(mc, "# TYPE %s histogram\n", metrics_hists[k]);
+		for (i = 0; i < st->nlisteners; i++)
+			for (j = 0; j < STATS_NMODES; j++) {
+				if (!USED(i, j))
+					continue;
+				for (o = 0; o < STATS_NOUTCOMES; o++) {
+					sh = &totals[i][j].hists[k][o];
+					snprintf(lab, sizeof(lab),
+					    "listener=\"%s\",mode=\"%s\","
+					    "outcome=\"%s\"",
+					    st->listeners[i].name,
+					    stats_modes[j],
+					    metrics_outcomes[o]);
+					for (n = 0, b = 0; b < STATS_NBUCKETS;
+					     b++) {
+						n += sh->buckets[b];
+						metrics_printf(mc, "%s_bucket{%s,"
+						    "le=\"%g\"} %llu\n",
+						    metrics_hists[k], lab,
+						    stats_bounds[b] / 1e6,
+						    (unsigned long long)n);
+					}
+					n += sh->buckets[b];
+					metrics_printf(mc, "%s_bucket{%s,"
+					    "le=\"+Inf\"} %llu\n"
+					    "%s_sum{%s} %.6f\n"
+					    "%s_count{%s} %llu\n",
+					    metrics_hists[k], lab,
+					    (unsigned long long)n,
+					    metrics_hists[k], lab,
+					    sh->sum / 1e6,
+					    metrics_hists[k], lab,
+					    (unsigned long long)n);
+				}
+			}
+	}
+
+#undef USED
+}
+
+static void
+metrics_printf(struct metrics_conn *mc, const char *fmt, ...)
+{
+	va_list ap;
+	char *p;
+	int ret;
+
+	if (mc->buf == NULL && mc->size > 0)
+		return;		/* Out of memory earlier */
+
+	for (;;) {
+		va_start(ap, fmt);
+		ret = vsnprintf(mc->buf + mc->len, mc->size - mc->len, fmt,
+		    ap);
+		va_end(ap);
+		if (ret < 0)
+			return;
+		if ((size_t)ret < mc->size - mc->len)
+			break;
+
+		if ((p = realloc(mc->buf, mc->size * 2 + ret + 1)) == NULL) {
+			warnv(0, "realloc()");
+			free(mc->buf);
+			mc->buf = NULL;
+			return;
+		}
+		mc->buf = p;
+		mc->size = mc->size * 2 + ret + 1;
+	}
+	mc->len += ret;
+}
+
+static void
+metrics_close(struct metrics_conn *mc)
+{
+	TAILQ_REMOVE(&metrics_conns, mc, next);
+	close(mc->sock);
+	event_del(&mc->ev);
+	free(mc->buf);
+	free(mc);
+}
+
+/*
+ * In a new child: a scrape in progress must not wait for it to exit,
+ * as the end of the response is when its socket closes.  Each socket
+ * is closed before event_del(), as in mirror_cleanup(), so the
+ * parent's registration is left alone.
+ */
+void
+metrics_forked(void)
+{
+	metrics_drop();
+}
+
+static void
+metrics_drop(void)
+{
+	while (!TAILQ_EMPTY(&metrics_conns))
+		metrics_close(TAILQ_FIRST(&metrics_conns));
+}
+
+static void
+metrics_cleanup(void *data)
+{
+	metrics_drop();
+	close(metrics_sock);
+	event_del(&metrics_ev);
+	stats_unlink(metrics_listen);
+}
@@ -8,44 +8,725 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 
 #include <netinet/in.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <netdb.h>
+#include <time.h>
 #include <unistd.h>
+#include <event.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif /* HAVE_CONFIG_H */
 
+#include "atomicio.h"
+#include "cleanup.h"
+#include "expanda.h"
 #include "net.h"
+#include "nylon.h"
+#include "mirror.h"
+#include "proxyhdr.h"
+#include "stats.h"
+#include "tunnel.h"
 #include "print.h"
 
+/* Points on the hash ring per unit of weight */
+#define MIRROR_POINTS 100
+
+/*
+ * Backend selection is done by the listening process, before it
+ * forks, so the selection state is naturally shared by every
+ * connection.  Connections are accounted to their backend until the
+ * process serving them is reaped.
+ */
+struct mirror_child {
+	pid_t                      pid;
+	struct mirror_backend     *mb;
+	TAILQ_ENTRY(mirror_child)  next;
+};
+
+static TAILQ_HEAD(mirror_childh, mirror_child) mirror_children =
+    TAILQ_HEAD_INITIALIZER(mirror_children);
+
+struct mirror_health mirror_health = {
+	0,			/* interval; active probes are off */
+	2,			/* timeout */
+	2,			/* rise */
+	3,			/* fall */
+	5,			/* eject_errors */
+	30			/* eject_time */
+};
+
+int mirror_pool_size = 0;
+int mirror_pool_idle = 60;
+
+extern cleanup_t *cleanup;
+
+static int       mirror_usable(struct mirror_backend *, time_t);
+static int       mirror_connect_nb(struct mirror_backend *);
+static void      mirror_pool_schedule(struct mirror_backend *, int);
+static void      mirror_pool_fill(int, short, void *);
+static void      mirror_pool_ready(int, short, void *);
+static void      mirror_pool_idle_cb(int, short, void *);
+static void      mirror_pool_drop(struct mirror_pooled *, int);
+static void      mirror_probe(int, short, void *);
+static void      mirror_probe_done(int, short, void *);
+static void      mirror_probe_result(struct mirror_backend *, int);
+static void      mirror_probe_schedule(struct mirror_backend *, int);
+static void      mirror_cleanup(void *);
+static u_int32_t mirror_hash(const void *, size_t);
+static void      mirror_buildring(struct mirror *);
+static int       mirror_pointcmp(const void *, const void *);
+
+/*
+ * addrs is a list of "host:port" backends, each optionally followed
+ * by "/weight".
+ */
+struct mirror *
+mirror_new(char *addrs, char *policy)
+{
+	struct mirror *m;
+	struct mirror_backend *mb;
+	char **arr, **a, *w;
+
+	if ((m = calloc(1, sizeof(*m))) == NULL)
+		errv(0, 1, "calloc()");
+
+	if (policy == NULL || strcmp(policy, "round-robin") == 0)
+		m->policy = MIRROR_ROUNDROBIN;
+	else if (strcmp(policy, "least-conn") == 0)
+		m->policy = MIRROR_LEASTCONN;
+	else if (strcmp(policy, "weighted") == 0)
+		m->policy = MIRROR_WEIGHTED;
+	else if (strcmp(policy, "hash") == 0)
+		m->policy = MIRROR_HASH;
+	else
+		errxv(0, 1, "Unknown mirror policy: %s", policy);
+
+	if ((arr = expanda(addrs)) == NULL)
+		errxv(0, 1, "Error expanding mirror address list");
+
+	for (a = arr; *a != NULL; a++)
+		m->nbackends++;
+	if (m->nbackends == 0)
+		errxv(0, 1, "Empty mirror address list");
+
+	if ((m->backends = calloc(m->nbackends, sizeof(*m->backends))) == NULL)
+		errv(0, 1, "calloc()");
+
+	for (a = arr, mb = m->backends; *a != NULL; a++, mb++) {
+		mb->mirror = m;
+		mb->up = 1;
+		mb->probesock = -1;
+		TAILQ_INIT(&mb->pool);
+		mb->weight = 1;
+		if ((w = strchr(*a, '/')) != NULL) {
+			*w++ = '\0';
+			if ((mb->weight = atoi(w)) < 1)
+				errxv(0, 1, "Bad weight for mirror %s", *a);
+		}
+
+		if ((mb->ai = get_ai_from_addrpair(*a)) == NULL)
+			errxv(0, 1, "Error resolving host:pair address");
+		if ((mb->name = strdup(*a)) == NULL)
+			errv(0, 1, "strdup()");
+	}
+
+	freea(arr);
+
+	if (m->policy == MIRROR_HASH)
+		mirror_buildring(m);
+
+	return (m);
+}
+
+/*
+ * Start the active health probes, if configured.  Probes go out from
+ * the connecting interface, like client connections.
+ */
+void
+mirror_start(struct mirror *m, struct conndesc *conn)
+{
+	u_int i;
+
+	m->conn = conn;
+
+	if (cleanup_add(cleanup, mirror_cleanup, m) == -1)
+		errxv(0, 1, "cleanup_add()");
+
+	/* Backends are only reachable through the upstream proxies */
+	if (conn->chain != NULL ||
+	    (conn->tunnel != NULL && conn->tunnel->peer_ai != NULL))
+		return;
+
+	for (i = 0; i < m->nbackends; i++) {
+		if (mirror_health.interval > 0)
+			mirror_probe_schedule(&m->backends[i], 0);
+		if (mirror_pool_size > 0) {
+			evtimer_set(&m->backends[i].poolev, mirror_pool_fill,
+			    &m->backends[i]);
+			mirror_pool_schedule(&m->backends[i], 0);
+		}
+	}
+}
+
+void
+mirror_report(struct mirror *m)
+{
+	struct mirror_backend *mb;
+	time_t now = time(NULL);
+	u_int i;
+
+	for (i = 0; i < m->nbackends; i++) {
+		mb = &m->backends[i];
+		warnxv(0, "Mirror %s: %s, weight %d, %u active, %u pooled, "
+		    "%u/%u probes failed, %u ejections%s",
+		    mb->name, mb->up ? "up" : "down", mb->weight, mb->active,
+		    mb->npool, mb->probefails, mb->probes, mb->ejections,
+		    mb->ejected > now ? " (ejected)" : "");
+	}
+}
+
+/*
+ * Pick a backend among those that are up and not ejected.  If there
+ * are none, every backend is considered rather than failing outright.
+ */
+struct mirror_backend *
+mirror_select(struct mirror *m, struct sockaddr_in *cli_in)
+{
+	struct mirror_backend *mb, *best = NULL;
+	u_int i, lo, hi, mid, start;
+	u_int32_t h;
+	time_t now = time(NULL);
+	int total = 0, any;
+
+	for (any = 0; any < 2 && best == NULL; any++)
+		switch (m->policy) {
+		case MIRROR_ROUNDROBIN:
+			for (i = 0; i < m->nbackends && best == NULL; i++) {
+				mb = &m->backends[m->rr++ % m->nbackends];
+				if (any || mirror_usable(mb, now))
+					best = mb;
+			}
+			break;
+		case MIRROR_LEASTCONN:
+			/* Fewest connections per unit of weight; ties rotate */
+			start = m->rr++;
+			for (i = 0; i < m->nbackends; i++) {
+				mb = &m->backends[(start + i) % m->nbackends];
+				if (!any && !mirror_usable(mb, now))
+					continue;
+				if (best == NULL || mb->active * best->weight <
+				    best->active * mb->weight)
+					best = mb;
+			}
+			break;
+		case MIRROR_WEIGHTED:
+			/* Smooth weighted round robin, as in nginx */
+			for (i = 0; i < m->nbackends; i++) {
+				mb = &m->backends[i];
+				if (!any && !mirror_usable(mb, now))
+					continue;
+				mb->current += mb->weight;
+				total += mb->weight;
+				if (best == NULL || mb->current > best->current)
+					best = mb;
+			}
+			if (best != NULL)
+				best->current -= total;
+			break;
+		case MIRROR_HASH:
+			/*
+			 * First point on the ring at or after the client's
+			 * hash, skipping points of unusable backends.
+			 */
+			h = mirror_hash(&cli_in->sin_addr,
+			    sizeof(cli_in->sin_addr));
+			lo = 0;
+			hi = m->npoints;
+			while (lo < hi) {
+				mid = (lo + hi) / 2;
+				if (m->ring[mid].hash < h)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			for (i = 0; i < m->npoints && best == NULL; i++) {
+				mb = m->ring[(lo + i) % m->npoints].mb;
+				if (any || mirror_usable(mb, now))
+					best = mb;
+			}
+			break;
+		}
+
+	return (best);
+}
+
+void
+mirror_started(struct mirror *m, struct mirror_backend *mb, pid_t pid)
+{
+	struct mirror_child *mc;
+
+	if ((mc = malloc(sizeof(*mc))) == NULL) {
+		warnv(0, "malloc()");
+		return;
+	}
+
+	mc->pid = pid;
+	mc->mb = mb;
+	mb->active++;
+
+	TAILQ_INSERT_TAIL(&mirror_children, mc, next);
+}
+
+void
+mirror_reap(pid_t pid, int status)
+{
+	struct mirror_child *mc;
+	struct mirror_backend *mb;
+
+	TAILQ_FOREACH(mc, &mirror_children, next)
+		if (mc->pid == pid)
+			break;
+
+	if (mc == NULL)
+		return;
+
+	mb = mc->mb;
+	mb->active--;
+
+	/* Passive outlier ejection */
+	if (!WIFEXITED(status) ||
+	    WEXITSTATUS(status) != MIRROR_EXIT_CONNFAIL) {
+		mb->connfails = 0;
+	} else if (mirror_health.eject_errors > 0 &&
+	    ++mb->connfails >= mirror_health.eject_errors) {
+		warnxv(0, "Mirror %s: %u consecutive connect failures; "
+		    "ejecting for %d seconds", mb->name, mb->connfails,
+		    mirror_health.eject_time);
+		mb->ejected = time(NULL) + mirror_health.eject_time;
+		mb->ejections++;
+		mb->connfails = 0;
+	}
+
+	TAILQ_REMOVE(&mirror_children, mc, next);
+	free(mc);
+}
+
 int
-mirror_setup(struct conndesc *conn)
+mirror_setup(struct negdesc *nd, struct conndesc *conn)
 {
+	struct addrinfo *ai = nd->mb->ai;
+	u_char hdr[PROXYHDR_V2_LEN];
+	socklen_t len;
 	int remsock;
-	struct addrinfo *ai = conn->mirror_ai;
 
-	if ((remsock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1) {
-		warnv(0, "socket()");
-		return (-1);
+	memcpy(&nd->rem_in, ai->ai_addr, sizeof(nd->rem_in));
+
+	if (nd->presock != -1) {
+		/* Handed a warm connection by the listener */
+		remsock = nd->presock;
+	} else if ((remsock = net_connect(conn, ai->ai_addr, ai->ai_addrlen,
+			NULL)) == -1) {
+		/* The exit status tells the listener about the failure */
+		stats_replied(STATS_FAIL);
+		stats_negfail();
+		errxv(1, MIRROR_EXIT_CONNFAIL, "Connection to mirror %s failed",
+		    nd->mb->name);
+	}
+
+	/* Tell the backend who the client is */
+	if (ISSET(conn->options, NET_OPT_MIRROR_PROXYHDR)) {
+		len = sizeof(nd->srv_in);
+		if (nd->srv_in.sin_family != AF_INET &&
+		    getsockname(nd->sock, (struct sockaddr *)&nd->srv_in,
+			&len) == -1) {
+			warnv(1, "getsockname()");
+			close(remsock);
+			return (-1);
+		}
+		if (atomicio(write, remsock, hdr,
+			proxyhdr_v2(hdr, &nd->cli_in, &nd->srv_in)) !=
+		    sizeof(hdr)) {
+			warnv(1, "write()");
+			close(remsock);
+			return (-1);
+		}
 	}
 
-	if ((ai = conn->bind_ai) != NULL &&
-	    bind(remsock, ai->ai_addr, ai->ai_addrlen) == -1) {
-		warnv(0, "bind()");
+	return (remsock);
+}
+
+/*
+ * Take a warm connection to the backend, if one is ready.  The pool
+ * is topped up again from the event loop.
+ */
+int
+mirror_pool_take(struct mirror_backend *mb)
+{
+	struct mirror_pooled *mp;
+	int sock;
+
+	TAILQ_FOREACH(mp, &mb->pool, next)
+		if (mp->connected)
+			break;
+
+	mirror_pool_schedule(mb, 0);
+
+	if (mp == NULL)
+		return (-1);
+
+	sock = mp->sock;
+	mp->sock = -1;
+	mirror_pool_drop(mp, 0);
+
+	/* The child serving the client does blocking I/O until the relay */
+	if (fcntl(sock, F_SETFL, 0) == -1) {
+		warnv(0, "fcntl()");
+		close(sock);
 		return (-1);
 	}
 
-	ai = conn->mirror_ai;
+	return (sock);
+}
+
+static void
+mirror_pool_schedule(struct mirror_backend *mb, int secs)
+{
+	struct timeval tv;
+
+	if (mirror_pool_size <= 0)
+		return;
+
+	timerclear(&tv);
+	tv.tv_sec = secs;
+
+	/* Rearms the refill if it is already pending */
+	if (evtimer_add(&mb->poolev, &tv) == -1)
+		warnv(0, "evtimer_add()");
+}
+
+static void
+mirror_pool_fill(int fd, short ev, void *data)
+{
+	struct mirror_backend *mb = data;
+	struct mirror_pooled *mp;
+	struct timeval tv;
+
+	/* No point keeping connections to a backend we avoid */
+	if (!mirror_usable(mb, time(NULL))) {
+		mirror_pool_schedule(mb, 1);
+		return;
+	}
+
+	timerclear(&tv);
+	tv.tv_sec = mirror_health.timeout;
+
+	while (mb->npool < mirror_pool_size) {
+		if ((mp = calloc(1, sizeof(*mp))) == NULL) {
+			warnv(0, "calloc()");
+			break;
+		}
+		if ((mp->sock = mirror_connect_nb(mb)) == -1) {
+			warnv(2, "Pooled connection to mirror %s", mb->name);
+			free(mp);
+			mirror_pool_schedule(mb, 1);
+			break;
+		}
+		mp->mb = mb;
+
+		event_set(&mp->ev, mp->sock, EV_WRITE, mirror_pool_ready, mp);
+		if (event_add(&mp->ev, &tv) == -1) {
+			warnv(0, "event_add()");
+			close(mp->sock);
+			free(mp);
+			break;
+		}
+
+		TAILQ_INSERT_TAIL(&mb->pool, mp, next);
+		mb->npool++;
+	}
+}
+
+static void
+mirror_pool_ready(int fd, short ev, void *data)
+{
+	struct mirror_pooled *mp = data;
+	struct timeval tv;
+	socklen_t len;
+	int error = ETIMEDOUT;
+
+	if (ev & EV_WRITE) {
+		len = sizeof(error);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+			error = errno;
+	}
+
+	if (error != 0) {
+		errno = error;
+		warnv(2, "Pooled connection to mirror %s", mp->mb->name);
+		mirror_pool_drop(mp, 1);
+		return;
+	}
+
+	mp->connected = 1;
+
+	/*
+	 * Nothing should arrive on an idle connection; if anything
+	 * does, it is most likely the backend closing it.
+	 */
+	timerclear(&tv);
+	tv.tv_sec = mirror_pool_idle;
+
+	event_set(&mp->ev, fd, EV_READ, mirror_pool_idle_cb, mp);
+	if (event_add(&mp->ev, mirror_pool_idle > 0 ? &tv : NULL) == -1) {
+		warnv(0, "event_add()");
+		mirror_pool_drop(mp, 1);
+	}
+}
+
+/*
+ * An idle pooled connection became readable or aged out: replace it.
+ */
+static void
+mirror_pool_idle_cb(int fd, short ev, void *data)
+{
+	struct mirror_pooled *mp = data;
+	struct mirror_backend *mb = mp->mb;
+
+	mirror_pool_drop(mp, 0);
+	mirror_pool_schedule(mb, (ev & EV_READ) ? 1 : 0);
+}
+
+/*
+ * Remove a pooled connection, retrying the refill a little later
+ * if it failed.
+ */
+static void
+mirror_pool_drop(struct mirror_pooled *mp, int failed)
+{
+	struct mirror_backend *mb = mp->mb;
+
+	if (mp->sock != -1)
+		close(mp->sock);
+	event_del(&mp->ev);
 
-	if (connect(remsock, ai->ai_addr, ai->ai_addrlen) == -1) {
-		close(remsock);
-		warnv(0, "connect()");
+	TAILQ_REMOVE(&mb->pool, mp, next);
+	mb->npool--;
+	free(mp);
+
+	if (failed)
+		mirror_pool_schedule(mb, 1);
+}
+
+static int
+mirror_usable(struct mirror_backend *mb, time_t now)
+{
+	return (mb->up && mb->ejected <= now);
+}
+
+/*
+ * Start a non-blocking connect to the backend from the connecting
+ * interface.  The connect may complete later.
+ */
+static int
+mirror_connect_nb(struct mirror_backend *mb)
+{
+	struct net_source *src;
+	int sock, xerrno;
+
+	if ((sock = socket(mb->ai->ai_family, SOCK_STREAM, 0)) == -1)
+		return (-1);
+
+	src = net_source(mb->mirror->conn, mb->ai->ai_addr, NULL);
+	if (fcntl(sock, F_SETFL, O_NONBLOCK) == -1 ||
+	    (src != NULL &&
+		bind(sock, src->ai->ai_addr, src->ai->ai_addrlen) == -1) ||
+	    (connect(sock, mb->ai->ai_addr, mb->ai->ai_addrlen) == -1 &&
+		errno != EINPROGRESS)) {
+		xerrno = errno;
+		close(sock);
+		errno = xerrno;
 		return (-1);
 	}
 
-	return (remsock);
+	return (sock);
+}
+
+static void
+mirror_probe_schedule(struct mirror_backend *mb, int secs)
+{
+	struct timeval tv;
+
+	timerclear(&tv);
+	tv.tv_sec = secs;
+
+	evtimer_set(&mb->probeev, mirror_probe, mb);
+	if (evtimer_add(&mb->probeev, &tv) == -1)
+		warnv(0, "evtimer_add()");
+}
+
+/*
+ * Active probe: a non-blocking connect to the backend.
+ */
+static void
+mirror_probe(int fd, short ev, void *data)
+{
+	struct mirror_backend *mb = data;
+	struct timeval tv;
+	int sock;
+
+	if ((sock = mirror_connect_nb(mb)) == -1) {
+		warnv(2, "Probe for mirror %s", mb->name);
+		mirror_probe_result(mb, 0);
+		return;
+	}
+
+	mb->probesock = sock;
+
+	timerclear(&tv);
+	tv.tv_sec = mirror_health.timeout;
+
+	event_set(&mb->probeev, sock, EV_WRITE, mirror_probe_done, mb);
+	if (event_add(&mb->probeev, &tv) == -1) {
+		warnv(0, "event_add()");
+		close(sock);
+		mb->probesock = -1;
+		mirror_probe_schedule(mb, mirror_health.interval);
+	}
+}
+
+static void
+mirror_probe_done(int fd, short ev, void *data)
+{
+	struct mirror_backend *mb = data;
+	socklen_t len;
+	int error = ETIMEDOUT;
+
+	if (ev & EV_WRITE) {
+		len = sizeof(error);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+			error = errno;
+	}
+
+	close(fd);
+	mb->probesock = -1;
+
+	if (error != 0) {
+		errno = error;
+		warnv(2, "Probe for mirror %s", mb->name);
+	}
+
+	mirror_probe_result(mb, error == 0);
+}
+
+static void
+mirror_probe_result(struct mirror_backend *mb, int ok)
+{
+	mb->probes++;
+
+	if (ok) {
+		mb->fall = 0;
+		if (!mb->up && ++mb->rise >= mirror_health.rise) {
+			warnxv(0, "Mirror %s is up", mb->name);
+			mb->up = 1;
+		}
+	} else {
+		mb->probefails++;
+		mb->rise = 0;
+		if (mb->up && ++mb->fall >= mirror_health.fall) {
+			warnxv(0, "Mirror %s is down", mb->name);
+			mb->up = 0;
+		}
+	}
+
+	mirror_probe_schedule(mb, mirror_health.interval);
+}
+
+/*
+ * Forked children must neither probe nor hold probe sockets.  The
+ * socket is closed before event_del(), as in net_setup_cleanup(), so
+ * the listener's own registration is left alone.
+ */
+static void
+mirror_cleanup(void *_m)
+{
+	struct mirror *m = _m;
+	struct mirror_backend *mb;
+	u_int i;
+
+	for (i = 0; i < m->nbackends; i++) {
+		mb = &m->backends[i];
+		if (mb->probesock != -1) {
+			close(mb->probesock);
+			mb->probesock = -1;
+		}
+		event_del(&mb->probeev);
+
+		while (!TAILQ_EMPTY(&mb->pool))
+			mirror_pool_drop(TAILQ_FIRST(&mb->pool), 0);
+		event_del(&mb->poolev);
+	}
+}
+
+/* FNV-1a */
+static u_int32_t
+mirror_hash(const void *_buf, size_t len)
+{
+	const u_char *buf = _buf;
+	u_int32_t h = 2166136261U;
+
+	while (len-- > 0) {
+		h ^= *buf++;
+		h *= 16777619U;
+	}
+
+	return (h);
+}
+
+static void
+mirror_buildring(struct mirror *m)
+{
+	struct mirror_backend *mb;
+	struct mirror_point *mp;
+	char key[NI_MAXHOST + NI_MAXSERV + 16];
+	u_int i;
+	int j;
+
+	for (i = 0; i < m->nbackends; i++)
+		m->npoints += MIRROR_POINTS * m->backends[i].weight;
+
+	if ((m->ring = calloc(m->npoints, sizeof(*m->ring))) == NULL)
+		errv(0, 1, "calloc()");
+
+	mp = m->ring;
+	for (i = 0; i < m->nbackends; i++) {
+		mb = &m->backends[i];
+		for (j = 0; j < MIRROR_POINTS * mb->weight; j++, mp++) {
+			snprintf(key, sizeof(key), "%s#%d", mb->name, j);
+			mp->hash = mirror_hash(key, strlen(key));
+			mp->mb = mb;
+		}
+	}
+
+	qsort(m->ring, m->npoints, sizeof(*m->ring), mirror_pointcmp);
+}
+
+static int
+mirror_pointcmp(const void *_a, const void *_b)
+{
+	const struct mirror_point *a = _a, *b = _b;
+
+	if (a->hash < b->hash)
+		return (-1);
+	return (a->hash > b->hash);
 }
@@ -17,6 +17,7 @@
 #include <sys/time.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <net/if.h>
 
@@ -36,15 +37,27 @@
 
 #include "atomicio.h"
 #include "access.h"
+#include "auth.h"
+#include "breaker.h"
 #include "cleanup.h"
+#include "dest.h"
+#include "expanda.h"
 #include "net.h"
+#include "accesslog.h"
+#include "capture.h"
 #include "print.h"
 #include "nylon.h"
+#include "stats.h"
+#include "metrics.h"
 
 /* Methods */
 #include "socks4.h"
 #include "socks5.h"
+#include "http.h"
+#include "proxyhdr.h"
 #include "mirror.h"
+#include "chain.h"
+#include "tunnel.h"
 
 /* Only IPv4 ... for now */
 #define MAKEHINTS(x) do {              \
@@ -57,6 +70,17 @@
 
 #define BUFFERSZ 1024
 
+/* Pending TCP Fast Open requests allowed on a listener */
+#define FASTOPEN_QLEN 16
+
+/* From <linux/netfilter_ipv4.h> */
+#if defined(__linux__) && !defined(SO_ORIGINAL_DST)
+#define SO_ORIGINAL_DST 80
+#endif
+
+/* Seconds for a load balancer to send the PROXY header */
+#define NET_PROXYHDR_TIMEOUT 5
+
 struct proxydesc {
 	int                 sock;
 	char                hostname[NI_MAXHOST];
@@ -67,31 +91,56 @@ struct proxydesc {
 	u_int               pos;
 	struct event       *ev;
 	struct proxydesc   *dst;
+	int                 stat;	/* Counts the bytes read */
+	int                 first;	/* Stamp of the first read, or -1 */
+	int                 capture;	/* Reads are from, or -1 */
 };
 
 struct listenq {
 	struct event          ev;
 	int                   sock;
 	struct conndesc      *conn;
+	int                   stats;	/* Listener index */
 	TAILQ_ENTRY(listenq)  next;
 };
 
 
 static TAILQ_HEAD(listenqh, listenq) listenq_head;
+
+/* A client whose PROXY header has not arrived yet */
+struct net_pending {
+	struct event             ev;
+	struct negdesc           nd;	/* Collects the PROXY header */
+	struct sockaddr_in       cli_in;
+	struct conndesc         *conn;
+	TAILQ_ENTRY(net_pending) next;
+};
+
+static TAILQ_HEAD(net_pendingh, net_pending) net_pending_head =
+    TAILQ_HEAD_INITIALIZER(net_pending_head);
+
 extern cleanup_t *cleanup;
 static char connstr[512];
 
 static struct addrinfo  *get_ai_from_ifip(char *, char *);
-static struct addrinfo  *get_ai_from_addrpair(char *);
 static void              proxy(int, short, void *);
 static struct proxydesc *newdesc(u_int);
 static struct proxydesc *freedesc(struct proxydesc *);
 static void              schedule(struct proxydesc *);
 static void              net_accept(int, short, void *);
-static int               net_negotiate(int, struct conndesc *);
-static int               net_setup_proxy(int, int);
+static void              net_proxyhdr(int, short, void *);
+static void              net_sources(struct conndesc *, char *, char *);
+static void              net_source_init(struct net_source *, char *);
+static void              net_routes(struct conndesc *, char *);
+static void              net_client(struct conndesc *, struct negdesc *,
+                             struct sockaddr_in *);
+static int               net_negotiate(struct negdesc *, struct conndesc *);
+static int               net_transparent(struct negdesc *, struct conndesc *);
+static int               net_setup_proxy(int, int, struct negdesc *);
 static void              net_setup_proxy_cleanup(void *);
 static void              net_setup_cleanup(void *);
+static int               net_connect_fastopen(int, struct sockaddr *,
+                             socklen_t, struct negdesc *, size_t);
 
 /* From nylon.c */
 void signal_setup(void);
@@ -132,14 +181,17 @@ _try_resolve_proxydesc(struct proxydesc *d, int flags)
  */
 int
 net_setup(char *ifip_bind, char *ifip_connect, char *port, char *mirror_addr,
-    char *chain_addr, int support)
+    char *chain_addr, int support, int options)
 {
 	int servsock = -1, on = 1, error;
 	struct conndesc *conn;
 	struct addrinfo hints, *ai;
 	struct listenq *lq;
 	char xhost[NI_MAXHOST], xport[NI_MAXSERV];
+	char name[NI_MAXHOST + NI_MAXSERV + 1];
 	static char portstr[NI_MAXSERV];
+	extern char *mirror_policy, *tunnel_addr, *tunnel_listen;
+	extern char *source_policy, *route_file;
 
 	TAILQ_INIT(&listenq_head);
 
@@ -147,21 +199,41 @@ net_setup(char *ifip_bind, char *ifip_connect, char *port, char *mirror_addr,
 		errv(0, 1, "calloc()");
 
 	if (mirror_addr != NULL) {
-		if ((conn->mirror_ai = get_ai_from_addrpair(mirror_addr)) == NULL)
-			errxv(0, 1, "Error resolving host:pair address");
+		conn->mirror = mirror_new(mirror_addr, mirror_policy);
 		if (port == NULL) {
 			snprintf(portstr, sizeof(portstr), "%i",
 			    ntohs(((struct sockaddr_in *)
-				      conn->mirror_ai->ai_addr)->sin_port));
+				conn->mirror->backends[0].ai->ai_addr)->sin_port));
 			port = portstr;
 		}
 	}
 
 	if (chain_addr != NULL)
-		if ((conn->chain_ai = get_ai_from_addrpair(chain_addr)) == NULL)
-			errxv(0, 1, "Error resolving host:pair address");
+		conn->chain = chain_new(chain_addr);
+
+	if (conn->mirror != NULL && ISSET(options, NET_OPT_TRANSPARENT))
+		errxv(0, 1, "Mirror mode and transparent mode "
+		    "cannot be used together");
+
+	if (tunnel_addr != NULL || tunnel_listen != NULL) {
+		if (conn->chain != NULL && tunnel_addr != NULL)
+			errxv(0, 1, "Upstream proxies and a tunnel peer "
+			    "cannot be used together");
+		conn->tunnel = tunnel_new(tunnel_addr, tunnel_listen);
+	}
+
+	/* Only SOCKS5 has a way to carry a password */
+	if (auth_file != NULL) {
+		if (conn->mirror != NULL || ISSET(options, NET_OPT_TRANSPARENT))
+			errxv(0, 1, "Authentication needs SOCKS5 negotiation");
+		if (!ISSET(support, NET_SUPPORT_SOCKS5))
+			errxv(0, 1, "Authentication needs SOCKS5 support");
+		CLR(support, NET_SUPPORT_SOCKS4 | NET_SUPPORT_HTTP);
+		auth_setup();
+	}
 
 	conn->support = support;
+	conn->options = options;
 
 	if (ifip_bind != NULL) {
 		if ((conn->serv_ai = get_ai_from_ifip(ifip_bind, port)) == NULL)
@@ -175,14 +247,10 @@ net_setup(char *ifip_bind, char *ifip_connect, char *port, char *mirror_addr,
 			    gai_strerror(error));
 	}
 
-	if (ifip_connect != NULL) {
-        if ((conn->bind_ai = get_ai_from_ifip(ifip_connect, NULL)) == NULL)
-		    errxv(0, 1, "Error resolving connecting if/ip address");
-        // check if parameter is not an IP
-        if (strchr(ifip_connect, '.') == NULL) {
-            conn->bind_if_name = ifip_connect;
-        }
-    }
+	if (ifip_connect != NULL)
+		net_sources(conn, ifip_connect, source_policy);
+	if (route_file != NULL)
+		net_routes(conn, route_file);
 
 	for (ai = conn->serv_ai; ai != NULL; ai = ai->ai_next) {
 		if ((servsock = socket(ai->ai_family,
@@ -196,9 +264,32 @@ net_setup(char *ifip_bind, char *ifip_connect, char *port, char *mirror_addr,
 		if (fcntl(servsock, F_SETFL, O_NONBLOCK) == -1)
 			errv(0, 1, "fcntl()");
 
+		/* Accept connections addressed to anyone */
+		if (ISSET(options, NET_OPT_TPROXY)) {
+#ifdef IP_TRANSPARENT
+			if (setsockopt(servsock, SOL_IP, IP_TRANSPARENT,
+				&on, sizeof(on)) == -1)
+				errv(0, 1, "setsockopt(IP_TRANSPARENT)");
+#else
+			errxv(0, 1, "TPROXY not supported on this system");
+#endif /* IP_TRANSPARENT */
+		}
+
 		if (bind(servsock, ai->ai_addr, ai->ai_addrlen) == -1)
 			errv(0, 1, "bind()");
 
+		if (ISSET(options, NET_OPT_FASTOPEN)) {
+#ifdef TCP_FASTOPEN
+			int qlen = FASTOPEN_QLEN;
+
+			if (setsockopt(servsock, IPPROTO_TCP, TCP_FASTOPEN,
+				&qlen, sizeof(qlen)) == -1)
+				warnv(0, "setsockopt(TCP_FASTOPEN)");
+#else
+			warnxv(0, "TCP Fast Open not supported on this system");
+#endif /* TCP_FASTOPEN */
+		}
+
 		if (listen(servsock, 10) == -1)
 			errv(0, 1, "listen()");
 
@@ -214,6 +305,9 @@ net_setup(char *ifip_bind, char *ifip_connect, char *port, char *mirror_addr,
 
 		warnxv(0, "Listening on %s:%s", xhost, xport);
 
+		snprintf(name, sizeof(name), "%s:%s", xhost, xport);
+		lq->stats = stats_listener(name);
+
 		event_set(&lq->ev, servsock, EV_READ, net_accept, lq);
 		if (event_add(&lq->ev, NULL) == -1)
 			errv(0, 1, "event_add()");
@@ -224,14 +318,135 @@ net_setup(char *ifip_bind, char *ifip_connect, char *port, char *mirror_addr,
 	if (cleanup_add(cleanup, net_setup_cleanup, &listenq_head) == -1)
 		errxv(0, 1, "cleanup_add()");
 
+	if (conn->chain != NULL)
+		chain_start(conn->chain, conn);
+	if (conn->tunnel != NULL)
+		tunnel_start(conn->tunnel, conn);
+	if (conn->mirror != NULL)
+		mirror_start(conn->mirror, conn);
+
 	return (servsock);
 }
 
+/*
+ * list holds the addresses or interfaces to make outgoing connections
+ * from.  Spreading them out over several gives more source ports to
+ * the popular destinations.
+ */
+static void
+net_sources(struct conndesc *conn, char *list, char *policy)
+{
+	struct net_source *src;
+	char **arr, **a;
+
+	if (policy == NULL || strcmp(policy, "round-robin") == 0)
+		conn->source_policy = NET_SOURCE_ROUNDROBIN;
+	else if (strcmp(policy, "hash") == 0)
+		conn->source_policy = NET_SOURCE_HASH;
+	else
+		errxv(0, 1, "Unknown connecting policy: %s", policy);
+
+	if ((arr = expanda(list)) == NULL)
+		errxv(0, 1, "Error expanding connecting if/ip list");
+
+	for (a = arr; *a != NULL; a++)
+		conn->nsources++;
+	if (conn->nsources == 0)
+		errxv(0, 1, "Empty connecting if/ip list");
+
+	if ((conn->sources = calloc(conn->nsources,
+		 sizeof(*conn->sources))) == NULL)
+		errv(0, 1, "calloc()");
+
+	for (a = arr, src = conn->sources; *a != NULL; a++, src++)
+		net_source_init(src, *a);
+
+	freea(arr);
+}
+
+static void
+net_source_init(struct net_source *src, char *ifip)
+{
+	if ((src->ai = get_ai_from_ifip(ifip, NULL)) == NULL)
+		errxv(0, 1, "Error resolving connecting if/ip address %s",
+		    ifip);
+	/* Not an IP address; bind to the device too */
+	if (strchr(ifip, '.') == NULL &&
+	    (src->if_name = strdup(ifip)) == NULL)
+		errv(0, 1, "strdup()");
+}
+
+/*
+ * Each line of path is a destination (see dest_add()) followed by the
+ * interface or address to reach it from.  Destinations without a rule
+ * use the connecting interfaces.
+ */
+static void
+net_routes(struct conndesc *conn, char *path)
+{
+	struct net_source *src;
+	char line[1024], match[256], ifip[64], *p;
+	u_int lineno = 0;
+	FILE *fp;
+	int n;
+
+	if ((conn->routes = dest_new()) == NULL)
+		errv(0, 1, "dest_new()");
+
+	if ((fp = fopen(path, "r")) == NULL)
+		errv(0, 1, "%s", path);
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		if ((n = sscanf(line, "%255s %63s", match, ifip)) <= 0)
+			continue;
+		if (n != 2)
+			errxv(0, 1, "%s:%u: No interface for %s", path, lineno,
+			    match);
+
+		if ((src = calloc(1, sizeof(*src))) == NULL)
+			errv(0, 1, "calloc()");
+		net_source_init(src, ifip);
+		if (dest_add(conn->routes, match, src) == -1)
+			errxv(0, 1, "%s:%u: Bad or duplicate destination %s",
+			    path, lineno, match);
+	}
+
+	fclose(fp);
+
+	warnxv(1, "Loaded %u routes from %s", conn->routes->nrules, path);
+}
+
+/*
+ * Report the state of each listener (SIGUSR1).
+ */
+void
+net_report(void)
+{
+	struct listenq *lq;
+	struct conndesc *conn = NULL;
+
+	TAILQ_FOREACH(lq, &listenq_head, next) {
+		if (lq->conn == conn)
+			continue;
+		conn = lq->conn;
+		if (conn->chain != NULL)
+			chain_report(conn->chain);
+		if (conn->tunnel != NULL)
+			tunnel_report(conn->tunnel);
+		if (conn->mirror != NULL)
+			mirror_report(conn->mirror);
+	}
+}
+
 static void
 net_setup_cleanup(void *_head)
 {
 	struct listenqh *head = (struct listenqh *)_head;
 	struct listenq *lq;
+	struct net_pending *np;
 
 	while ((lq = TAILQ_FIRST(head)) != NULL) {
 		TAILQ_REMOVE(head, lq, next);
@@ -240,43 +455,227 @@ net_setup_cleanup(void *_head)
 		event_del(&lq->ev);
 		free(lq);
 	}
+
+	while ((np = TAILQ_FIRST(&net_pending_head)) != NULL) {
+		TAILQ_REMOVE(&net_pending_head, np, next);
+		close(np->nd.sock);
+		event_del(&np->ev);
+		free(np);
+	}
 }
 
 static void
 net_accept(int fd, short ev, void *data)
 {
-	struct sockaddr cliaddr;
-	socklen_t addrlen = sizeof(cliaddr);
-	int clisock, remsock;
+	struct sockaddr_in cli_in;
+	socklen_t addrlen = sizeof(cli_in);
+	int clisock;
 	struct listenq *lq = (struct listenq *)data;
 	struct conndesc *conn = lq->conn;
+	struct negdesc nd;
+	struct net_pending *np;
+	struct timeval tv;
 
-	if ((clisock = accept(fd, &cliaddr, &addrlen)) == -1) {
+	if ((clisock = accept(fd, (struct sockaddr *)&cli_in,
+		 &addrlen)) == -1) {
 		warnv(0, "accept()");
 		goto out;
 	}
 
-	if (!access_host((struct sockaddr_in *)&cliaddr)) {
-		warnxv(2, "Client %s rejected",
-		    inet_ntoa(((struct sockaddr_in *)&cliaddr)->sin_addr));
+	memset(&nd, 0, sizeof(nd));
+	nd.sock = clisock;
+	nd.presock = -1;
+	nd.listener = lq->stats;
+	nd.accepted = stats_clock();
+
+	if (!ISSET(conn->options, NET_OPT_PROXYHDR)) {
+		net_client(conn, &nd, &cli_in);
+		goto out;
+	}
+
+	/* Anyone else could claim to be any client */
+	if (!access_proxy(&cli_in)) {
+		warnxv(1, "PROXY header from untrusted %s",
+		    inet_ntoa(cli_in.sin_addr));
+		stats_accept(lq->stats, 0);
+		close(clisock);
+		goto out;
+	}
+
+	/* Wait for the PROXY header, without holding up the listener */
+	if ((np = calloc(1, sizeof(*np))) == NULL) {
+		warnv(0, "calloc()");
+		close(clisock);
+		goto out;
+	}
+	np->conn = conn;
+	memcpy(&np->nd, &nd, sizeof(np->nd));
+	memcpy(&np->cli_in, &cli_in, sizeof(np->cli_in));
+
+	timerclear(&tv);
+	tv.tv_sec = NET_PROXYHDR_TIMEOUT;
+
+	event_set(&np->ev, clisock, EV_READ, net_proxyhdr, np);
+	if (event_add(&np->ev, &tv) == -1) {
+		warnv(0, "event_add()");
+		close(clisock);
+		free(np);
+		goto out;
+	}
+	TAILQ_INSERT_TAIL(&net_pending_head, np, next);
+
+ out:
+	if (event_add(&lq->ev, NULL) == -1)
+		errv(0, 1, "event_add()");
+}
+
+/*
+ * Collect the PROXY header, which may come in several segments, within
+ * NET_PROXYHDR_TIMEOUT of the accept.  It names the real client, which
+ * the access lists and the rest of the connection see instead of the
+ * load balancer.
+ */
+static void
+net_proxyhdr(int fd, short ev, void *data)
+{
+	struct net_pending *np = data;
+	struct negdesc *nd = &np->nd;
+	struct sockaddr_in src_in, dst_in;
+	struct timeval tv;
+	u_int64_t deadline, now;
+	ssize_t ret;
+	int hlen;
+
+	TAILQ_REMOVE(&net_pending_head, np, next);
+
+	if (ev & EV_TIMEOUT)
+		goto timeout;
+
+	do {
+		ret = recv(fd, nd->buf + nd->len, sizeof(nd->buf) - nd->len,
+		    MSG_DONTWAIT);
+	} while (ret == -1 && errno == EINTR);
+	if (ret == -1 && errno == EAGAIN)
+		goto more;
+	if (ret <= 0) {
+		if (ret == -1)
+			warnv(1, "recv()");
+		goto fail;
+	}
+	nd->len += ret;
+
+	hlen = proxyhdr_parse(nd->buf, nd->len, &src_in, &dst_in);
+	if (hlen == NET_PARSE_MORE && nd->len < sizeof(nd->buf))
+		goto more;
+	if (hlen <= 0) {
+		warnxv(1, "Bad PROXY header from %s",
+		    inet_ntoa(np->cli_in.sin_addr));
+		goto fail;
+	}
+	nd->off = hlen;
+
+	if (src_in.sin_family == AF_INET) {
+		memcpy(&np->cli_in, &src_in, sizeof(np->cli_in));
+		memcpy(&nd->srv_in, &dst_in, sizeof(nd->srv_in));
+	}
+
+	net_client(np->conn, nd, &np->cli_in);
+	free(np);
+	return;
+
+ more:
+	deadline = nd->accepted + NET_PROXYHDR_TIMEOUT * 1000000ULL;
+	if ((now = stats_clock()) >= deadline)
+		goto timeout;
+
+	timerclear(&tv);
+	tv.tv_sec = (deadline - now) / 1000000;
+	tv.tv_usec = (deadline - now) % 1000000;
+
+	if (event_add(&np->ev, &tv) == -1) {
+		warnv(0, "event_add()");
+		goto fail;
+	}
+	TAILQ_INSERT_TAIL(&net_pending_head, np, next);
+	return;
+
+ timeout:
+	warnxv(1, "No PROXY header from %s", inet_ntoa(np->cli_in.sin_addr));
+ fail:
+	close(fd);
+	free(np);
+}
+
+/*
+ * Check the client against the access lists and fork a process to
+ * serve it.  Closes the client socket in the listening process.
+ */
+static void
+net_client(struct conndesc *conn, struct negdesc *nd,
+    struct sockaddr_in *cli_in)
+{
+	int clisock = nd->sock, remsock, slot;
+	pid_t pid;
+
+	stats_stamps_start(nd->accepted);
+	if (!access_host(cli_in)) {
+		warnxv(2, "Client %s rejected", inet_ntoa(cli_in->sin_addr));
+		stats_accept(nd->listener, 0);
+		accesslog_reject(cli_in);
 		goto out;
 	}
+	stats_accept(nd->listener, 1);
+	stats_stamp(STATS_T_ACL);
+
+	memcpy(&nd->cli_in, cli_in, sizeof(nd->cli_in));
 
-	switch (fork()) {
+	if (conn->mirror != NULL &&
+	    (nd->mb = mirror_select(conn->mirror, cli_in)) != NULL)
+		nd->presock = mirror_pool_take(nd->mb);
+
+	if (conn->tunnel != NULL && tunnel_prefork(conn->tunnel) == -1)
+		goto out;
+
+	/* The child takes the next source in the rotation */
+	conn->source_next++;
+
+	slot = stats_fork(nd->listener);
+	pid = fork();
+	if (conn->tunnel != NULL)
+		tunnel_postfork(conn->tunnel, pid);
+	stats_forked(slot, pid);
+
+	switch (pid) {
 	case -1:
 		warnv(0, "fork()");
 		break;
 	case 0:
-		if ((remsock = net_negotiate(clisock, conn)) == NET_FAIL) {
+		stats_stamp(STATS_T_FORK);
+		metrics_forked();
+		accesslog_start(nd);
+		remsock = net_negotiate(nd, conn);
+		stats_replied(remsock == NET_FAIL ? STATS_FAIL : STATS_OK);
+		if (remsock == NET_FAIL) {
+			stats_negfail();
 			close(clisock);
 			errxv(1, 1, "Negotiation failed");
 		} else if (remsock == NET_NOPROXY) {
 			/* SOCKS4A command 0xf0 succeeded */
+			accesslog_reason(ACCESSLOG_CLOSED);
 			exit(0);
 		}
 
 		assert(remsock >= 0);
 
+		/*
+		 * Client data that arrived with the request and was
+		 * not already sent along with the connect.
+		 */
+		if (nd->off < nd->len &&
+		    atomicio(write, remsock, nd->buf + nd->off,
+			nd->len - nd->off) != nd->len - nd->off)
+			errv(1, 1, "write()");
+
 		cleanup_cleanup(cleanup);
 		cleanup_free(cleanup);
 
@@ -285,7 +684,7 @@ net_accept(int fd, short ev, void *data)
 
 		/* Create new event loop */
 		event_init();
-		if (net_setup_proxy(clisock, remsock) == -1) {
+		if (net_setup_proxy(clisock, remsock, nd) == -1) {
 			cleanup_cleanup(cleanup);
 			errxv(0, 1, "Error setting up proxy");
 		}
@@ -293,17 +692,21 @@ net_accept(int fd, short ev, void *data)
 		event_dispatch();
 		errxv(0, 1, "Event error");
 	default:
+		if (nd->mb != NULL)
+			mirror_started(conn->mirror, nd->mb, pid);
 		break;
 	}
 
+	/* The child owns the pooled connection now */
+	if (nd->presock != -1)
+		close(nd->presock);
+
  out:
 	close(clisock);
-	if (event_add(&lq->ev, NULL) == -1)
-		errv(0, 1, "event_add()");
 }
 
 static int
-net_setup_proxy(int clisock, int remsock)
+net_setup_proxy(int clisock, int remsock, struct negdesc *nd)
 {
 	struct proxydesc *clidesc, *remdesc;
 	socklen_t len;
@@ -316,7 +719,16 @@ net_setup_proxy(int clisock, int remsock)
 		goto fail1;
 
 	clidesc->sock = clisock;
+	clidesc->stat = STATS_BYTES_CLIENT;
+	clidesc->first = STATS_T_FIRST_CLIENT;
 	remdesc->sock = remsock;
+	remdesc->stat = STATS_BYTES_REMOTE;
+	remdesc->first = STATS_T_FIRST_REMOTE;
+	if (capture_start(nd)) {
+		clidesc->capture = CAPTURE_FROM_CLIENT;
+		remdesc->capture = CAPTURE_FROM_REMOTE;
+	} else
+		clidesc->capture = remdesc->capture = -1;
 
 	if (fcntl(clisock, F_SETFL, O_NONBLOCK) == -1) {
 		warnv(0, "fcntl()");
@@ -327,15 +739,24 @@ net_setup_proxy(int clisock, int remsock)
 		goto fail2;
 	}
 
-	len = sizeof(clidesc->in);
-	if (getpeername(clisock, (struct sockaddr *)&clidesc->in, &len) == -1) {
-		warnv(0, "Failed to retrieve address information from client");
-		goto fail2;
-	}
+	/* As told by the PROXY header, if there was one */
+	memcpy(&clidesc->in, &nd->cli_in, sizeof(clidesc->in));
+
 	len = sizeof(remdesc->in);
-	if (getpeername(remsock, (struct sockaddr *)&remdesc->in, &len) == -1) {
-		warnv(0, "Failed to retrieve address information from target");
-		goto fail2;
+	if (getpeername(remsock, (struct sockaddr *)&remdesc->in, &len) == -1 ||
+	    remdesc->in.sin_family != AF_INET) {
+		/*
+		 * A Fast Open connect to the mirror is not on the
+		 * wire until the first write, and a tunnelled
+		 * connection is a local socket.
+		 */
+		if (nd->rem_in.sin_family == AF_INET) {
+			memcpy(&remdesc->in, &nd->rem_in, sizeof(remdesc->in));
+		} else {
+			warnv(0,
+			    "Failed to retrieve address information from target");
+			goto fail2;
+		}
 	}
 
 	flags = NI_NOFQDN;
@@ -386,48 +807,462 @@ net_setup_proxy_cleanup(void *_desc)
 }
 
 static int
-net_negotiate(int clisock, struct conndesc *conn)
+net_negotiate(struct negdesc *nd, struct conndesc *conn)
 {
-	u_char vn;
 	int remsock = -1;
 
 	/* Mirror mode */
-	if (conn->mirror_ai != NULL)
-		return (mirror_setup(conn));
+	if (conn->mirror != NULL) {
+		stats_mode(STATS_MODE_MIRROR);
+		return (mirror_setup(nd, conn));
+	}
 
-	/* SOCKS */
-	if (atomicio(read, clisock, &vn, 1) != 1) {
-		warnv(0, "read()");
+	/* Transparent mode; there is no negotiation */
+	if (ISSET(conn->options, NET_OPT_TRANSPARENT)) {
+		stats_mode(STATS_MODE_TRANSPARENT);
+		return (net_transparent(nd, conn));
+	}
+
+	/* The first byte tells the protocol; it is left for the parsers */
+	if (nd->off == nd->len && net_negfill(nd) <= 0) {
+		warnv(0, "recv()");
+		stats_cause(STATS_NEG_EOF);
 		return (-1);
 	}
 
-	/* SOCKS 4 and SOCKS 5 supported */
-	switch (vn) {
+	/* SOCKS 4, SOCKS 5 and HTTP CONNECT supported */
+	switch (nd->buf[nd->off]) {
 	case 4:
 		if (!ISSET(conn->support, NET_SUPPORT_SOCKS4)) {
 			warnxv(1, "SOCKS4 support turned off");
 			return (-1);
 		}
-		remsock = socks4_negotiate(clisock, conn);
+		stats_mode(STATS_MODE_SOCKS4);
+		remsock = socks4_negotiate(nd, conn);
 		break;
 	case 5:
 		if (!ISSET(conn->support, NET_SUPPORT_SOCKS5)) {
 			warnxv(1, "SOCKS5 support turned off");
 			return (-1);
 		}
-		remsock = socks5_negotiate(clisock, conn);
+		stats_mode(STATS_MODE_SOCKS5);
+		remsock = socks5_negotiate(nd, conn);
 		break;
 	default:
+		/* Anything else is taken for an HTTP request line */
+		if (!ISSET(conn->support, NET_SUPPORT_HTTP)) {
+			warnxv(1, "Unknown protocol from client");
+			return (-1);
+		}
+		stats_mode(STATS_MODE_HTTP);
+		remsock = http_negotiate(nd, conn);
 		break;
 	}
 
 	return (remsock);
 }
 
+/*
+ * Whether an address belongs to this host: only local addresses can
+ * be bound without IP_TRANSPARENT.
+ */
+static int
+net_islocal(struct in_addr addr)
+{
+	struct sockaddr_in sin;
+	int sock, ret;
+
+	if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		return (1);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr = addr;
+	ret = bind(sock, (struct sockaddr *)&sin, sizeof(sin)) == 0 ||
+	    errno != EADDRNOTAVAIL;
+	close(sock);
+
+	return (ret);
+}
+
+/*
+ * Connect to where the client was going before the firewall sent it
+ * to us.  With REDIRECT, netfilter remembers the original destination;
+ * with TPROXY the connection is still addressed to it.
+ */
+static int
+net_transparent(struct negdesc *nd, struct conndesc *conn)
+{
+	struct sockaddr_in dst_in, lq_in;
+	struct listenq *lq;
+	socklen_t len = sizeof(dst_in);
+
+	if (ISSET(conn->options, NET_OPT_REDIRECT)) {
+#ifdef SO_ORIGINAL_DST
+		if (getsockopt(nd->sock, SOL_IP, SO_ORIGINAL_DST, &dst_in,
+			&len) == -1) {
+			warnv(1, "getsockopt(SO_ORIGINAL_DST)");
+			return (-1);
+		}
+#else
+		warnxv(0, "REDIRECT not supported on this system");
+		return (-1);
+#endif /* SO_ORIGINAL_DST */
+	} else if (getsockname(nd->sock, (struct sockaddr *)&dst_in,
+		       &len) == -1) {
+		warnv(1, "getsockname()");
+		return (-1);
+	}
+
+	if (dst_in.sin_family != AF_INET) {
+		warnxv(1, "Transparent connection not over IPv4");
+		return (-1);
+	}
+
+	/*
+	 * Connected to us directly rather than sent by the firewall.  A
+	 * wildcard listener only matches our own addresses; with TPROXY
+	 * the remote end may well use the same port.
+	 */
+	TAILQ_FOREACH(lq, &listenq_head, next) {
+		len = sizeof(lq_in);
+		if (getsockname(lq->sock, (struct sockaddr *)&lq_in,
+			&len) == 0 && lq_in.sin_port == dst_in.sin_port &&
+		    (lq_in.sin_addr.s_addr == dst_in.sin_addr.s_addr ||
+			(lq_in.sin_addr.s_addr == INADDR_ANY &&
+			    net_islocal(dst_in.sin_addr)))) {
+			warnxv(1, "Transparent connection to ourselves");
+			return (-1);
+		}
+	}
+
+	warnxv(2, "Transparent connection to %s:%d",
+	    inet_ntoa(dst_in.sin_addr), ntohs(dst_in.sin_port));
+
+	memcpy(&nd->rem_in, &dst_in, sizeof(nd->rem_in));
+
+	/* Whatever the client sent already goes out with the connect */
+	return (net_connect(conn, (struct sockaddr *)&dst_in,
+		    sizeof(dst_in), nd));
+}
+
+/*
+ * Open an outgoing connection on behalf of a client, from the
+ * connecting interface if one is configured.  Whatever the client
+ * has sent past its request is forwarded as soon as the connection
+ * is up, rather than waiting for the relay to start.
+ */
+int
+net_connect(struct conndesc *conn, struct sockaddr *sa, socklen_t salen,
+    struct negdesc *nd)
+{
+	struct sockaddr_in *sin = NULL;
+	struct timeval tv;
+	u_int64_t start;
+	size_t len;
+	int sock;
+	extern int connect_timeout;
+
+	len = nd != NULL ? nd->len - nd->off : 0;
+
+	if (nd != NULL && sa->sa_family == AF_INET)
+		memcpy(&nd->rem_in, sa, sizeof(nd->rem_in));
+
+	/* Mirror backends (no nd) are ours; client targets are checked */
+	if (nd != NULL &&
+	    !access_dest((struct sockaddr_in *)sa, nd->rem_host)) {
+		stats_cause(STATS_NEG_DENIED);
+		errno = EACCES;
+		return (-1);
+	}
+
+	start = stats_stamp(STATS_T_CONNECT);
+
+	/* Through the tunnel; the peer connects */
+	if (conn->tunnel != NULL && conn->tunnel->peer_ai != NULL) {
+		if ((sock = tunnel_connect(conn->tunnel, sa, salen)) == -1) {
+			warnv(1, "Tunnel connect");
+			goto err;
+		}
+		goto connected;
+	}
+
+	/* Through an upstream proxy */
+	if (conn->chain != NULL) {
+		if ((sock = chain_connect(conn, sa, salen)) == -1)
+			goto err;
+		goto connected;
+	}
+
+	/* Destinations that keep timing out are not waited for */
+	if (nd != NULL && sa->sa_family == AF_INET) {
+		sin = (struct sockaddr_in *)sa;
+		if (!breaker_allow(sin)) {
+			errno = EHOSTUNREACH;
+			goto err;
+		}
+	}
+
+	if ((sock = net_socket(conn, sa,
+		 nd != NULL ? nd->rem_host : NULL)) == -1)
+		goto err;
+
+	/* Bounds a blocking connect() */
+	if (connect_timeout > 0) {
+		timerclear(&tv);
+		tv.tv_sec = connect_timeout;
+		if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv,
+			sizeof(tv)) == -1)
+			warnv(1, "setsockopt(SO_SNDTIMEO)");
+	}
+
+	if (ISSET(conn->options, NET_OPT_FASTOPEN_CONNECT)) {
+		switch (net_connect_fastopen(sock, sa, salen, nd, len)) {
+		case -1:
+			if (sin != NULL)
+				breaker_done(sin, errno);
+			goto fail;
+		case 0:
+			break;
+		default:
+			if (sin != NULL)
+				breaker_done(sin, 0);
+			stats_time(STATS_HIST_CONNECT, STATS_OK,
+			    stats_stamp(STATS_T_CONNECTED) - start);
+			return (sock);
+		}
+	}
+
+	if (connect(sock, sa, salen) == -1) {
+		warnv(0, "connect()");
+		if (sin != NULL)
+			breaker_done(sin, errno);
+		goto fail;
+	}
+	if (sin != NULL)
+		breaker_done(sin, 0);
+
+ connected:
+	if (len > 0) {
+		if (atomicio(write, sock, nd->buf + nd->off, len) != len) {
+			warnv(0, "write()");
+			goto fail;
+		}
+		nd->off = nd->len;
+	}
+
+	stats_time(STATS_HIST_CONNECT, STATS_OK,
+	    stats_stamp(STATS_T_CONNECTED) - start);
+	return (sock);
+
+ fail:
+	close(sock);
+ err:
+	stats_time(STATS_HIST_CONNECT, STATS_FAIL, stats_clock() - start);
+	stats_add(STATS_CONNECT_ERRORS, 1);
+	stats_cause(STATS_NEG_CONNECT);
+	return (-1);
+}
+
+/*
+ * Pick the source for a connection to sa, named host by the client,
+ * or NULL to leave it to the kernel.  Routes come first.  sa may be
+ * NULL when the destination is not known yet, and host when the
+ * client gave an address.
+ */
+struct net_source *
+net_source(struct conndesc *conn, struct sockaddr *sa, const char *host)
+{
+	struct net_source *src;
+	u_int32_t h, w[4];
+
+	if (conn->routes != NULL && (sa == NULL || sa->sa_family == AF_INET) &&
+	    (src = dest_lookup(conn->routes, (struct sockaddr_in *)sa,
+		host)) != NULL)
+		return (src);
+
+	if (conn->nsources == 0)
+		return (NULL);
+
+	if (conn->source_policy == NET_SOURCE_HASH && sa != NULL &&
+	    (sa->sa_family == AF_INET || sa->sa_family == AF_INET6)) {
+		if (sa->sa_family == AF_INET)
+			h = ntohl(((struct sockaddr_in *)sa)->sin_addr.s_addr);
+		else {
+			/* Folded into one word */
+			memcpy(w, &((struct sockaddr_in6 *)sa)->sin6_addr,
+			    sizeof(w));
+			h = ntohl(w[0] ^ w[1] ^ w[2] ^ w[3]);
+		}
+		/* Fibonacci hashing; the high bits are the mixed ones */
+		h *= 2654435769U;
+		return (&conn->sources[(h >> 16) % conn->nsources]);
+	}
+
+	return (&conn->sources[conn->source_next++ % conn->nsources]);
+}
+
+int
+net_socket(struct conndesc *conn, struct sockaddr *sa, const char *host)
+{
+	struct net_source *src;
+	int sock, on = 1;
+
+	if ((sock = socket(sa->sa_family, SOCK_STREAM, 0)) == -1) {
+		warnv(0, "socket()");
+		return (-1);
+	}
+
+	if ((src = net_source(conn, sa, host)) == NULL)
+		return (sock);
+
+#ifdef SO_BINDTODEVICE
+	if (src->if_name != NULL &&
+	    setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, src->if_name,
+		IFNAMSIZ - 1) == -1) {
+		warnv(0, "bind device()");
+		goto fail;
+	}
+#endif /* SO_BINDTODEVICE */
+
+#ifdef IP_BIND_ADDRESS_NO_PORT
+	/*
+	 * Leave the port to connect(), which only needs it to be unique
+	 * per destination, not across all of them.
+	 */
+	if (setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on,
+		sizeof(on)) == -1)
+		warnv(1, "setsockopt(IP_BIND_ADDRESS_NO_PORT)");
+#endif /* IP_BIND_ADDRESS_NO_PORT */
+
+	if (bind(sock, src->ai->ai_addr, src->ai->ai_addrlen) == -1) {
+		warnv(0, "bind()");
+		goto fail;
+	}
+
+	return (sock);
+
+ fail:
+	close(sock);
+	return (-1);
+}
+
+/*
+ * Connect with TCP Fast Open.  Pending client data is carried in the
+ * SYN.  Without a negotiation buffer (mirror mode) nobody waits on
+ * the outcome of the connect, so the handshake is deferred to the
+ * first write from the relay.  Returns 1 when connected, 0 when the
+ * caller should fall back to a regular connect and -1 on failure.
+ */
+static int
+net_connect_fastopen(int sock, struct sockaddr *sa, socklen_t salen,
+    struct negdesc *nd, size_t len)
+{
+	if (len > 0) {
+#ifdef MSG_FASTOPEN
+		ssize_t ret;
+
+		ret = sendto(sock, nd->buf + nd->off, len, MSG_FASTOPEN,
+		    sa, salen);
+		if (ret == -1) {
+			if (errno == EOPNOTSUPP)
+				return (0);
+			warnv(0, "sendto(MSG_FASTOPEN)");
+			return (-1);
+		}
+		nd->off += ret;
+		len -= ret;
+		if (len > 0 &&
+		    atomicio(write, sock, nd->buf + nd->off, len) != len) {
+			warnv(0, "write()");
+			return (-1);
+		}
+		nd->off = nd->len;
+		return (1);
+#endif /* MSG_FASTOPEN */
+	} else if (nd == NULL) {
+#ifdef TCP_FASTOPEN_CONNECT
+		int on = 1;
+
+		if (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+			&on, sizeof(on)) == -1)
+			warnv(1, "setsockopt(TCP_FASTOPEN_CONNECT)");
+#endif /* TCP_FASTOPEN_CONNECT */
+	}
+
+	return (0);
+}
+
+/*
+ * Append whatever the client has sent so far to the negotiation
+ * buffer with a single recv().  Returns the number of bytes read, 0
+ * on EOF and -1 on error (EAGAIN included, for non-blocking sockets).
+ */
+int
+net_negfill(struct negdesc *nd)
+{
+	ssize_t ret;
+
+	if (nd->len == sizeof(nd->buf)) {
+		warnxv(1, "Negotiation request too large");
+		errno = EMSGSIZE;
+		return (-1);
+	}
+
+	do {
+		ret = recv(nd->sock, nd->buf + nd->len,
+		    sizeof(nd->buf) - nd->len, 0);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret > 0)
+		nd->len += ret;
+
+	return (ret);
+}
+
+/*
+ * Run the parser over the unconsumed part of the buffer, reading
+ * more from the client until it has a complete request.  The parsers
+ * are stateless over the buffer, so a partial request is simply
+ * parsed again once more data has arrived.
+ */
+int
+net_negparse(struct negdesc *nd,
+    int (*parse)(const u_char *, size_t, void *), void *arg)
+{
+	int ret;
+
+	for (;;) {
+		ret = (*parse)(nd->buf + nd->off, nd->len - nd->off, arg);
+		if (ret > 0) {
+			nd->off += ret;
+			return (0);
+		}
+		if (ret == NET_PARSE_FAIL) {
+			warnxv(1, "Malformed request from client");
+			return (-1);
+		}
+
+		switch (net_negfill(nd)) {
+		case -1:
+			warnv(1, "recv()");
+			stats_cause(STATS_NEG_EOF);
+			return (-1);
+		case 0:
+			warnxv(1, "Client closed connection during negotiation");
+			stats_cause(STATS_NEG_EOF);
+			return (-1);
+		default:
+			break;
+		}
+	}
+}
+
 static void
 proxy(int fd, short ev, void *data)
 {
 	struct proxydesc *d = (struct proxydesc *)data;
+	char phases[256];
 	int ret;
 
 	/*
@@ -449,7 +1284,10 @@ proxy(int fd, short ev, void *data)
 					break;
 				}
 				cleanup_cleanup(cleanup);
-				errv(0, 1, "(%s)", connstr);
+				accesslog_reason(d->stat == STATS_BYTES_CLIENT ?
+				    ACCESSLOG_CLIENT_ERROR : ACCESSLOG_TARGET_ERROR);
+				stats_phases(phases, sizeof(phases));
+				errv(0, 1, "(%s) %s", connstr, phases);
 			}
 			break;
 		case 0:
@@ -458,10 +1296,22 @@ proxy(int fd, short ev, void *data)
 				break;
 			}
 			cleanup_cleanup(cleanup);
-			errxv(2, 0, "(%s) Terminated connection", connstr);
+			accesslog_reason(ACCESSLOG_CLOSED);
+			stats_phases(phases, sizeof(phases));
+			errxv(2, 0, "(%s) Terminated connection: %s", connstr,
+			    phases);
 			/* NOTREACHED */
 		default:
+			if (d->capture != -1)
+				capture_data(d->capture,
+				    (u_char *)d->dst->iov.iov_base + d->dst->pos,
+				    ret);
 			d->dst->pos += ret;
+			stats_add(d->stat, ret);
+			if (d->first != -1) {
+				stats_first(d->first);
+				d->first = -1;
+			}
 			break;
 		}
 	}
@@ -470,9 +1320,13 @@ proxy(int fd, short ev, void *data)
 		ret = write(d->sock, d->iov.iov_base, d->pos);
 
 		if (ret == -1) {
-			if (errno != EAGAIN) {
+			/* EINPROGRESS: deferred Fast Open connect */
+			if (errno != EAGAIN && errno != EINPROGRESS) {
 				cleanup_cleanup(cleanup);
-				errv(0, 1, "(%s)", connstr);
+				accesslog_reason(d->stat == STATS_BYTES_CLIENT ?
+				    ACCESSLOG_CLIENT_ERROR : ACCESSLOG_TARGET_ERROR);
+				stats_phases(phases, sizeof(phases));
+				errv(0, 1, "(%s) %s", connstr, phases);
 			}
 			goto out;
 		}
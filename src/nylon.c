@@ -9,6 +9,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/queue.h>
 #include <sys/time.h>
 
 #include <netinet/in.h>
@@ -18,6 +19,7 @@
 #include <unistd.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <event.h>
 
 #ifdef HAVE_CONFIG_H
@@ -25,12 +27,22 @@
 #endif /* HAVE_CONFIG_H */
 
 #include "access.h"
+#include "auth.h"
+#include "breaker.h"
+#include "hosts.h"
 #include "cfg.h"
 #include "cleanup.h"
 #include "misc.h"
 #include "nylon.h"
 #include "net.h"
+#include "accesslog.h"
+#include "capture.h"
+#include "mirror.h"
+#include "chain.h"
+#include "tunnel.h"
 #include "print.h"
+#include "stats.h"
+#include "metrics.h"
 
 #define CONF_SAVE(w, f)        \
             do {               \
@@ -41,13 +53,21 @@
 
 void usage(void);
 
-struct event sigchldev, sighupev, sigtermev, sigintev;
+struct event sigchldev, sighupev, sigtermev, sigintev, sigusr1ev;
 
 char  *conf_path;		/* Used by cfg.c  */
 char **xargv;
 int    xargc;
 int    noresolve;
 int    verbose_dump;
+int    bind_timeout;		/* Used by socks5.c */
+char  *mirror_policy;		/* Used by net.c */
+char  *source_policy;		/* Used by net.c */
+char  *route_file;		/* Used by net.c */
+int    connect_timeout;		/* Used by net.c */
+char  *tunnel_addr;		/* Used by net.c */
+char  *tunnel_listen;		/* Used by net.c */
+char  *hosts_file;		/* Used by hosts.c */
 
 #ifdef HAVE___PROGNAME
 extern char *__progname;
@@ -59,6 +79,7 @@ cleanup_t *cleanup, *cleanup_exit;
 
 void        sigchld_cb(int, short, void *);
 void        sighup_cb(int, short, void *);
+void        sigusr1_cb(int, short, void *);
 void        gensig_cb(int, short, void *);
 void        signal_setup(void);
 static void unlink_pidfile_cb(void *);
@@ -66,10 +87,11 @@ static void unlink_pidfile_cb(void *);
 int
 main(int argc, char **argv)
 {
-	int opt, foreground, verbose, use_syslog, support;
+	int opt, foreground, verbose, use_syslog, support, options;
 	static int servsock;
 	char *bind_ifip, *connect_ifip, *pidfilenam, *allow_hosts, *deny_hosts,
-	    *mirror_addr, *bind_port;
+	    *mirror_addr, *chain_addr, *bind_port, *transparent, *allow_dests,
+	    *deny_dests, *proxy_from;
 	struct stat sb;
 
 	__progname = get_progname(argv[0]);
@@ -78,15 +100,18 @@ main(int argc, char **argv)
 	xargc = argc;
 
 	/* Defaults */
-	support = NET_SUPPORT_SOCKS4 | NET_SUPPORT_SOCKS5;
+	support = NET_SUPPORT_SOCKS4 | NET_SUPPORT_SOCKS5 | NET_SUPPORT_HTTP;
+	options = 0;
 	conf_path = SYSCONFDIR "/nylon.conf";
 	use_syslog = noresolve = verbose = verbose_dump = foreground = 0;
+	bind_timeout = 120;
 	pidfilenam = "/var/run/nylon.pid";
-	bind_port = mirror_addr = connect_ifip = bind_ifip = NULL;
+	bind_port = mirror_addr = chain_addr = connect_ifip = bind_ifip = NULL;
+	transparent = allow_dests = deny_dests = proxy_from = NULL;
 	allow_hosts = "127.0.0.1";
 	deny_hosts = "";
 
-#define GETOPT_STR "hvVfsn45p:i:I:P:c:m:a:d:"
+#define GETOPT_STR "hvVfsn45Hp:i:I:P:c:m:u:t:a:d:"
 	while ((opt = getopt(argc, argv, GETOPT_STR)) != -1)
 		if (opt == 'c')
 			conf_path = optarg;
@@ -102,10 +127,85 @@ main(int argc, char **argv)
 		CONF_SAVE(connect_ifip, conf_get_str("Server", "Connecting-Interface"));
 		CONF_SAVE(allow_hosts, conf_get_str("Server", "Allow-IP"));
 		CONF_SAVE(deny_hosts, conf_get_str("Server", "Deny-IP"));
+		CONF_SAVE(allow_dests, conf_get_str("Server",
+		    "Allow-Destination"));
+		CONF_SAVE(deny_dests, conf_get_str("Server",
+		    "Deny-Destination"));
 		CONF_SAVE(mirror_addr, conf_get_str("Server", "Mirror-Address"));
+		CONF_SAVE(mirror_policy, conf_get_str("Server", "Mirror-Policy"));
+		CONF_SAVE(source_policy, conf_get_str("Server",
+		    "Connecting-Policy"));
+		CONF_SAVE(route_file, conf_get_str("Server", "Route-File"));
+		CONF_SAVE(chain_addr, conf_get_str("Server", "Chain-Address"));
+		CONF_SAVE(transparent, conf_get_str("Server", "Transparent"));
+		CONF_SAVE(tunnel_addr, conf_get_str("Server", "Tunnel-Address"));
+		CONF_SAVE(tunnel_listen, conf_get_str("Server", "Tunnel-Listen"));
+		CONF_SAVE(auth_file, conf_get_str("Server", "Auth-File"));
+		CONF_SAVE(hosts_file, conf_get_str("Server", "Hosts-File"));
+		CONF_SAVE(stats_listen, conf_get_str("Server", "Stats-Listen"));
+		CONF_SAVE(metrics_listen, conf_get_str("Server",
+		    "Metrics-Listen"));
 		CONF_SAVE(pidfilenam, conf_get_str("General", "PIDFile"));
+		bind_timeout = conf_get_num("Server", "Bind-Timeout",
+		    bind_timeout);
+		connect_timeout = conf_get_num("Server", "Connect-Timeout", 0);
+		auth_cache_time = conf_get_num("Server", "Auth-Cache-Time",
+		    auth_cache_time);
+		breaker_failures = conf_get_num("Server", "Breaker-Failures",
+		    breaker_failures);
+		breaker_time = conf_get_num("Server", "Breaker-Time",
+		    breaker_time);
+		mirror_health.interval = conf_get_num("Server",
+		    "Mirror-Check-Interval", mirror_health.interval);
+		mirror_health.timeout = conf_get_num("Server",
+		    "Mirror-Check-Timeout", mirror_health.timeout);
+		mirror_health.rise = conf_get_num("Server",
+		    "Mirror-Check-Rise", mirror_health.rise);
+		mirror_health.fall = conf_get_num("Server",
+		    "Mirror-Check-Fall", mirror_health.fall);
+		mirror_health.eject_errors = conf_get_num("Server",
+		    "Mirror-Eject-Errors", mirror_health.eject_errors);
+		mirror_health.eject_time = conf_get_num("Server",
+		    "Mirror-Eject-Time", mirror_health.eject_time);
+		mirror_pool_size = conf_get_num("Server",
+		    "Mirror-Pool-Size", mirror_pool_size);
+		mirror_pool_idle = conf_get_num("Server",
+		    "Mirror-Pool-Idle", mirror_pool_idle);
+		chain_check_interval = conf_get_num("Server",
+		    "Chain-Check-Interval", chain_check_interval);
+		tunnel_conns = conf_get_num("Server", "Tunnel-Connections",
+		    tunnel_conns);
+		if (!conf_get_num("Server", "HTTP-Connect", 1))
+			CLR(support, NET_SUPPORT_HTTP);
+		if (conf_get_num("Server", "Proxy-Protocol", 0))
+			SET(options, NET_OPT_PROXYHDR);
+		CONF_SAVE(proxy_from, conf_get_str("Server",
+		    "Proxy-Protocol-From"));
+		if (conf_get_num("Server", "Mirror-Proxy-Protocol", 0))
+			SET(options, NET_OPT_MIRROR_PROXYHDR);
+		if (conf_get_num("Server", "Fast-Open", 0))
+			SET(options, NET_OPT_FASTOPEN);
+		if (conf_get_num("Server", "Connecting-Fast-Open", 0))
+			SET(options, NET_OPT_FASTOPEN_CONNECT);
 		verbose = conf_get_num("General", "Verbose", 0);
 		use_syslog = conf_get_num("General", "Syslog", 0);
+		CONF_SAVE(print_file, conf_get_str("General", "Log-File"));
+		print_rate = conf_get_num("General", "Log-Rate", 0);
+		CONF_SAVE(accesslog_file, conf_get_str("General",
+		    "Access-Log"));
+		CONF_SAVE(accesslog_format, conf_get_str("General",
+		    "Access-Log-Format"));
+		accesslog_size = conf_get_num("General", "Access-Log-Size", 0);
+		CONF_SAVE(capture_file, conf_get_str("General",
+		    "Capture-File"));
+		CONF_SAVE(capture_filter, conf_get_str("General",
+		    "Capture-Filter"));
+		capture_sample = conf_get_num("General", "Capture-Sample", 0);
+		capture_bytes = conf_get_num("General", "Capture-Bytes",
+		    capture_bytes);
+		capture_buffer = conf_get_num("General", "Capture-Buffer",
+		    capture_buffer);
+		verbose_dump = conf_get_num("General", "Verbose-Dump", 0);
 	}
 
 	while ((opt = getopt(argc, argv, GETOPT_STR)) != -1)
@@ -138,6 +238,12 @@ main(int argc, char **argv)
 		case 'm':
 			mirror_addr = optarg;
 			break;
+		case 'u':
+			chain_addr = optarg;
+			break;
+		case 't':
+			transparent = optarg;
+			break;
 		case 'p':
 			bind_port = optarg;
 			break;
@@ -156,12 +262,25 @@ main(int argc, char **argv)
 		case '5':
 			CLR(support, NET_SUPPORT_SOCKS5);
 			break;
+		case 'H':
+			CLR(support, NET_SUPPORT_HTTP);
+			break;
 		default:
 			usage();
 			/* NOTREACHED */
 		}
 #undef GETOPT_STR
 
+	if (transparent != NULL) {
+		if (strcmp(transparent, "redirect") == 0)
+			SET(options, NET_OPT_REDIRECT);
+		else if (strcmp(transparent, "tproxy") == 0)
+			SET(options, NET_OPT_TPROXY);
+		else
+			errxv(0, 1, "Unknown transparent mode: %s",
+			    transparent);
+	}
+
 	if (bind_port == NULL && mirror_addr == NULL)
 		bind_port = "1080";
 
@@ -181,9 +300,27 @@ main(int argc, char **argv)
 	if ((cleanup = cleanup_new()) == NULL)
 		errxv(0, 1, "Failed setting up cleanup functionality");
 	print_setup(verbose, use_syslog);
+	if (accesslog_file != NULL)
+		accesslog_setup();
+	if (capture_file != NULL || verbose_dump)
+		capture_setup();
+	if (stats_listen != NULL || metrics_listen != NULL)
+		stats_setup();
+	if (metrics_listen != NULL)
+		metrics_setup();
 	servsock = net_setup(bind_ifip, connect_ifip, bind_port, mirror_addr,
-	    NULL, support);
+	    chain_addr, support, options);
 	access_setup(allow_hosts, deny_hosts);
+	access_dest_setup(allow_dests, deny_dests);
+	if (ISSET(options, NET_OPT_PROXYHDR)) {
+		if (proxy_from == NULL)
+			errxv(0, 1, "Proxy-Protocol needs Proxy-Protocol-From");
+		access_proxy_setup(proxy_from);
+	}
+	if (hosts_file != NULL)
+		hosts_setup();
+	if (breaker_failures > 0)
+		breaker_setup();
 	signal_setup();
 
 	signal_set(&sighupev, SIGHUP, sighup_cb, &servsock);
@@ -192,6 +329,9 @@ main(int argc, char **argv)
 	signal_set(&sigchldev, SIGCHLD, sigchld_cb, NULL);
 	if (signal_add(&sigchldev, NULL) == -1)
 		errv(0, 1, "signal_add()");
+	signal_set(&sigusr1ev, SIGUSR1, sigusr1_cb, NULL);
+	if (signal_add(&sigusr1ev, NULL) == -1)
+		errv(0, 1, "signal_add()");
 
 	/* By now, we might have a new PID, so we store our pidfile */
 	if (stat(pidfilenam, &sb) != -1 && errno == ENOENT) {
@@ -261,6 +401,12 @@ sighup_cb(int sig, short ev, void *data)
 	errv(0, 1, "Restart FAILED");
 }
 
+void
+sigusr1_cb(int sig, short ev, void *data)
+{
+	net_report();
+}
+
 void
 sigchld_cb(int sig, short ev, void *data)
 {
@@ -269,7 +415,11 @@ sigchld_cb(int sig, short ev, void *data)
 
 	/* The Grim Children Reaper */
 	while ((pid = waitpid(-1, &status, WNOHANG)) > 0 ||
-	    (pid < 0 && errno == EINTR));
+	    (pid < 0 && errno == EINTR))
+		if (pid > 0) {
+			mirror_reap(pid, status);
+			stats_reap(pid);
+		}
 }
 
 static void
@@ -284,8 +434,8 @@ void
 usage(void)
 {
 	fprintf(stderr,
-	    "Usage: %s [-hvVfds] [-p <port>] [-i <if/ip>] [-I <if/ip>] "
-	    "[-P <file>] [-m <addr>] [-c <file>]\n"
+	    "Usage: %s [-hvVfds] [-p <port>] [-i <if/ip>] [-I <list>] "
+	    "[-P <file>] [-m <addr>] [-u <addr>] [-t <mode>] [-c <file>]\n"
 	    "\t-h         Help (this)\n"
 	    "\t-v         Increase verbosity level\n"
 	    "\t-V         Print %s version\n"
@@ -294,10 +444,12 @@ usage(void)
 	    "\t-n         Do not resolve IP addresses\n"
 	    "\t-a <list>  Set IP allow list to <list>\n"
 	    "\t-d <list>  Set IP deny list to <list>\n"
-	    "\t-m <addr>  Mirror address/port pair <addr> in the format \"address:port\"\n"
+	    "\t-m <list>  Mirror address/port pairs <list> in the format \"address:port\"\n"
+	    "\t-u <list>  Connect through upstream SOCKS5 proxies <list>\n"
+	    "\t-t <mode>  Transparent proxy for \"redirect\" or \"tproxy\" rules\n"
 	    "\t-p <port>  Bind to <port> instead of the default 1080\n"
 	    "\t-i <if/ip> Bind to interface or IP address <if/ip>\n"
-	    "\t-I <if/ip> Make outgoing connections on interface or IP address <if/ip>\n"
+	    "\t-I <list>  Make outgoing connections on interfaces or IP addresses <list>\n"
 	    "\t-P <file>  Use PID file <file>\n"
 	    "\t-c <file>  Use configuration file <file>\n",
 	    __progname, __progname, __progname);
@@ -20,12 +20,17 @@
  */
 
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <syslog.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 
 #include <unistd.h>
 #include <sys/ioctl.h>
@@ -34,10 +39,59 @@
 #include "config.h"
 #endif /* HAVE_CONFIG_H */
 
-static void vprint(const char *, va_list);
-static void vprintx(const char *, va_list);
+#include "print.h"
+#include "writer.h"
+
+/*
+ * Messages are handed to a log writer process over a socket pair
+ * shared by the listening process and every child, so that a slow
+ * syslogd or disk holds up the writer and not the relays.  Each
+ * message is one datagram and goes out without blocking; when the
+ * socket's queue is full it is dropped and counted, and the count
+ * goes along with the next message that makes it.  Messages for
+ * which a process has to exit wait for room instead.
+ */
+
+#define PRINT_MSGSZ 1024
+#define PRINT_QUEUE (256 * 1024)	/* Bytes queued for the writer */
+#define PRINT_BATCH 64		/* Messages written out at once */
+#define PRINT_LINESZ (PRINT_MSGSZ + 512)
+
+struct print_msg {
+	pid_t pid;
+	u_int dropped;		/* Before this one, queue full */
+	u_int limited;		/* Before this one, over the rate */
+	char  text[PRINT_MSGSZ];
+};
+
+static void vprint(int, const char *, va_list);
+static void vprintx(int, const char *, va_list);
+static void print_send(int, const char *);
+static size_t print_format(struct print_msg *, size_t, char *, size_t);
+static void print_out(struct print_msg *, size_t);
+static void print_writer(int);
+static void print_put(u_char *, size_t);
+static void print_flush(void);
+
+char *print_file;		/* Log to this file instead */
+int   print_rate;		/* Messages per second per process; 0 any */
 
 static int verbose, use_syslog;
+static int print_fd = -1;	/* print_file */
+static int print_sock = -1;	/* To the writer */
+
+/* In the writer */
+static char   print_buf[PRINT_BATCH * PRINT_LINESZ];
+static size_t print_off;
+
+/* Per process, so reset in new children */
+static struct {
+	pid_t  pid;
+	u_int  dropped;
+	u_int  limited;
+	time_t sec;
+	int    count;
+} print_q;
 
 extern char *__progname;
 
@@ -47,8 +101,19 @@ print_setup(int _verbose, int _use_syslog)
 	verbose = _verbose;
 	use_syslog = _use_syslog;
 
+	if (print_file != NULL) {
+		if ((print_fd = open(print_file,
+			 O_WRONLY | O_APPEND | O_CREAT, 0640)) == -1)
+			errv(0, 1, "open(): %s", print_file);
+		/* A restart on SIGHUP opens it again */
+		fcntl(print_fd, F_SETFD, FD_CLOEXEC);
+		use_syslog = 0;
+	}
+
 	if (use_syslog)
 		openlog(__progname, LOG_PID, LOG_DAEMON);
+
+	print_sock = writer_spawn("the log", PRINT_QUEUE, print_writer);
 }
 
 /*
@@ -64,7 +129,7 @@ errv(int level, int eval, const char *fmt, ...)
 		exit(eval);
 
 	va_start(ap, fmt);
-	vprint(fmt, ap);
+	vprint(1, fmt, ap);
 	va_end(ap);
 	exit(eval);
 }
@@ -78,7 +143,7 @@ errxv(int level, int eval, const char *fmt, ...)
 		exit(eval);
 
 	va_start(ap, fmt);
-	vprintx(fmt, ap);
+	vprintx(1, fmt, ap);
 	va_end(ap);
 	exit(eval);
 }
@@ -92,7 +157,7 @@ warnv(int level, const char *fmt, ...)
 		return;
 
 	va_start(ap, fmt);
-	vprint(fmt, ap);
+	vprint(0, fmt, ap);
 	va_end(ap);
 }
 
@@ -105,44 +170,187 @@ warnxv(int level, const char *fmt, ...)
 		return;
 
 	va_start(ap, fmt);
-	vprintx(fmt, ap);
+	vprintx(0, fmt, ap);
 	va_end(ap);
 }
 
 static void
-vprint(const char *fmt, va_list ap)
+vprint(int fatal, const char *fmt, va_list ap)
 {
-	if (use_syslog) {
-		char msg[1024];
-		if (fmt != NULL) {
-			msg[0] = '\0';
-			vsnprintf(msg, sizeof(msg), fmt, ap);
-			strlcat(msg, ": ", sizeof(msg));
-			strlcat(msg, strerror(errno), sizeof(msg));
-			syslog(LOG_INFO, "%s", msg);
+	char msg[PRINT_MSGSZ];
+	int serrno = errno;
+
+	if (fmt == NULL)
+		return;
+
+	msg[0] = '\0';
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	strlcat(msg, ": ", sizeof(msg));
+	strlcat(msg, strerror(serrno), sizeof(msg));
+	print_send(fatal, msg);
+	errno = serrno;
+}
+
+static void
+vprintx(int fatal, const char *fmt, va_list ap)
+{
+	char msg[PRINT_MSGSZ];
+	int serrno = errno;
+
+	if (fmt == NULL)
+		return;
+
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	print_send(fatal, msg);
+	errno = serrno;
+}
+
+/*
+ * Queue a message for the writer, or write it out here if there is
+ * no writer.
+ */
+static void
+print_send(int fatal, const char *text)
+{
+	struct print_msg pm;
+	time_t now;
+	size_t len;
+	ssize_t ret;
+
+	pm.pid = getpid();
+	if (print_q.pid != pm.pid) {
+		memset(&print_q, 0, sizeof(print_q));
+		print_q.pid = pm.pid;
+	}
+
+	/* Against log storms */
+	if (print_rate > 0 && !fatal) {
+		now = time(NULL);
+		if (now != print_q.sec) {
+			print_q.sec = now;
+			print_q.count = 0;
+		}
+		if (++print_q.count > print_rate) {
+			print_q.limited++;
+			return;
 		}
+	}
+
+	pm.dropped = print_q.dropped;
+	pm.limited = print_q.limited;
+	len = strlcpy(pm.text, text, sizeof(pm.text));
+	if (len >= sizeof(pm.text))
+		len = sizeof(pm.text) - 1;
+	len += offsetof(struct print_msg, text) + 1;
+
+	if (print_sock == -1) {
+		print_out(&pm, len);
+		print_q.dropped = print_q.limited = 0;
 		return;
 	}
 
-	fprintf(stderr, "%s: ", __progname);
-        if (fmt != NULL)
-                vfprintf(stderr, fmt, ap);
-        fprintf(stderr, ": %s\n", strerror(errno));
+	do
+		ret = send(print_sock, &pm, len,
+		    MSG_NOSIGNAL | (fatal ? 0 : MSG_DONTWAIT));
+	while (ret == -1 && errno == EINTR);
+
+	if (ret != -1) {
+		print_q.dropped = print_q.limited = 0;
+	} else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+		print_q.dropped++;
+	} else {
+		/* The writer is gone */
+		close(print_sock);
+		print_sock = -1;
+		print_out(&pm, len);
+		print_q.dropped = print_q.limited = 0;
+	}
 }
 
-static void
-vprintx(const char *fmt, va_list ap)
+/*
+ * Write out a message, to syslog or as a line into buf; returns the
+ * length of the line.
+ */
+static size_t
+print_format(struct print_msg *pm, size_t len, char *buf, size_t size)
 {
+	char ident[64], stamp[32];
+	time_t now;
+	size_t n = 0;
+
+	if (len <= offsetof(struct print_msg, text))
+		return (0);
+	pm->text[len - offsetof(struct print_msg, text) - 1] = '\0';
+
 	if (use_syslog) {
-		if (fmt != NULL)
-			vsyslog(LOG_INFO, fmt, ap);
-		return;
+		/* Under the pid of the process that sent it */
+		snprintf(ident, sizeof(ident), "%s[%d]", __progname,
+		    (int)pm->pid);
+		openlog(ident, 0, LOG_DAEMON);
+		if (pm->dropped > 0)
+			syslog(LOG_INFO, "%u messages dropped", pm->dropped);
+		if (pm->limited > 0)
+			syslog(LOG_INFO, "%u messages over the rate limit",
+			    pm->limited);
+		syslog(LOG_INFO, "%s", pm->text);
+		return (0);
 	}
 
-	fprintf(stderr, "%s: ", __progname);
-        if (fmt != NULL)
-                vfprintf(stderr, fmt, ap);
-        fprintf(stderr, "\n");
+	if (print_fd != -1) {
+		now = time(NULL);
+		strftime(stamp, sizeof(stamp), "%b %e %H:%M:%S",
+		    localtime(&now));
+		snprintf(ident, sizeof(ident), "%s %s[%d]", stamp, __progname,
+		    (int)pm->pid);
+	} else
+		strlcpy(ident, __progname, sizeof(ident));
+
+	if (pm->dropped > 0)
+		n += snprintf(buf + n, size - n, "%s: %u messages dropped\n",
+		    ident, pm->dropped);
+	if (pm->limited > 0)
+		n += snprintf(buf + n, size - n,
+		    "%s: %u messages over the rate limit\n", ident, pm->limited);
+	n += snprintf(buf + n, size - n, "%s: %s\n", ident, pm->text);
+
+	return (n < size ? n : size - 1);
+}
+
+static void
+print_out(struct print_msg *pm, size_t len)
+{
+	char line[PRINT_LINESZ];
+	size_t n;
+
+	if ((n = print_format(pm, len, line, sizeof(line))) > 0)
+		write(print_fd != -1 ? print_fd : STDERR_FILENO, line, n);
+}
+
+/*
+ * The log writer: takes messages off the queue as they come, a batch
+ * at a time.
+ */
+static void
+print_writer(int sock)
+{
+	writer_loop(sock, sizeof(struct print_msg), PRINT_BATCH, print_put,
+	    print_flush);
+}
+
+static void
+print_put(u_char *msg, size_t len)
+{
+	print_off += print_format((struct print_msg *)msg, len,
+	    print_buf + print_off, sizeof(print_buf) - print_off);
+}
+
+static void
+print_flush(void)
+{
+	if (print_off > 0)
+		write(print_fd != -1 ? print_fd : STDERR_FILENO, print_buf,
+		    print_off);
+	print_off = 0;
 }
 
 /*
@@ -0,0 +1,172 @@
+/*
+ * proxyhdr.c
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "net.h"
+#include "proxyhdr.h"
+
+/*
+ * The PROXY protocol header a load balancer puts in front of the
+ * connection, telling who actually connected.  Both versions are
+ * parsed straight from the negotiation buffer.
+ */
+
+static const u_char proxyhdr_sig[12] = {
+	0x0d, 0x0a, 0x0d, 0x0a, 0x00, 0x0d, 0x0a, 0x51,
+	0x55, 0x49, 0x54, 0x0a
+};
+
+static int proxyhdr_v1(const u_char *, size_t, struct sockaddr_in *,
+               struct sockaddr_in *);
+static int proxyhdr_field(const char **, const char *, char *, size_t);
+
+/*
+ * Returns the length of the header, NET_PARSE_MORE or NET_PARSE_FAIL.
+ * src and dst get family AF_INET only when the header carries IPv4
+ * addresses; for LOCAL and unknown or IPv6 connections the caller
+ * keeps the addresses of the connection itself.
+ */
+int
+proxyhdr_parse(const u_char *buf, size_t len, struct sockaddr_in *src,
+    struct sockaddr_in *dst)
+{
+	size_t hlen;
+
+	memset(src, 0, sizeof(*src));
+	memset(dst, 0, sizeof(*dst));
+
+	if (len >= 1 && buf[0] == 'P')
+		return (proxyhdr_v1(buf, len, src, dst));
+
+	if (len < 16)
+		return (memcmp(buf, proxyhdr_sig,
+		    MIN(len, sizeof(proxyhdr_sig))) == 0 ?
+		    NET_PARSE_MORE : NET_PARSE_FAIL);
+	if (memcmp(buf, proxyhdr_sig, sizeof(proxyhdr_sig)) != 0 ||
+	    (buf[12] & 0xf0) != 0x20)
+		return (NET_PARSE_FAIL);
+
+	hlen = 16 + ((buf[14] << 8) | buf[15]);
+	if (len < hlen)
+		return (NET_PARSE_MORE);
+
+	/* PROXY command, TCP over IPv4 */
+	if ((buf[12] & 0x0f) == 0x01 && buf[13] == 0x11) {
+		if (hlen < 16 + 12)
+			return (NET_PARSE_FAIL);
+		src->sin_family = dst->sin_family = AF_INET;
+		memcpy(&src->sin_addr, buf + 16, 4);
+		memcpy(&dst->sin_addr, buf + 20, 4);
+		memcpy(&src->sin_port, buf + 24, 2);
+		memcpy(&dst->sin_port, buf + 26, 2);
+	}
+
+	return (hlen);
+}
+
+/*
+ * "PROXY TCP4 <src> <dst> <sport> <dport>\r\n"
+ */
+static int
+proxyhdr_v1(const u_char *buf, size_t len, struct sockaddr_in *src,
+    struct sockaddr_in *dst)
+{
+	const char *p = (const char *)buf, *end;
+	char field[16];
+	long sport, dport;
+
+	if (memcmp(p, "PROXY ", MIN(len, 6)) != 0)
+		return (NET_PARSE_FAIL);
+
+	if ((end = memchr(p, '\n', MIN(len, PROXYHDR_V1_MAX))) == NULL)
+		return (len < PROXYHDR_V1_MAX ? NET_PARSE_MORE : NET_PARSE_FAIL);
+	if (end - p < 7 || end[-1] != '\r')
+		return (NET_PARSE_FAIL);
+
+	p += 6;
+	if (end - p >= 7 && memcmp(p, "UNKNOWN", 7) == 0)
+		return (end + 1 - (const char *)buf);
+
+	if (proxyhdr_field(&p, end, field, sizeof(field)) == -1)
+		return (NET_PARSE_FAIL);
+	if (strcmp(field, "TCP6") == 0)
+		return (end + 1 - (const char *)buf);
+	if (strcmp(field, "TCP4") != 0)
+		return (NET_PARSE_FAIL);
+
+	if (proxyhdr_field(&p, end, field, sizeof(field)) == -1 ||
+	    inet_aton(field, &src->sin_addr) == 0 ||
+	    proxyhdr_field(&p, end, field, sizeof(field)) == -1 ||
+	    inet_aton(field, &dst->sin_addr) == 0 ||
+	    proxyhdr_field(&p, end, field, sizeof(field)) == -1 ||
+	    (sport = strtol(field, NULL, 10)) <= 0 || sport > 65535 ||
+	    proxyhdr_field(&p, end, field, sizeof(field)) == -1 ||
+	    (dport = strtol(field, NULL, 10)) <= 0 || dport > 65535)
+		return (NET_PARSE_FAIL);
+
+	src->sin_family = dst->sin_family = AF_INET;
+	src->sin_port = htons(sport);
+	dst->sin_port = htons(dport);
+
+	return (end + 1 - (const char *)buf);
+}
+
+/* Copy the next space or CRLF terminated field */
+static int
+proxyhdr_field(const char **pp, const char *end, char *field, size_t size)
+{
+	const char *p = *pp;
+	size_t n = 0;
+
+	while (p < end && *p != ' ' && *p != '\r') {
+		if (n == size - 1)
+			return (-1);
+		field[n++] = *p++;
+	}
+	if (n == 0)
+		return (-1);
+	field[n] = '\0';
+
+	if (p < end && *p == ' ')
+		p++;
+	*pp = p;
+
+	return (0);
+}
+
+/*
+ * Write a v2 header for a TCP over IPv4 connection from src to dst
+ * into buf, which holds PROXYHDR_V2_LEN bytes.
+ */
+int
+proxyhdr_v2(u_char *buf, struct sockaddr_in *src, struct sockaddr_in *dst)
+{
+	memcpy(buf, proxyhdr_sig, sizeof(proxyhdr_sig));
+	buf[12] = 0x21;		/* Version 2, PROXY */
+	buf[13] = 0x11;		/* TCP over IPv4 */
+	buf[14] = 0;
+	buf[15] = 12;
+	memcpy(buf + 16, &src->sin_addr, 4);
+	memcpy(buf + 20, &dst->sin_addr, 4);
+	memcpy(buf + 24, &src->sin_port, 2);
+	memcpy(buf + 26, &dst->sin_port, 2);
+
+	return (PROXYHDR_V2_LEN);
+}
@@ -6,6 +6,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/queue.h>
 #include <sys/socket.h>
 
 #include <netinet/in.h>
@@ -23,6 +24,7 @@
 #endif /* HAVE_CONFIG_H */
 
 #include "atomicio.h"
+#include "hosts.h"
 #include "print.h"
 #include "net.h"
 #include "socks4.h"
@@ -41,124 +43,120 @@ struct socks4_hdr {
 	u_int32_t destaddr;
 };
 
-static int _socks4_tryconnect(int, struct sockaddr_in *,
-    struct socks4_hdr *, struct conndesc *);
-
-static int _getstr(int sock, char *buf, int len) {
-	u_char byte;
-	int pos;
-
-	for (pos = 0; pos < len; pos++) {
-		if (atomicio(read, sock, &byte, 1) != 1)
-			return -1;
-
-		buf[pos] = byte;
-
-		if (byte == 0)
-			return pos;
-	}
+struct socks4_req {
+	struct socks4_hdr hdr;
+	int               fqdn;		/* SOCKS4A or tor-resolve */
+	char              hostname[256];
+};
 
-	return -1;
-}
+static int socks4_parse(const u_char *, size_t, void *);
+static int _socks4_tryconnect(struct negdesc *, struct sockaddr_in *,
+    struct socks4_hdr *, struct conndesc *);
 
 int
-socks4_negotiate(int clisock, struct conndesc *conn)
+socks4_negotiate(struct negdesc *nd, struct conndesc *conn)
 {
-	u_char data, *addr;
-	char hostname[256];
-	int ret;
-	struct socks4_hdr hdr4;
+	struct socks4_req req4;
 	struct sockaddr_in rem_in;
-	struct hostent *hent;
-
-	/* This is already implied ... */
-	hdr4.vn = 4;
-
-	ret = -1;
 
-	/* Get the seven first bytes after version, until USERID */
-	if (atomicio(read, clisock, &hdr4.cd, 7) != 7)
+	if (net_negparse(nd, socks4_parse, &req4) == -1)
 		return (-1);
 
-	switch (hdr4.cd) {
+	switch (req4.hdr.cd) {
 	case SOCKS4_CD_CONNECT:
 	case SOCKS4_CD_RESOLVE:
 		/* We can only do connect & resolve. */
 		break;
 	default:
 		warnxv(0, "Client attempted unsupported SOCKS4 command %d",
-		    hdr4.cd);
+		    req4.hdr.cd);
 		return (-1);
 	};
 
-	/* Eat the username; it is not used */
-	while ((ret = atomicio(read, clisock, &data, 1)) == 1 && data != 0);
-
-	if (ret != 1)
-		return (-1);
-
 	memset(&rem_in, 0, sizeof(rem_in));
 	rem_in.sin_family = AF_INET;
-	rem_in.sin_port = hdr4.destport;
+	rem_in.sin_port = req4.hdr.destport;
 
-    	addr = (unsigned char *)&hdr4.destaddr;
-    	/* SOCKS4A or tor-resolve? */
- 	if ((addr[0] == 0 && addr[1] == 0 && addr[2] == 0 && addr[3] != 0)
-	    || (hdr4.cd == SOCKS4_CD_RESOLVE && hdr4.destport == 0)) {
-		if (_getstr(clisock, hostname, sizeof(hostname)) < 0)
-			return (-1);
-
-		if ((hent = gethostbyname(hostname)) == NULL) {
-			hdr4.cd = SOCKS4_CD_REJECT;
+	if (req4.fqdn) {
+		strlcpy(nd->rem_host, req4.hostname, sizeof(nd->rem_host));
+		if (hosts_resolve(req4.hostname, &rem_in.sin_addr) == -1) {
+			req4.hdr.cd = SOCKS4_CD_REJECT;
 		} else {
-			rem_in.sin_addr = *(struct in_addr *)hent->h_addr;
 			/*
 			 * Send back the resolved address as well, for
 			 * tor-resolve.
 			 */
-			hdr4.destaddr = rem_in.sin_addr.s_addr;
+			req4.hdr.destaddr = rem_in.sin_addr.s_addr;
 		}
 	} else {
-		rem_in.sin_addr.s_addr = hdr4.destaddr;
+		rem_in.sin_addr.s_addr = req4.hdr.destaddr;
 	}
 
- 	return (_socks4_tryconnect(clisock, &rem_in, &hdr4, conn));
+ 	return (_socks4_tryconnect(nd, &rem_in, &req4.hdr, conn));
+}
+
+/*
+ * Parse VN CD DSTPORT DSTIP USERID NUL, followed by HOSTNAME NUL for
+ * SOCKS4A and tor-resolve requests.
+ */
+static int
+socks4_parse(const u_char *buf, size_t len, void *arg)
+{
+	struct socks4_req *req = arg;
+	const u_char *addr, *p, *end;
+	size_t left;
+
+	if (len < 8)
+		return (NET_PARSE_MORE);
+
+	req->hdr.vn = buf[0];
+	req->hdr.cd = buf[1];
+	memcpy(&req->hdr.destport, buf + 2, sizeof(req->hdr.destport));
+	memcpy(&req->hdr.destaddr, buf + 4, sizeof(req->hdr.destaddr));
+	req->hostname[0] = '\0';
+
+	/* Skip the username; it is not used */
+	left = len - 8;
+	if ((end = memchr(buf + 8, '\0', left)) == NULL)
+		return (left > SOCKS4_MAX_USERID ?
+		    NET_PARSE_FAIL : NET_PARSE_MORE);
+	if (end - (buf + 8) > SOCKS4_MAX_USERID)
+		return (NET_PARSE_FAIL);
+	p = end + 1;
+
+	addr = (const u_char *)&req->hdr.destaddr;
+	req->fqdn = (addr[0] == 0 && addr[1] == 0 && addr[2] == 0 &&
+	    addr[3] != 0) ||
+	    (req->hdr.cd == SOCKS4_CD_RESOLVE && req->hdr.destport == 0);
+	if (!req->fqdn)
+		return (p - buf);
+
+	left = len - (p - buf);
+	if ((end = memchr(p, '\0', left)) == NULL)
+		return (left >= sizeof(req->hostname) ?
+		    NET_PARSE_FAIL : NET_PARSE_MORE);
+	if (end - p >= sizeof(req->hostname))
+		return (NET_PARSE_FAIL);
+	memcpy(req->hostname, p, end - p + 1);
+
+	return (end + 1 - buf);
 }
 
 static int
-_socks4_tryconnect(int clisock, struct sockaddr_in *rem_in,
+_socks4_tryconnect(struct negdesc *nd, struct sockaddr_in *rem_in,
     struct socks4_hdr *hdr4, struct conndesc *conn)
 {
-	struct addrinfo *ai;
 	int ret, sock = -1;
 
 	if (hdr4->cd != SOCKS4_CD_CONNECT)
 		goto fail_reply;
 
-	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-		return (-1);
-
-	if ((ai = conn->bind_ai) != NULL) {
-        if (conn->bind_if_name != NULL) {
-            if (setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, conn->bind_if_name, IFNAMSIZ-1) == -1) {
-                warnv(0, "bind device()");
-                return (-1);
-            }
-        }
-
-		if (bind(sock, ai->ai_addr, ai->ai_addrlen) == -1) {
-			warnv(0, "bind()");
-			return (-1);
-		}
-	}
-
-	if (connect(sock, (struct sockaddr *)rem_in,
-		sizeof(*rem_in)) == -1) {
-		warnv(0, "connect()");
+	/* Any data the client pipelined goes out with the connect */
+	if ((sock = net_connect(conn, (struct sockaddr *)rem_in,
+		 sizeof(*rem_in), nd)) == -1)
 		hdr4->cd = SOCKS4_CD_REJECT;
-	} else {
+	else
 		hdr4->cd = SOCKS4_CD_GRANT;
-	}
 
 fail_reply:
 	hdr4->vn = 0;
@@ -176,10 +174,10 @@ fail_reply:
 		ret = sock;
 	}
 
-	if (atomicio(write, clisock, hdr4, sizeof(*hdr4)) != sizeof(*hdr4))
+	if (atomicio(write, nd->sock, hdr4, sizeof(*hdr4)) != sizeof(*hdr4))
 		ret = NET_FAIL;
 
-	if (ret < 0)
+	if (ret < 0 && sock != -1)
 		close(sock);
 
 	/*
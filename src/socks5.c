@@ -7,25 +7,34 @@
  */
 
 #include <sys/types.h>
+#include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <net/if.h>
+#include <event.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif /* HAVE_CONFIG_H */
 
 #include "atomicio.h"
+#include "auth.h"
+#include "hosts.h"
 #include "print.h"
 #include "net.h"
+#include "udp.h"
+#include "stats.h"
 
 #define SOCKS5_ATYP_IPV4      1
 #define SOCKS5_ATYP_FQDN      3
@@ -33,6 +42,13 @@
 #define SOCKS5_CD_BIND        2
 #define SOCKS5_CD_UDP_ASSOC   3
 
+#define SOCKS5_METHOD_NOAUTH   0x00
+#define SOCKS5_METHOD_USERPASS 0x02
+#define SOCKS5_METHOD_NONE     0xff
+
+/* Client bytes held back until the BIND peer connects */
+#define SOCKS5_BIND_EARLY 512
+
 /*
  * XXX proper error replies
  */
@@ -47,111 +63,120 @@ struct socks5_req {
 	u_int16_t destport;    /* Dest port */
 };
 
+/* A pending BIND, waiting for the remote peer */
+struct socks5_bindq {
+	int                 clisock;
+	int                 listensock;
+	int                 tgtsock;
+	struct sockaddr_in  tgt_in;
+	struct socks5_req  *req5;
+	struct event_base  *base;
+	struct event        ev;
+	struct event        cliev;
+	struct timeval      deadline;	/* For the peer to connect */
+	u_char              early[SOCKS5_BIND_EARLY];
+	size_t              nearly;
+};
+
 /* Version reply */
 struct socks5_v_repl {
 	u_char ver;       /* Version */
 	u_char res;       /* Response */
 };
 
-static int socks5_connect(int, struct sockaddr_in *, struct socks5_req *,
+/* Method selection message */
+struct socks5_greeting {
+	u_char nmethods;
+	u_char methods[255];
+};
+
+/* Username/password sub-negotiation (RFC 1929) */
+struct socks5_userpass {
+	char user[256];
+	char pass[256];
+};
+
+/* Parsed request */
+struct socks5_request {
+	struct socks5_req req;
+	int               fqdn;
+	char              hostname[256];
+};
+
+static int socks5_parse_greeting(const u_char *, size_t, void *);
+static int socks5_parse_userpass(const u_char *, size_t, void *);
+static int socks5_auth(struct negdesc *);
+static int socks5_parse_request(const u_char *, size_t, void *);
+static int socks5_connect(struct negdesc *, struct sockaddr_in *,
+    struct socks5_req *, struct conndesc *);
+static int socks5_bind(int, struct sockaddr_in *, struct socks5_req *,
+    struct conndesc *);
+static void socks5_bind_reply(int, short, void *);
+static void socks5_bind_accept(int, short, void *);
+static int  socks5_bind_wait(struct socks5_bindq *);
+static void socks5_bind_client(int, short, void *);
+static void socks5_bind_done(struct socks5_bindq *, int);
+static int socks5_udp_assoc(int, struct sockaddr_in *, struct socks5_req *,
     struct conndesc *);
-static int socks5_bind(int, struct sockaddr_in *, struct socks5_req *);
 
 int
-socks5_negotiate(int clisock, struct conndesc *conn)
+socks5_negotiate(struct negdesc *nd, struct conndesc *conn)
 {
-	u_int i;
-	char hostname[256];
-	u_char nmethods, len, junk;
 	struct sockaddr_in rem_in;
-	struct socks5_req req5;
+	struct socks5_greeting greet;
+	struct socks5_request request;
+	struct socks5_req *req5 = &request.req;
 	struct socks5_v_repl rep5;
-	struct hostent *hent;
-
-	req5.vn = 5;
-	req5.rsv = 0;
-
-	/*
-	 * Start by retrieving number of methods, version number has
-	 * already been consumed by the calling procedure
-	 */
 
-	if (atomicio(read, clisock, &nmethods, 1) != 1) {
-		warnv(1, "read()");
+	if (net_negparse(nd, socks5_parse_greeting, &greet) == -1)
 		return (-1);
-	}
-
-	/* Eat up methods */
-
-	i = 0;
-	while (i++ < nmethods)
-		if (atomicio(read, clisock, &junk, 1) != 1) {
-			warnv(1, "read()");
-			return (-1);
-		}
 
 	/*
-	 * We don't support any authentication methods yet, so simply
-	 * ignore it and send reply with no authentication required.
+	 * Without a credential file, no authentication is required,
+	 * whatever the client offers.
 	 */
-
 	rep5.ver = 5;
-	rep5.res = 0;
+	rep5.res = SOCKS5_METHOD_NOAUTH;
+	if (auth_file != NULL)
+		rep5.res = memchr(greet.methods, SOCKS5_METHOD_USERPASS,
+		    greet.nmethods) != NULL ?
+		    SOCKS5_METHOD_USERPASS : SOCKS5_METHOD_NONE;
 
-	if (atomicio(write, clisock, &rep5, 2) != 2) {
+	if (atomicio(write, nd->sock, &rep5, 2) != 2) {
 		warnv(1, "write()");
 		return (-1);
 	}
 
-	/* Receive data up to atyp */
-	if (atomicio(read, clisock, &req5, 4) != 4) {
-		warnv(1, "read()");
+	if (rep5.res == SOCKS5_METHOD_NONE) {
+		warnxv(1, "Client does not offer username/password "
+		    "authentication");
+		stats_cause(STATS_NEG_AUTH);
 		return (-1);
 	}
-	if (req5.vn != 5)
+	if (rep5.res == SOCKS5_METHOD_USERPASS && socks5_auth(nd) == -1)
+		return (-1);
+
+	/* The client may well have sent the request already */
+	if (net_negparse(nd, socks5_parse_request, &request) == -1)
 		return (-1);
 
 	memset(&rem_in, 0, sizeof(rem_in));
+	rem_in.sin_family = AF_INET;
 
-	switch (req5.atyp) {
-	case SOCKS5_ATYP_IPV4:
-		if (atomicio(read, clisock, &req5.destaddr, 4) != 4) {
-			warnv(1, "read()");
-			return (-1);
-		}
-		rem_in.sin_family = AF_INET;
-		rem_in.sin_addr.s_addr = req5.destaddr;
-		break;
-	case SOCKS5_ATYP_FQDN:
-		if (atomicio(read, clisock, &len, 1) != 1) {
-			warnv(1, "read()");
-			return (-1);
-		}
-		if (atomicio(read, clisock, hostname, len) != len) {
-			warnv(1, "read()");
-			return (-1);
-		}
-		hostname[len] = '\0';
-		if ((hent = gethostbyname(hostname)) == NULL) {
+	if (request.fqdn) {
+		strlcpy(nd->rem_host, request.hostname, sizeof(nd->rem_host));
+		if (hosts_resolve(request.hostname, &rem_in.sin_addr) == -1) {
 			/* XXX no hstrerror() on solaris */
 #ifndef __sun__
 			warnxv(1, "gethostbyname(): %s", hstrerror(h_errno));
 #endif /* __sun__ */
 			return (-1);
 		}
-		rem_in.sin_family = AF_INET;
-		rem_in.sin_addr = *(struct in_addr *)hent->h_addr;
-		break;
-	default:
-		return (-1);
-	}
-
-	if (atomicio(read, clisock, &req5.destport, 2) != 2) {
-		warnv(1, "read()");
-		return (-1);
+	} else {
+		rem_in.sin_addr.s_addr = req5->destaddr;
 	}
 
-	rem_in.sin_port = req5.destport;
+	rem_in.sin_port = req5->destport;
 
 	/*
 	 * Now we have a filled in in_addr for the target host:
@@ -160,114 +185,500 @@ socks5_negotiate(int clisock, struct conndesc *conn)
 	 * statement.
 	 */
 
-	switch (req5.cd) {
+	switch (req5->cd) {
 	case SOCKS5_CD_CONNECT:
-		return (socks5_connect(clisock, &rem_in, &req5, conn));
+		return (socks5_connect(nd, &rem_in, req5, conn));
 	case SOCKS5_CD_BIND:
-		return (socks5_bind(clisock, &rem_in, &req5));
+		return (socks5_bind(nd->sock, &rem_in, req5, conn));
 	case SOCKS5_CD_UDP_ASSOC:
+		return (socks5_udp_assoc(nd->sock, &rem_in, req5, conn));
 	default:
 		return (-1);
 	}
 }
 
+/*
+ * Reply code for a failed connect.
+ */
+u_char
+socks5_rep(int error)
+{
+	switch (error) {
+	case EACCES:
+		return (0x02);	/* Not allowed by ruleset */
+	case ENETUNREACH:
+		return (0x03);
+	case EHOSTUNREACH:
+		return (0x04);
+	case ECONNREFUSED:
+		return (0x05);
+	case ETIMEDOUT:
+		return (0x06);
+	default:
+		return (0x01);
+	}
+}
+
+/*
+ * And back, for replies from upstream.
+ */
+int
+socks5_errno(u_char rep)
+{
+	switch (rep) {
+	case 0x02:
+		return (EACCES);
+	case 0x03:
+		return (ENETUNREACH);
+	case 0x04:
+		return (EHOSTUNREACH);
+	case 0x05:
+		return (ECONNREFUSED);
+	case 0x06:
+		return (ETIMEDOUT);
+	default:
+		return (ECONNABORTED);
+	}
+}
+
+/*
+ * Parse VER NMETHODS METHODS.
+ */
 static int
-socks5_connect(int clisock, struct sockaddr_in *rem_in, struct socks5_req *req5,
-    struct conndesc *conn)
+socks5_parse_greeting(const u_char *buf, size_t len, void *arg)
 {
-	int remsock;
-	struct addrinfo *ai;
+	struct socks5_greeting *greet = arg;
+
+	if (len < 2)
+		return (NET_PARSE_MORE);
+	if (buf[0] != 5)
+		return (NET_PARSE_FAIL);
+	if (len < 2 + buf[1])
+		return (NET_PARSE_MORE);
+
+	greet->nmethods = buf[1];
+	memcpy(greet->methods, buf + 2, greet->nmethods);
+
+	return (2 + greet->nmethods);
+}
+
+/*
+ * Parse VER ULEN UNAME PLEN PASSWD.
+ */
+static int
+socks5_parse_userpass(const u_char *buf, size_t len, void *arg)
+{
+	struct socks5_userpass *up = arg;
+	size_t ulen, plen;
+
+	if (len < 2)
+		return (NET_PARSE_MORE);
+	if (buf[0] != 1 || buf[1] == 0)
+		return (NET_PARSE_FAIL);
+	ulen = buf[1];
+	if (len < 2 + ulen + 1)
+		return (NET_PARSE_MORE);
+	plen = buf[2 + ulen];
+	if (len < 3 + ulen + plen)
+		return (NET_PARSE_MORE);
+
+	memcpy(up->user, buf + 2, ulen);
+	up->user[ulen] = '\0';
+	memcpy(up->pass, buf + 3 + ulen, plen);
+	up->pass[plen] = '\0';
+
+	return (3 + ulen + plen);
+}
+
+static int
+socks5_auth(struct negdesc *nd)
+{
+	struct socks5_userpass up;
+	u_char rep[2];
+	int ret;
 
-	/* XXX use bind_ai for socket creation, also */
-	if ((remsock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-		warnv(0, "socket()");
+	if (net_negparse(nd, socks5_parse_userpass, &up) == -1)
+		return (-1);
+
+	ret = auth_check(up.user, up.pass);
+	memset(up.pass, 0, sizeof(up.pass));
+	/* For the access log, whether it worked or not */
+	strlcpy(nd->user, up.user, sizeof(nd->user));
+
+	rep[0] = 1;
+	rep[1] = ret == 0 ? 0 : 1;
+	if (atomicio(write, nd->sock, rep, 2) != 2) {
+		warnv(1, "write()");
 		return (-1);
 	}
 
-	if ((ai = conn->bind_ai) != NULL)
-        if (conn->bind_if_name != NULL) {
-            if (setsockopt(remsock, SOL_SOCKET, SO_BINDTODEVICE, conn->bind_if_name, IFNAMSIZ-1) == -1) {
-                warnv(0, "bind device()");
-                return (-1);
-            }
-        }
+	if (ret == -1) {
+		warnxv(1, "Authentication failed for user %s", up.user);
+		stats_cause(STATS_NEG_AUTH);
+		return (-1);
+	}
+	warnxv(2, "Authenticated user %s", up.user);
 
-		if (bind(remsock, ai->ai_addr, ai->ai_addrlen) == -1) {
-			warnv(0, "bind()");
-			return (-1);
-		}
+	return (0);
+}
 
-	if (connect(remsock, (struct sockaddr *)rem_in, sizeof(*rem_in)) == -1) {
-		warnv(0, "connect()");
-		req5->cd = 1;
-	} else {
-		req5->cd = 0;
+/*
+ * Parse VER CMD RSV ATYP DST.ADDR DST.PORT.
+ */
+static int
+socks5_parse_request(const u_char *buf, size_t len, void *arg)
+{
+	struct socks5_request *request = arg;
+	struct socks5_req *req5 = &request->req;
+	size_t need;
+
+	if (len < 5)
+		return (NET_PARSE_MORE);
+	if (buf[0] != 5)
+		return (NET_PARSE_FAIL);
+
+	req5->vn = buf[0];
+	req5->cd = buf[1];
+	req5->rsv = 0;
+	req5->atyp = buf[3];
+
+	switch (req5->atyp) {
+	case SOCKS5_ATYP_IPV4:
+		need = 4 + 4 + 2;
+		if (len < need)
+			return (NET_PARSE_MORE);
+		request->fqdn = 0;
+		memcpy(&req5->destaddr, buf + 4, sizeof(req5->destaddr));
+		break;
+	case SOCKS5_ATYP_FQDN:
+		need = 5 + buf[4] + 2;
+		if (len < need)
+			return (NET_PARSE_MORE);
+		request->fqdn = 1;
+		memcpy(request->hostname, buf + 5, buf[4]);
+		request->hostname[buf[4]] = '\0';
+		req5->destaddr = 0;
+		break;
+	default:
+		return (NET_PARSE_FAIL);
 	}
 
+	memcpy(&req5->destport, buf + need - 2, sizeof(req5->destport));
+
+	return (need);
+}
+
+static int
+socks5_connect(struct negdesc *nd, struct sockaddr_in *rem_in,
+    struct socks5_req *req5, struct conndesc *conn)
+{
+	int remsock;
+
+	/* Any data the client pipelined goes out with the connect */
+	if ((remsock = net_connect(conn, (struct sockaddr *)rem_in,
+		 sizeof(*rem_in), nd)) == -1)
+		req5->cd = socks5_rep(errno);
+	else
+		req5->cd = 0;
+
 	/* getpeername() */
 
 	req5->atyp = SOCKS5_ATYP_IPV4;
 	/* XXX fill in address and port of our server (getsockname()) */
 
-	if (atomicio(write, clisock, req5, 10) != 10) {
+	if (atomicio(write, nd->sock, req5, 10) != 10) {
 		warnv(1, "write()");
 		goto fail;
 	}
 
-	if (req5->cd == 1)
+	if (req5->cd != 0)
 		goto fail;
 
 	return (remsock);
 
  fail:
-	close(remsock);
+	if (remsock != -1)
+		close(remsock);
 	return (-1);
 }
 
+/*
+ * Listen on an ephemeral port of ours, on the connecting interface
+ * if one is set, and wait for the peer without blocking: the replies
+ * are sent and the peer accepted from event callbacks, and the wait
+ * is bounded by bind_timeout.  tgt_in is the peer we expect.
+ */
 static int
-socks5_bind(int clisock, struct sockaddr_in *tgt_in, struct socks5_req *req5)
+socks5_bind(int clisock, struct sockaddr_in *tgt_in, struct socks5_req *req5,
+    struct conndesc *conn)
 {
-        struct sockaddr_in cli_in;
+	struct socks5_bindq bq;
+	struct sockaddr_in bnd_in;
+	struct net_source *src;
 	socklen_t len;
-	int tgtsock = -1, listensock;
 
-	if ((listensock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+	memset(&bq, 0, sizeof(bq));
+	bq.clisock = clisock;
+	bq.tgtsock = -1;
+	bq.req5 = req5;
+	memcpy(&bq.tgt_in, tgt_in, sizeof(bq.tgt_in));
+
+	if ((src = net_source(conn, (struct sockaddr *)tgt_in,
+		 NULL)) != NULL) {
+		memcpy(&bnd_in, src->ai->ai_addr, sizeof(bnd_in));
+	} else {
+		len = sizeof(bnd_in);
+		if (getsockname(clisock, (struct sockaddr *)&bnd_in,
+			&len) == -1) {
+			warnv(1, "getsockname()");
+			return (-1);
+		}
+	}
+	bnd_in.sin_port = 0;
+
+	if ((bq.listensock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
 		warnv(1, "socket()");
-                return (-1);
+		return (-1);
 	}
 
-        if (bind(listensock, (struct sockaddr *)tgt_in, sizeof(*tgt_in)) == -1) {
-                warnv(1, "bind()");
-                goto out;
-        }
+	if (fcntl(bq.listensock, F_SETFL, O_NONBLOCK) == -1) {
+		warnv(1, "fcntl()");
+		goto out;
+	}
 
-        if (listen(listensock, 1) == -1) {
+	if (bind(bq.listensock, (struct sockaddr *)&bnd_in,
+		sizeof(bnd_in)) == -1) {
+		warnv(1, "bind()");
+		goto out;
+	}
+
+	if (listen(bq.listensock, 1) == -1) {
 		warnv(1, "listen()");
 		goto out;
-        }
+	}
 
-	/* Reply: success */
+	len = sizeof(bnd_in);
+	if (getsockname(bq.listensock, (struct sockaddr *)&bnd_in,
+		&len) == -1) {
+		warnv(1, "getsockname()");
+		goto out;
+	}
+
+	/* First reply: where the peer should connect */
 	req5->atyp = SOCKS5_ATYP_IPV4;
 	req5->cd = 0;
+	req5->destaddr = bnd_in.sin_addr.s_addr;
+	req5->destport = bnd_in.sin_port;
 
-	if (atomicio(write, clisock, req5, 10) != 10)
+	if ((bq.base = event_base_new()) == NULL) {
+		warnxv(1, "event_base_new()");
 		goto out;
+	}
 
-	len = sizeof(cli_in);
-        if ((tgtsock = accept(listensock, (struct sockaddr *)&cli_in, &len)) == -1)
-		goto out;
+	event_set(&bq.ev, clisock, EV_WRITE, socks5_bind_reply, &bq);
+	event_base_set(bq.base, &bq.ev);
+	event_set(&bq.cliev, clisock, EV_READ | EV_PERSIST, socks5_bind_client,
+	    &bq);
+	event_base_set(bq.base, &bq.cliev);
 
-        req5->destaddr = cli_in.sin_addr.s_addr;
-        req5->destport = cli_in.sin_port;
+	if (event_add(&bq.ev, NULL) == -1)
+		warnv(1, "event_add()");
+	else
+		event_base_dispatch(bq.base);
 
-	/* Send second reply */
-	if (atomicio(write, clisock, req5, 10) != 10) {
+	event_base_free(bq.base);
+
+ out:
+	close(bq.listensock);
+
+	return (bq.tgtsock);
+}
+
+static void
+socks5_bind_reply(int fd, short ev, void *data)
+{
+	struct socks5_bindq *bq = data;
+	struct timeval tv;
+	extern int bind_timeout;
+
+	if (atomicio(write, fd, bq->req5, 10) != 10) {
+		warnv(1, "write()");
+		return;
+	}
+
+	timerclear(&tv);
+	tv.tv_sec = bind_timeout;
+	gettimeofday(&bq->deadline, NULL);
+	timeradd(&bq->deadline, &tv, &bq->deadline);
+
+	event_set(&bq->ev, bq->listensock, EV_READ, socks5_bind_accept, bq);
+	event_base_set(bq->base, &bq->ev);
+	if (socks5_bind_wait(bq) == -1 ||
+	    event_add(&bq->cliev, NULL) == -1) {
+		warnv(1, "event_add()");
+		socks5_bind_done(bq, -1);
+	}
+}
+
+/*
+ * Wait for the peer until the deadline, however many stray
+ * connections came first.
+ */
+static int
+socks5_bind_wait(struct socks5_bindq *bq)
+{
+	struct timeval now, tv;
+
+	gettimeofday(&now, NULL);
+	if (!timercmp(&now, &bq->deadline, <)) {
+		errno = ETIMEDOUT;
+		return (-1);
+	}
+	timersub(&bq->deadline, &now, &tv);
+
+	return (event_add(&bq->ev, &tv));
+}
+
+static void
+socks5_bind_accept(int fd, short ev, void *data)
+{
+	struct socks5_bindq *bq = data;
+	struct sockaddr_in peer_in;
+	socklen_t len;
+	int tgtsock;
+
+	if (ev & EV_TIMEOUT)
+		goto timeout;
+
+	len = sizeof(peer_in);
+	if ((tgtsock = accept(fd, (struct sockaddr *)&peer_in, &len)) == -1) {
+		if (errno != EAGAIN && errno != EINTR &&
+		    errno != ECONNABORTED) {
+			warnv(1, "accept()");
+			socks5_bind_done(bq, -1);
+		} else if (socks5_bind_wait(bq) == -1)
+			goto timeout;
+		return;
+	}
+
+	/* Only the peer named in the request may connect */
+	if (bq->tgt_in.sin_addr.s_addr != INADDR_ANY &&
+	    peer_in.sin_addr.s_addr != bq->tgt_in.sin_addr.s_addr) {
+		warnxv(1, "Unexpected BIND peer %s",
+		    inet_ntoa(peer_in.sin_addr));
 		close(tgtsock);
-		tgtsock = -1;
+		if (socks5_bind_wait(bq) == -1)
+			goto timeout;
+		return;
 	}
 
- out:
-	close(listensock);
+	bq->req5->destaddr = peer_in.sin_addr.s_addr;
+	bq->req5->destport = peer_in.sin_port;
+
+	socks5_bind_done(bq, tgtsock);
+	return;
+
+ timeout:
+	warnxv(1, "Timed out waiting for BIND peer");
+	socks5_bind_done(bq, -1);
+}
+
+/*
+ * The client is not supposed to talk before the second reply; if it
+ * goes away, so does the BIND.  What it does send is read, so that
+ * its close is still seen, and passed on once the peer connects.
+ */
+static void
+socks5_bind_client(int fd, short ev, void *data)
+{
+	struct socks5_bindq *bq = data;
+	ssize_t n;
+
+	if (bq->nearly == sizeof(bq->early)) {
+		warnxv(1, "Too much data from client during BIND");
+		socks5_bind_done(bq, -1);
+		return;
+	}
+
+	n = read(fd, bq->early + bq->nearly, sizeof(bq->early) - bq->nearly);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) {
+		warnxv(1, "Client closed connection during BIND");
+		bq->clisock = -1;
+		socks5_bind_done(bq, -1);
+		return;
+	}
+
+	bq->nearly += n;
+}
+
+/*
+ * Send the second reply and stop waiting.
+ */
+static void
+socks5_bind_done(struct socks5_bindq *bq, int tgtsock)
+{
+	event_del(&bq->ev);
+	event_del(&bq->cliev);
+
+	if (bq->clisock == -1) {
+		if (tgtsock != -1)
+			close(tgtsock);
+		return;
+	}
+
+	bq->req5->cd = tgtsock == -1 ? 1 : 0;
+
+	if (atomicio(write, bq->clisock, bq->req5, 10) != 10) {
+		warnv(1, "write()");
+		if (tgtsock != -1)
+			close(tgtsock);
+		return;
+	}
+
+	if (tgtsock != -1 && bq->nearly > 0 &&
+	    atomicio(write, tgtsock, bq->early, bq->nearly) != bq->nearly) {
+		warnv(1, "write()");
+		close(tgtsock);
+		return;
+	}
+
+	bq->tgtsock = tgtsock;
+}
+
+/*
+ * rem_in is where the client expects to send datagrams from; the
+ * reply carries the address of our relay.
+ */
+static int
+socks5_udp_assoc(int clisock, struct sockaddr_in *rem_in,
+    struct socks5_req *req5, struct conndesc *conn)
+{
+	struct udp_assoc *ua;
+	struct sockaddr_in bnd_in;
+
+	memset(&bnd_in, 0, sizeof(bnd_in));
+
+	if ((ua = udp_setup(clisock, rem_in, conn, &bnd_in)) == NULL)
+		req5->cd = 1;
+	else
+		req5->cd = 0;
+
+	req5->atyp = SOCKS5_ATYP_IPV4;
+	req5->destaddr = bnd_in.sin_addr.s_addr;
+	req5->destport = bnd_in.sin_port;
+
+	if (atomicio(write, clisock, req5, 10) != 10) {
+		warnv(1, "write()");
+		return (-1);
+	}
+
+	if (ua == NULL)
+		return (-1);
+
+	udp_relay(ua);
+	/* NOTREACHED */
 
-	return (tgtsock);
+	return (NET_NOPROXY);
 }
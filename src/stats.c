@@ -0,0 +1,596 @@
+/*
+ * stats.c
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "cleanup.h"
+#include "net.h"
+#include "print.h"
+#include "stats.h"
+
+/*
+ * Counters for the stats and metrics listeners.  Every child counts
+ * into its own slot of a table shared with the listening process, so
+ * nothing is locked; the slots are only added up when somebody asks,
+ * from the listening process's event loop.  When a child exits, its
+ * slot is added to the totals for its listener and mode.
+ */
+
+#define STATS_BUFSZ 8192
+
+char *stats_listen;
+
+extern cleanup_t *cleanup;
+
+const char *stats_modes[STATS_NMODES] = {
+	"negotiating", "socks4", "socks5", "http", "mirror", "transparent"
+};
+const char *stats_causes[STATS_NNEG] = {
+	"protocol", "eof", "auth", "denied", "dns", "connect"
+};
+
+/* Upper bounds in microseconds, from half a millisecond to 10 seconds */
+const u_int64_t stats_bounds[STATS_NBUCKETS] = {
+	500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+	500000, 1000000, 2500000, 5000000, 10000000
+};
+
+static u_int64_t            stats_stamps[STATS_NSTAMPS];
+
+static struct stats_shm    *stats;
+static struct stats_worker *stats_me;	/* NULL in the listening process */
+static struct stats_worker  stats_untracked;	/* A child without a slot */
+static int                  stats_sock = -1;
+static struct event         stats_ev;
+static pid_t                stats_owner;	/* Removes Unix sockets */
+static char                 stats_buf[STATS_BUFSZ];
+static size_t               stats_len;
+
+static void stats_serve(int, short, void *);
+static void stats_printf(const char *, ...);
+static void stats_cleanup(void *);
+static void stats_fold(struct stats_total *, struct stats_total *);
+
+void
+stats_setup(void)
+{
+	stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_SHARED, -1, 0);
+	if (stats == MAP_FAILED)
+		errv(0, 1, "mmap()");
+	stats_owner = getpid();
+
+	if (stats_listen == NULL)
+		return;
+
+	stats_sock = stats_socket(stats_listen);
+	if (cleanup_add(cleanup, stats_cleanup, NULL) == -1)
+		errxv(0, 1, "cleanup_add()");
+
+	event_set(&stats_ev, stats_sock, EV_READ | EV_PERSIST, stats_serve,
+	    NULL);
+	if (event_add(&stats_ev, NULL) == -1)
+		errv(0, 1, "event_add()");
+
+	warnxv(1, "Statistics on %s", stats_listen);
+}
+
+/*
+ * A listening socket for addr: the path of a Unix socket, a port on
+ * the loopback address, or "address:port".
+ */
+int
+stats_socket(const char *addr)
+{
+	struct sockaddr_un sun;
+	struct addrinfo *ai;
+	char pair[NI_MAXHOST + NI_MAXSERV];
+	int sock, on = 1;
+
+	if (strchr(addr, '/') != NULL) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlcpy(sun.sun_path, addr,
+			sizeof(sun.sun_path)) >= sizeof(sun.sun_path))
+			errxv(0, 1, "Socket path too long: %s", addr);
+		if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+			errv(0, 1, "socket()");
+		/* Left behind by an earlier run */
+		unlink(addr);
+		if (bind(sock, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+			errv(0, 1, "bind(): %s", addr);
+	} else {
+		if (strchr(addr, ':') == NULL)
+			snprintf(pair, sizeof(pair), "127.0.0.1:%s", addr);
+		else
+			strlcpy(pair, addr, sizeof(pair));
+		if ((ai = get_ai_from_addrpair(pair)) == NULL)
+			errxv(0, 1, "Error resolving address %s", pair);
+		if ((sock = socket(ai->ai_family, SOCK_STREAM, 0)) == -1)
+			errv(0, 1, "socket()");
+		if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
+			&on, sizeof(on)) == -1)
+			warnv(0, "setsockopt()");
+		if (bind(sock, ai->ai_addr, ai->ai_addrlen) == -1)
+			errv(0, 1, "bind(): %s", pair);
+		freeaddrinfo(ai);
+	}
+
+	if (listen(sock, 10) == -1)
+		errv(0, 1, "listen()");
+	/* A restart on SIGHUP binds it again */
+	if (fcntl(sock, F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(sock, F_SETFD, FD_CLOEXEC) == -1)
+		errv(0, 1, "fcntl()");
+
+	return (sock);
+}
+
+/* Children close the listeners, only their owner removes them */
+void
+stats_unlink(const char *addr)
+{
+	if (getpid() == stats_owner && strchr(addr, '/') != NULL)
+		unlink(addr);
+}
+
+/*
+ * Returns the index of a new listener called name, or -1.
+ */
+int
+stats_listener(const char *name)
+{
+	struct stats_listener *sl;
+
+	if (stats == NULL || stats->nlisteners == STATS_LISTENERS)
+		return (-1);
+
+	sl = &stats->listeners[stats->nlisteners];
+	strlcpy(sl->name, name, sizeof(sl->name));
+
+	return (stats->nlisteners++);
+}
+
+void
+stats_accept(int listener, int allowed)
+{
+	if (stats == NULL || listener == -1)
+		return;
+
+	if (allowed)
+		stats->listeners[listener].accepts++;
+	else
+		stats->listeners[listener].rejects++;
+}
+
+/*
+ * Find a slot for a child about to be forked for listener.  Returns
+ * -1 if there is none; the child then goes uncounted.
+ */
+int
+stats_fork(int listener)
+{
+	struct stats_worker *sw;
+	static int next;
+	int i, slot;
+
+	if (stats == NULL || listener == -1)
+		return (-1);
+
+	for (i = 0; i < STATS_WORKERS; i++) {
+		slot = (next + i) % STATS_WORKERS;
+		sw = &stats->workers[slot];
+		if (sw->pid == 0) {
+			memset(sw, 0, sizeof(*sw));
+			sw->pid = -1;
+			sw->listener = listener;
+			next = slot + 1;
+			return (slot);
+		}
+	}
+
+	stats->untracked++;
+	return (-1);
+}
+
+/*
+ * Called on both sides of fork(), with its return.  A child without
+ * a slot still counts for itself, for the access log.
+ */
+void
+stats_forked(int slot, pid_t pid)
+{
+	if (stats == NULL || slot == -1) {
+		if (pid == 0) {
+			memset(&stats_untracked, 0, sizeof(stats_untracked));
+			stats_me = &stats_untracked;
+		}
+		return;
+	}
+
+	switch (pid) {
+	case -1:
+		stats->workers[slot].pid = 0;
+		break;
+	case 0:
+		stats_me = &stats->workers[slot];
+		break;
+	default:
+		stats->workers[slot].pid = pid;
+		break;
+	}
+}
+
+/* What this child counted so far; NULL in the listening process */
+struct stats_worker *
+stats_self(void)
+{
+	return (stats_me);
+}
+
+/*
+ * A child has exited; keep what it counted.
+ */
+void
+stats_reap(pid_t pid)
+{
+	struct stats_worker *sw;
+	struct stats_total *st;
+	int slot;
+
+	if (stats == NULL)
+		return;
+
+	for (slot = 0; slot < STATS_WORKERS; slot++) {
+		sw = &stats->workers[slot];
+		if (sw->pid != pid)
+			continue;
+
+		st = &stats->retired[sw->listener][sw->mode];
+		stats_fold(st, &sw->total);
+		st->closed[sw->failed ? STATS_FAIL : STATS_OK]++;
+		sw->pid = 0;
+		break;
+	}
+}
+
+void
+stats_mode(int mode)
+{
+	if (stats_me != NULL)
+		stats_me->mode = mode;
+}
+
+/* The latest cause given is the one counted */
+void
+stats_cause(int cause)
+{
+	if (stats_me != NULL)
+		stats_me->cause = cause;
+}
+
+void
+stats_negfail(void)
+{
+	if (stats_me != NULL) {
+		stats_me->total.negfails[stats_me->cause]++;
+		stats_me->failed = 1;
+	}
+}
+
+void
+stats_add(int counter, u_int64_t n)
+{
+	if (stats_me != NULL)
+		stats_me->total.counters[counter] += n;
+}
+
+/* Microseconds from some fixed point, which never goes back */
+u_int64_t
+stats_clock(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return (0);
+	return ((u_int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((u_int64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+#endif /* CLOCK_MONOTONIC */
+}
+
+/*
+ * Record that something took usec, with outcome STATS_OK or
+ * STATS_FAIL, in histogram hist.
+ */
+void
+stats_time(int hist, int outcome, u_int64_t usec)
+{
+	struct stats_hist *sh;
+	int i;
+
+	if (stats_me == NULL)
+		return;
+
+	sh = &stats_me->total.hists[hist][outcome];
+	for (i = 0; i < STATS_NBUCKETS && usec > stats_bounds[i]; i++)
+		;
+	sh->buckets[i]++;
+	sh->sum += usec;
+}
+
+/*
+ * The listening process starts the stamps for each client just before
+ * forking, and the child carries on with them.
+ */
+void
+stats_stamps_start(u_int64_t accepted)
+{
+	memset(stats_stamps, 0, sizeof(stats_stamps));
+	stats_stamps[STATS_T_ACCEPT] = accepted;
+}
+
+/* Only the first time counts; returns the time now either way */
+u_int64_t
+stats_stamp(int stamp)
+{
+	u_int64_t now = stats_clock();
+
+	if (stats_stamps[stamp] == 0)
+		stats_stamps[stamp] = now;
+
+	return (now);
+}
+
+/*
+ * The client has its reply: outcome is STATS_OK if it is connected.
+ * Times the phases up to now.
+ */
+void
+stats_replied(int outcome)
+{
+	u_int64_t *t = stats_stamps, now, request;
+
+	now = stats_stamp(STATS_T_REPLY);
+
+	/* The request is understood when it is first acted on */
+	if ((request = t[STATS_T_DNS]) == 0 &&
+	    (request = t[STATS_T_CONNECT]) == 0)
+		request = now;
+
+	stats_time(STATS_HIST_REPLY, outcome, now - t[STATS_T_ACCEPT]);
+	stats_time(STATS_HIST_ACL, STATS_OK,
+	    t[STATS_T_ACL] - t[STATS_T_ACCEPT]);
+	if (t[STATS_T_FORK] != 0)
+		stats_time(STATS_HIST_HANDSHAKE, outcome,
+		    request - t[STATS_T_FORK]);
+}
+
+/* stamp is STATS_T_FIRST_CLIENT or STATS_T_FIRST_REMOTE */
+void
+stats_first(int stamp)
+{
+	u_int64_t now = stats_stamp(stamp);
+
+	stats_time(stamp == STATS_T_FIRST_CLIENT ? STATS_HIST_FIRST_CLIENT :
+	    STATS_HIST_FIRST_REMOTE, STATS_OK,
+	    now - stats_stamps[STATS_T_REPLY]);
+}
+
+/*
+ * How long each phase of the connection took, in milliseconds, for
+ * the log.  A phase that did not happen is "-".
+ */
+void
+stats_phases(char *buf, size_t len)
+{
+	static const struct {
+		const char *name;
+		int         from;
+		int         to;
+	} phases[] = {
+		{ "acl",       STATS_T_ACCEPT,    STATS_T_ACL },
+		{ "fork",      STATS_T_ACL,       STATS_T_FORK },
+		{ "handshake", STATS_T_FORK,      -1 },
+		{ "dns",       STATS_T_DNS,       STATS_T_DNS_DONE },
+		{ "connect",   STATS_T_CONNECT,   STATS_T_CONNECTED },
+		{ "reply",     STATS_T_ACCEPT,    STATS_T_REPLY },
+		{ "up",        STATS_T_REPLY,     STATS_T_FIRST_CLIENT },
+		{ "down",      STATS_T_REPLY,     STATS_T_FIRST_REMOTE },
+		{ "relay",     STATS_T_REPLY,     STATS_NSTAMPS }
+	};
+	u_int64_t *t = stats_stamps, from, to, now = stats_clock();
+	size_t off = 0;
+	u_int i;
+	int ret;
+
+	buf[0] = '\0';
+	for (i = 0; i < sizeof(phases) / sizeof(phases[0]); i++) {
+		from = t[phases[i].from];
+		if (phases[i].to == STATS_NSTAMPS)
+			to = now;
+		else if (phases[i].to != -1)
+			to = t[phases[i].to];
+		else if ((to = t[STATS_T_DNS]) == 0 &&
+		    (to = t[STATS_T_CONNECT]) == 0)
+			to = t[STATS_T_REPLY];
+
+		if (from == 0 || to == 0 || to < from)
+			ret = snprintf(buf + off, len - off, "%s%s -",
+			    i > 0 ? " " : "", phases[i].name);
+		else
+			ret = snprintf(buf + off, len - off, "%s%s %llu.%03llu",
+			    i > 0 ? " " : "", phases[i].name,
+			    (unsigned long long)(to - from) / 1000,
+			    (unsigned long long)(to - from) % 1000);
+		if (ret < 0 || (size_t)ret >= len - off)
+			return;
+		off += ret;
+	}
+	snprintf(buf + off, len - off, " ms");
+}
+
+/*
+ * Add up everything counted so far into totals, per listener and
+ * mode, and the children busy in each into active.  Returns the
+ * table, for the listeners.
+ */
+struct stats_shm *
+stats_sum(struct stats_total totals[][STATS_NMODES],
+    u_int active[][STATS_NMODES])
+{
+	struct stats_worker *sw;
+	int slot;
+
+	memcpy(totals, stats->retired, sizeof(stats->retired));
+	memset(active, 0, STATS_LISTENERS * sizeof(*active));
+
+	for (slot = 0; slot < STATS_WORKERS; slot++) {
+		sw = &stats->workers[slot];
+		if (sw->pid <= 0 || sw->listener < 0 ||
+		    sw->listener >= STATS_LISTENERS ||
+		    sw->mode < 0 || sw->mode >= STATS_NMODES)
+			continue;
+		stats_fold(&totals[sw->listener][sw->mode], &sw->total);
+		active[sw->listener][sw->mode]++;
+	}
+
+	return (stats);
+}
+
+static void
+stats_fold(struct stats_total *to, struct stats_total *from)
+{
+	int i, j, k;
+
+	for (i = 0; i < STATS_NCOUNTERS; i++)
+		to->counters[i] += from->counters[i];
+	for (i = 0; i < STATS_NNEG; i++)
+		to->negfails[i] += from->negfails[i];
+	for (i = 0; i < STATS_NOUTCOMES; i++)
+		to->closed[i] += from->closed[i];
+	for (i = 0; i < STATS_NHISTS; i++)
+		for (j = 0; j < STATS_NOUTCOMES; j++) {
+			for (k = 0; k <= STATS_NBUCKETS; k++)
+				to->hists[i][j].buckets[k] +=
+				    from->hists[i][j].buckets[k];
+			to->hists[i][j].sum += from->hists[i][j].sum;
+		}
+}
+
+/*
+ * Write the lot to whoever connected.  The report is small enough for
+ * the socket buffer, so this does not block the event loop.
+ */
+static void
+stats_serve(int fd, short ev, void *data)
+{
+	static struct stats_total totals[STATS_LISTENERS][STATS_NMODES];
+	u_int active[STATS_LISTENERS][STATS_NMODES];
+	u_int64_t counters[STATS_NCOUNTERS], negfails[STATS_NNEG];
+	u_int nworkers = 0;
+	int sock, i, j, k;
+
+	if ((sock = accept(fd, NULL, NULL)) == -1) {
+		if (errno != EAGAIN && errno != EINTR)
+			warnv(0, "accept()");
+		return;
+	}
+
+	stats_sum(totals, active);
+
+	memset(counters, 0, sizeof(counters));
+	memset(negfails, 0, sizeof(negfails));
+
+	stats_len = 0;
+	for (i = 0; i < stats->nlisteners; i++) {
+		stats_printf("listener %s accepts %llu rejects %llu\n",
+		    stats->listeners[i].name,
+		    (unsigned long long)stats->listeners[i].accepts,
+		    (unsigned long long)stats->listeners[i].rejects);
+		for (j = 0; j < STATS_NMODES; j++) {
+			stats_printf("active %s %s %u\n",
+			    stats->listeners[i].name, stats_modes[j],
+			    active[i][j]);
+			nworkers += active[i][j];
+			for (k = 0; k < STATS_NCOUNTERS; k++)
+				counters[k] += totals[i][j].counters[k];
+			for (k = 0; k < STATS_NNEG; k++)
+				negfails[k] += totals[i][j].negfails[k];
+		}
+	}
+	stats_printf("workers %u untracked %llu\n", nworkers,
+	    (unsigned long long)stats->untracked);
+	stats_printf("bytes client %llu\n",
+	    (unsigned long long)counters[STATS_BYTES_CLIENT]);
+	stats_printf("bytes remote %llu\n",
+	    (unsigned long long)counters[STATS_BYTES_REMOTE]);
+	for (i = 0; i < STATS_NNEG; i++)
+		stats_printf("negfail %s %llu\n", stats_causes[i],
+		    (unsigned long long)negfails[i]);
+	stats_printf("errors dns %llu\n",
+	    (unsigned long long)counters[STATS_DNS_ERRORS]);
+	stats_printf("errors connect %llu\n",
+	    (unsigned long long)counters[STATS_CONNECT_ERRORS]);
+
+	if (write(sock, stats_buf, stats_len) == -1)
+		warnv(1, "write()");
+	close(sock);
+}
+
+static void
+stats_printf(const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = vsnprintf(stats_buf + stats_len, sizeof(stats_buf) - stats_len,
+	    fmt, ap);
+	va_end(ap);
+
+	if (ret < 0)
+		return;
+	stats_len += ret;
+	if (stats_len >= sizeof(stats_buf))
+		stats_len = sizeof(stats_buf) - 1;
+}
+
+static void
+stats_cleanup(void *data)
+{
+	close(stats_sock);
+	event_del(&stats_ev);
+	stats_unlink(stats_listen);
+}
@@ -0,0 +1,1123 @@
+/*
+ * tunnel.c
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <event.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "access.h"
+#include "atomicio.h"
+#include "cleanup.h"
+#include "net.h"
+#include "socks5.h"
+#include "tunnel.h"
+#include "print.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif /* MSG_NOSIGNAL */
+
+/* Queued frames per connection before streams stop reading */
+#define TUNNEL_BUFSZ   (256 * 1024)
+#define TUNNEL_TIMEOUT 30	/* Without Connect-Timeout */
+
+/* Stream states */
+#define TS_WAITING    0		/* For the request from the child */
+#define TS_OPENING    1		/* For the peer to connect */
+#define TS_CONNECTING 2		/* To the destination, for the peer */
+#define TS_OPEN       3
+
+/* Stream flags */
+#define TS_READING  0x01
+#define TS_LOCALEOF 0x02
+#define TS_PEEREOF  0x04
+#define TS_SHUTDOWN 0x08
+
+/*
+ * The tunnel carries the outgoing connections of one nylon over a
+ * few long lived connections to another, which makes the connects on
+ * our behalf.  The listening process owns the tunnel connections.
+ * Each client gets one end of a socketpair when it is forked and
+ * asks for its destination over it; the listening process then
+ * relays between the socketpair and the tunnel.  Both ends of the
+ * tunnel run the same code, but streams are only opened by the end
+ * that dialed the connections; the accepting end serves them.  Every
+ * stream may have TUNNEL_STREAMWIN bytes in flight in each
+ * direction, which bounds the buffering in both processes.
+ */
+int tunnel_conns = 2;
+
+extern cleanup_t *cleanup;
+extern int connect_timeout;
+
+static void                  tunnel_retry(int, short, void *);
+static void                  tunnel_accept(int, short, void *);
+static struct tunnel_conn   *tunnel_conn_new(struct tunnel *, int, int);
+static void                  tunnel_conn_free(struct tunnel_conn *);
+static void                  tunnel_conn_connected(int, short, void *);
+static void                  tunnel_conn_ready(struct tunnel_conn *);
+static void                  tunnel_conn_read(int, short, void *);
+static void                  tunnel_conn_write(int, short, void *);
+static struct tunnel_conn   *tunnel_pick(struct tunnel *);
+static u_char               *tunnel_reserve(struct tunnel_conn *, size_t);
+static void                  tunnel_send(struct tunnel_conn *, int,
+                                 u_int32_t, const void *, size_t);
+static void                  tunnel_hdr(u_char *, int, u_int32_t, size_t);
+static void                  tunnel_conn_schedule(struct tunnel_conn *);
+static int                   tunnel_frame(struct tunnel_conn *, int,
+                                 u_int32_t, u_char *, size_t);
+static struct tunnel_stream *tunnel_stream_new(struct tunnel *,
+                                 struct tunnel_conn *, u_int32_t, int, int);
+static struct tunnel_stream *tunnel_stream_lookup(struct tunnel_conn *,
+                                 u_int32_t);
+static void                  tunnel_stream_free(struct tunnel_stream *);
+static void                  tunnel_stream_reset(struct tunnel_stream *);
+static void                  tunnel_stream_dial(struct tunnel_conn *,
+                                 u_int32_t, u_char *, size_t);
+static void                  tunnel_stream_connected(int, short, void *);
+static void                  tunnel_stream_request(struct tunnel_stream *);
+static void                  tunnel_stream_read(int, short, void *);
+static void                  tunnel_stream_write(int, short, void *);
+static int                   tunnel_stream_flush(struct tunnel_stream *);
+static void                  tunnel_stream_resume(struct tunnel_stream *);
+static void                  tunnel_stream_pause(struct tunnel_stream *);
+static void                  tunnel_stream_append(struct tunnel_stream *,
+                                 const u_char *, size_t);
+static int                   tunnel_addr(u_char *, size_t,
+                                 struct sockaddr_storage *, socklen_t *);
+static void                  tunnel_cleanup(void *);
+
+/*
+ * peer is the "host:port" of a nylon to open streams to, listen the
+ * "host:port" to accept tunnels from other nylons on.
+ */
+struct tunnel *
+tunnel_new(char *peer, char *listen_addr)
+{
+	struct tunnel *t;
+	struct addrinfo *ai;
+	int on = 1;
+
+	if ((t = calloc(1, sizeof(*t))) == NULL)
+		errv(0, 1, "calloc()");
+
+	t->listensock = t->childsock = t->parentsock = -1;
+	TAILQ_INIT(&t->conns);
+	TAILQ_INIT(&t->waiting);
+
+	if (peer != NULL) {
+		if ((t->peer_ai = get_ai_from_addrpair(peer)) == NULL)
+			errxv(0, 1, "Error resolving host:pair address");
+		if ((t->peer = strdup(peer)) == NULL)
+			errv(0, 1, "strdup()");
+	}
+
+	if (listen_addr != NULL) {
+		if ((ai = get_ai_from_addrpair(listen_addr)) == NULL)
+			errxv(0, 1, "Error resolving host:pair address");
+		if ((t->listensock = socket(ai->ai_family, SOCK_STREAM,
+			 0)) == -1)
+			errv(0, 1, "socket()");
+		if (setsockopt(t->listensock, SOL_SOCKET, SO_REUSEADDR,
+			&on, sizeof(on)) == -1)
+			warnv(0, "setsockopt()");
+		if (bind(t->listensock, ai->ai_addr, ai->ai_addrlen) == -1)
+			errv(0, 1, "bind()");
+		if (listen(t->listensock, 10) == -1)
+			errv(0, 1, "listen()");
+		if (fcntl(t->listensock, F_SETFL, O_NONBLOCK) == -1)
+			errv(0, 1, "fcntl()");
+		freeaddrinfo(ai);
+
+		warnxv(1, "Accepting tunnels on %s", listen_addr);
+	}
+
+	return (t);
+}
+
+void
+tunnel_start(struct tunnel *t, struct conndesc *conn)
+{
+	t->conn = conn;
+
+	if (cleanup_add(cleanup, tunnel_cleanup, t) == -1)
+		errxv(0, 1, "cleanup_add()");
+
+	if (t->listensock != -1) {
+		event_set(&t->listenev, t->listensock, EV_READ | EV_PERSIST,
+		    tunnel_accept, t);
+		if (event_add(&t->listenev, NULL) == -1)
+			errv(0, 1, "event_add()");
+	}
+
+	if (t->peer_ai != NULL) {
+		evtimer_set(&t->retryev, tunnel_retry, t);
+		tunnel_retry(-1, 0, t);
+	}
+}
+
+void
+tunnel_report(struct tunnel *t)
+{
+	struct tunnel_conn *tc;
+
+	TAILQ_FOREACH(tc, &t->conns, next)
+		warnxv(0, "Tunnel %s %s: %s, %u streams, %lu bytes queued",
+		    tc->outgoing ? "to" : "from",
+		    tc->outgoing ? t->peer : "peer",
+		    tc->connected ? "up" : "connecting", tc->nstreams,
+		    (u_long)tc->outlen);
+}
+
+/*
+ * Called before the listening process forks a child for a client: the
+ * socketpair becomes the child's connection to the tunnel.
+ */
+int
+tunnel_prefork(struct tunnel *t)
+{
+	int sv[2];
+
+	if (t->peer_ai == NULL)
+		return (0);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		warnv(0, "socketpair()");
+		return (-1);
+	}
+
+	t->parentsock = sv[0];
+	t->childsock = sv[1];
+
+	return (0);
+}
+
+void
+tunnel_postfork(struct tunnel *t, pid_t pid)
+{
+	struct tunnel_stream *ts;
+
+	if (t->parentsock == -1)
+		return;
+
+	if (pid == 0) {
+		close(t->parentsock);
+		t->parentsock = -1;
+		return;
+	}
+
+	close(t->childsock);
+	t->childsock = -1;
+
+	if (pid == -1 || fcntl(t->parentsock, F_SETFL, O_NONBLOCK) == -1) {
+		close(t->parentsock);
+		t->parentsock = -1;
+		return;
+	}
+
+	ts = tunnel_stream_new(t, NULL, 0, t->parentsock, TS_WAITING);
+	t->parentsock = -1;
+	if (ts != NULL && event_add(&ts->rev, NULL) == -1) {
+		warnv(0, "event_add()");
+		tunnel_stream_free(ts);
+	}
+}
+
+/*
+ * Ask the listening process for a stream to sa.  Runs in the child
+ * serving the client; the socketpair is the connection to the
+ * destination from here on.
+ */
+int
+tunnel_connect(struct tunnel *t, struct sockaddr *sa, socklen_t salen)
+{
+	u_char req[19], rep;
+	size_t len;
+	int sock = t->childsock;
+
+	if (sock == -1) {
+		errno = ENOTCONN;
+		return (-1);
+	}
+	t->childsock = -1;
+
+	switch (sa->sa_family) {
+	case AF_INET:
+		req[0] = 0x01;
+		memcpy(req + 1, &((struct sockaddr_in *)sa)->sin_addr, 4);
+		memcpy(req + 5, &((struct sockaddr_in *)sa)->sin_port, 2);
+		len = 7;
+		break;
+	case AF_INET6:
+		req[0] = 0x04;
+		memcpy(req + 1, &((struct sockaddr_in6 *)sa)->sin6_addr, 16);
+		memcpy(req + 17, &((struct sockaddr_in6 *)sa)->sin6_port, 2);
+		len = 19;
+		break;
+	default:
+		close(sock);
+		errno = EAFNOSUPPORT;
+		return (-1);
+	}
+
+	if (atomicio(write, sock, req, len) != len ||
+	    atomicio(read, sock, &rep, 1) != 1) {
+		close(sock);
+		errno = ECONNRESET;
+		return (-1);
+	}
+
+	if (rep == 0x00)
+		return (sock);
+
+	errno = socks5_errno(rep);
+	close(sock);
+	return (-1);
+}
+
+/*
+ * Keep tunnel_conns connections open to the peer.
+ */
+static void
+tunnel_retry(int fd, short ev, void *data)
+{
+	struct tunnel *t = data;
+	struct tunnel_conn *tc;
+	struct timeval tv;
+	int n = 0, sock;
+
+	TAILQ_FOREACH(tc, &t->conns, next)
+		if (tc->outgoing)
+			n++;
+
+	timerclear(&tv);
+	tv.tv_sec = connect_timeout > 0 ? connect_timeout : TUNNEL_TIMEOUT;
+
+	for (; n < tunnel_conns; n++) {
+		if ((sock = net_socket(t->conn, t->peer_ai->ai_addr,
+			 NULL)) == -1)
+			break;
+		if (fcntl(sock, F_SETFL, O_NONBLOCK) == -1 ||
+		    (connect(sock, t->peer_ai->ai_addr,
+			t->peer_ai->ai_addrlen) == -1 &&
+			errno != EINPROGRESS)) {
+			warnv(1, "Tunnel to %s", t->peer);
+			close(sock);
+			break;
+		}
+
+		if ((tc = tunnel_conn_new(t, sock, 1)) == NULL)
+			break;
+
+		event_set(&tc->wev, sock, EV_WRITE, tunnel_conn_connected, tc);
+		if (event_add(&tc->wev, &tv) == -1) {
+			warnv(0, "event_add()");
+			tunnel_conn_free(tc);
+			return;
+		}
+	}
+
+	if (n < tunnel_conns) {
+		timerclear(&tv);
+		tv.tv_sec = 1;
+		if (evtimer_add(&t->retryev, &tv) == -1)
+			warnv(0, "evtimer_add()");
+	}
+}
+
+static void
+tunnel_accept(int fd, short ev, void *data)
+{
+	struct tunnel *t = data;
+	struct tunnel_conn *tc;
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int sock;
+
+	if ((sock = accept(fd, (struct sockaddr *)&sin, &len)) == -1) {
+		if (errno != EAGAIN && errno != EINTR)
+			warnv(0, "accept()");
+		return;
+	}
+
+	if (!access_host(&sin)) {
+		warnxv(2, "Tunnel from %s rejected", inet_ntoa(sin.sin_addr));
+		close(sock);
+		return;
+	}
+
+	if (fcntl(sock, F_SETFL, O_NONBLOCK) == -1) {
+		warnv(0, "fcntl()");
+		close(sock);
+		return;
+	}
+
+	if ((tc = tunnel_conn_new(t, sock, 0)) == NULL)
+		return;
+
+	warnxv(1, "Tunnel from %s up", inet_ntoa(sin.sin_addr));
+	tunnel_conn_ready(tc);
+}
+
+static struct tunnel_conn *
+tunnel_conn_new(struct tunnel *t, int sock, int outgoing)
+{
+	struct tunnel_conn *tc;
+	int i, on = 1;
+
+	if ((tc = calloc(1, sizeof(*tc))) == NULL ||
+	    (tc->in = malloc(TUNNEL_HDRLEN + TUNNEL_MAXDATA)) == NULL ||
+	    (tc->out = malloc(TUNNEL_BUFSZ)) == NULL) {
+		warnv(0, "malloc()");
+		if (tc != NULL)
+			free(tc->in);
+		free(tc);
+		close(sock);
+		return (NULL);
+	}
+
+	/* Each side numbers the streams it opens from its own half */
+	tc->nextid = outgoing ? 1 : 2;
+	tc->outgoing = outgoing;
+	tc->fd = sock;
+	tc->t = t;
+	for (i = 0; i < TUNNEL_HASHSZ; i++)
+		TAILQ_INIT(&tc->streams[i]);
+
+	if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1 ||
+	    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) == -1)
+		warnv(1, "setsockopt()");
+
+	event_set(&tc->rev, sock, EV_READ | EV_PERSIST, tunnel_conn_read, tc);
+	event_set(&tc->wev, sock, EV_WRITE, tunnel_conn_write, tc);
+
+	TAILQ_INSERT_TAIL(&t->conns, tc, next);
+
+	return (tc);
+}
+
+/*
+ * Drop a tunnel connection along with every stream on it; the
+ * clients see their connections closed.
+ */
+static void
+tunnel_conn_free(struct tunnel_conn *tc)
+{
+	struct tunnel *t = tc->t;
+	struct tunnel_stream *ts;
+	struct timeval tv;
+	int i;
+
+	for (i = 0; i < TUNNEL_HASHSZ; i++)
+		while ((ts = TAILQ_FIRST(&tc->streams[i])) != NULL)
+			tunnel_stream_free(ts);
+
+	event_del(&tc->rev);
+	event_del(&tc->wev);
+	close(tc->fd);
+
+	TAILQ_REMOVE(&t->conns, tc, next);
+
+	if (tc->outgoing) {
+		warnxv(tc->connected ? 0 : 1, "Tunnel to %s down", t->peer);
+		timerclear(&tv);
+		tv.tv_sec = 1;
+		if (evtimer_add(&t->retryev, &tv) == -1)
+			warnv(0, "evtimer_add()");
+	}
+
+	free(tc->in);
+	free(tc->out);
+	free(tc);
+}
+
+static void
+tunnel_conn_connected(int fd, short ev, void *data)
+{
+	struct tunnel_conn *tc = data;
+	socklen_t len;
+	int error = ETIMEDOUT;
+
+	if (ev & EV_WRITE) {
+		len = sizeof(error);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+			error = errno;
+	}
+
+	if (error != 0) {
+		errno = error;
+		warnv(1, "Tunnel to %s", tc->t->peer);
+		tunnel_conn_free(tc);
+		return;
+	}
+
+	warnxv(1, "Tunnel to %s up", tc->t->peer);
+	tunnel_conn_ready(tc);
+}
+
+static void
+tunnel_conn_ready(struct tunnel_conn *tc)
+{
+	tc->connected = 1;
+
+	event_set(&tc->wev, tc->fd, EV_WRITE, tunnel_conn_write, tc);
+
+	if (event_add(&tc->rev, NULL) == -1) {
+		warnv(0, "event_add()");
+		tunnel_conn_free(tc);
+	}
+}
+
+static void
+tunnel_conn_read(int fd, short ev, void *data)
+{
+	struct tunnel_conn *tc = data;
+	u_char *p;
+	size_t left, len;
+	ssize_t ret;
+
+	ret = recv(fd, tc->in + tc->inlen,
+	    TUNNEL_HDRLEN + TUNNEL_MAXDATA - tc->inlen, 0);
+	if (ret == -1 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (ret <= 0) {
+		if (ret == -1)
+			warnv(1, "Tunnel recv()");
+		tunnel_conn_free(tc);
+		return;
+	}
+	tc->inlen += ret;
+
+	for (p = tc->in, left = tc->inlen; left >= TUNNEL_HDRLEN;
+	     p += TUNNEL_HDRLEN + len, left -= TUNNEL_HDRLEN + len) {
+		len = (p[2] << 8) | p[3];
+		if (len > TUNNEL_MAXDATA) {
+			warnxv(0, "Tunnel frame too large");
+			tunnel_conn_free(tc);
+			return;
+		}
+		if (left < TUNNEL_HDRLEN + len)
+			break;
+
+		if (tunnel_frame(tc, p[0],
+			(p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7],
+			p + TUNNEL_HDRLEN, len) == -1) {
+			warnxv(0, "Tunnel protocol error");
+			tunnel_conn_free(tc);
+			return;
+		}
+	}
+
+	memmove(tc->in, p, left);
+	tc->inlen = left;
+}
+
+static void
+tunnel_conn_write(int fd, short ev, void *data)
+{
+	struct tunnel_conn *tc = data;
+	struct tunnel_stream *ts, *tsnext;
+	ssize_t ret;
+	int i;
+
+	ret = send(fd, tc->out + tc->outoff, tc->outlen, MSG_NOSIGNAL);
+	if (ret == -1) {
+		if (errno == EINTR || errno == EAGAIN) {
+			event_add(&tc->wev, NULL);
+			return;
+		}
+		warnv(1, "Tunnel send()");
+		tunnel_conn_free(tc);
+		return;
+	}
+
+	tc->outoff += ret;
+	tc->outlen -= ret;
+	if (tc->outlen == 0)
+		tc->outoff = 0;
+	else if (event_add(&tc->wev, NULL) == -1)
+		warnv(0, "event_add()");
+
+	/* Streams that stopped reading for lack of room can go on */
+	if (tc->blocked && tc->outlen < TUNNEL_BUFSZ / 2) {
+		tc->blocked = 0;
+		for (i = 0; i < TUNNEL_HASHSZ; i++)
+			for (ts = TAILQ_FIRST(&tc->streams[i]); ts != NULL;
+			     ts = tsnext) {
+				tsnext = TAILQ_NEXT(ts, next);
+				tunnel_stream_resume(ts);
+			}
+	}
+}
+
+/* The established connection with the fewest streams */
+static struct tunnel_conn *
+tunnel_pick(struct tunnel *t)
+{
+	struct tunnel_conn *tc, *best = NULL;
+
+	TAILQ_FOREACH(tc, &t->conns, next)
+		if (tc->connected && tc->outgoing &&
+		    (best == NULL || tc->nstreams < best->nstreams))
+			best = tc;
+
+	return (best);
+}
+
+/*
+ * Room for len more bytes of output.  Stream data is held back
+ * before TUNNEL_BUFSZ is reached; control frames always go out.
+ */
+static u_char *
+tunnel_reserve(struct tunnel_conn *tc, size_t len)
+{
+	size_t size = TUNNEL_BUFSZ;
+	u_char *out;
+
+	if (tc->outoff + tc->outlen + len > TUNNEL_BUFSZ) {
+		memmove(tc->out, tc->out + tc->outoff, tc->outlen);
+		tc->outoff = 0;
+	}
+
+	while (size < tc->outlen + len)
+		size *= 2;
+	if (size > TUNNEL_BUFSZ) {
+		if ((out = realloc(tc->out, size)) == NULL)
+			errv(0, 1, "realloc()");
+		tc->out = out;
+	}
+
+	return (tc->out + tc->outoff + tc->outlen);
+}
+
+static void
+tunnel_send(struct tunnel_conn *tc, int type, u_int32_t id,
+    const void *payload, size_t len)
+{
+	u_char *p;
+
+	p = tunnel_reserve(tc, TUNNEL_HDRLEN + len);
+	tunnel_hdr(p, type, id, len);
+	if (len > 0)
+		memcpy(p + TUNNEL_HDRLEN, payload, len);
+	tc->outlen += TUNNEL_HDRLEN + len;
+
+	tunnel_conn_schedule(tc);
+}
+
+static void
+tunnel_hdr(u_char *p, int type, u_int32_t id, size_t len)
+{
+	p[0] = type;
+	p[1] = 0;
+	p[2] = len >> 8;
+	p[3] = len;
+	p[4] = id >> 24;
+	p[5] = id >> 16;
+	p[6] = id >> 8;
+	p[7] = id;
+}
+
+static void
+tunnel_conn_schedule(struct tunnel_conn *tc)
+{
+	if (tc->connected && !event_pending(&tc->wev, EV_WRITE, NULL) &&
+	    event_add(&tc->wev, NULL) == -1)
+		warnv(0, "event_add()");
+}
+
+static int
+tunnel_frame(struct tunnel_conn *tc, int type, u_int32_t id, u_char *p,
+    size_t len)
+{
+	struct tunnel_stream *ts;
+	u_int32_t inc;
+
+	if (type == TUNNEL_OPEN) {
+		/* Only the end that dialed opens streams */
+		if (tc->outgoing || tunnel_stream_lookup(tc, id) != NULL)
+			return (-1);
+		tunnel_stream_dial(tc, id, p, len);
+		return (0);
+	}
+
+	/* Frames for a stream that was just reset are expected */
+	if ((ts = tunnel_stream_lookup(tc, id)) == NULL)
+		return (0);
+
+	switch (type) {
+	case TUNNEL_OPENED:
+		if (ts->state != TS_OPENING || len != 1)
+			return (-1);
+		/* The reply for the child */
+		tunnel_stream_append(ts, p, 1);
+		if (p[0] != 0x00)
+			ts->flags |= TS_LOCALEOF | TS_PEEREOF;
+		if (tunnel_stream_flush(ts) == -1 || p[0] != 0x00)
+			break;
+		ts->state = TS_OPEN;
+		tunnel_stream_resume(ts);
+		break;
+	case TUNNEL_DATA:
+		if (ts->state != TS_OPEN || (ts->flags & TS_PEEREOF) ||
+		    ts->len + len > TUNNEL_STREAMWIN) {
+			tunnel_stream_reset(ts);
+			break;
+		}
+		tunnel_stream_append(ts, p, len);
+		tunnel_stream_flush(ts);
+		break;
+	case TUNNEL_WINDOW:
+		if (len != 4)
+			return (-1);
+		memcpy(&inc, p, 4);
+		ts->sendwin += ntohl(inc);
+		tunnel_stream_resume(ts);
+		break;
+	case TUNNEL_CLOSE:
+		ts->flags |= TS_PEEREOF;
+		tunnel_stream_flush(ts);
+		break;
+	case TUNNEL_RESET:
+		tunnel_stream_free(ts);
+		break;
+	default:
+		return (-1);
+	}
+
+	return (0);
+}
+
+static struct tunnel_stream *
+tunnel_stream_new(struct tunnel *t, struct tunnel_conn *tc, u_int32_t id,
+    int fd, int state)
+{
+	struct tunnel_stream *ts;
+
+	if ((ts = calloc(1, sizeof(*ts))) == NULL ||
+	    (ts->buf = malloc(TUNNEL_STREAMWIN + 1)) == NULL) {
+		warnv(0, "malloc()");
+		free(ts);
+		close(fd);
+		return (NULL);
+	}
+
+	ts->id = id;
+	ts->fd = fd;
+	ts->state = state;
+	ts->sendwin = TUNNEL_STREAMWIN;
+	ts->tc = tc;
+	ts->t = t;
+
+	event_set(&ts->rev, fd, EV_READ | EV_PERSIST, tunnel_stream_read, ts);
+	event_set(&ts->wev, fd, EV_WRITE, tunnel_stream_write, ts);
+
+	if (tc != NULL) {
+		TAILQ_INSERT_TAIL(&tc->streams[id % TUNNEL_HASHSZ], ts, next);
+		tc->nstreams++;
+	} else {
+		TAILQ_INSERT_TAIL(&t->waiting, ts, next);
+	}
+
+	return (ts);
+}
+
+static struct tunnel_stream *
+tunnel_stream_lookup(struct tunnel_conn *tc, u_int32_t id)
+{
+	struct tunnel_stream *ts;
+
+	TAILQ_FOREACH(ts, &tc->streams[id % TUNNEL_HASHSZ], next)
+		if (ts->id == id)
+			break;
+
+	return (ts);
+}
+
+static void
+tunnel_stream_free(struct tunnel_stream *ts)
+{
+	struct tunnel_conn *tc = ts->tc;
+
+	event_del(&ts->rev);
+	event_del(&ts->wev);
+	close(ts->fd);
+
+	if (tc != NULL) {
+		TAILQ_REMOVE(&tc->streams[ts->id % TUNNEL_HASHSZ], ts, next);
+		tc->nstreams--;
+	} else {
+		TAILQ_REMOVE(&ts->t->waiting, ts, next);
+	}
+
+	free(ts->buf);
+	free(ts);
+}
+
+static void
+tunnel_stream_reset(struct tunnel_stream *ts)
+{
+	if (ts->tc != NULL)
+		tunnel_send(ts->tc, TUNNEL_RESET, ts->id, NULL, 0);
+	tunnel_stream_free(ts);
+}
+
+/*
+ * The peer asks us to connect for it.
+ */
+static void
+tunnel_stream_dial(struct tunnel_conn *tc, u_int32_t id, u_char *p,
+    size_t len)
+{
+	struct tunnel_stream *ts;
+	struct sockaddr_storage ss;
+	struct timeval tv;
+	socklen_t sslen;
+	u_char rep = 0x01;
+	int sock;
+
+	if (tunnel_addr(p, len, &ss, &sslen) == -1) {
+		rep = 0x08;
+		goto fail;
+	}
+
+	/* Our rules apply to what the peer asks of us as well */
+	if (!access_dest((struct sockaddr_in *)&ss, NULL)) {
+		rep = socks5_rep(EACCES);
+		goto fail;
+	}
+
+	if ((sock = net_socket(tc->t->conn, (struct sockaddr *)&ss,
+		 NULL)) == -1)
+		goto fail;
+
+	if (fcntl(sock, F_SETFL, O_NONBLOCK) == -1 ||
+	    (connect(sock, (struct sockaddr *)&ss, sslen) == -1 &&
+		errno != EINPROGRESS)) {
+		rep = socks5_rep(errno);
+		close(sock);
+		goto fail;
+	}
+
+	if ((ts = tunnel_stream_new(tc->t, tc, id, sock, TS_CONNECTING)) == NULL)
+		goto fail;
+
+	timerclear(&tv);
+	tv.tv_sec = connect_timeout > 0 ? connect_timeout : TUNNEL_TIMEOUT;
+
+	event_set(&ts->wev, sock, EV_WRITE, tunnel_stream_connected, ts);
+	if (event_add(&ts->wev, &tv) == -1) {
+		warnv(0, "event_add()");
+		tunnel_stream_free(ts);
+		goto fail;
+	}
+
+	return;
+
+ fail:
+	tunnel_send(tc, TUNNEL_OPENED, id, &rep, 1);
+}
+
+static void
+tunnel_stream_connected(int fd, short ev, void *data)
+{
+	struct tunnel_stream *ts = data;
+	struct tunnel_conn *tc = ts->tc;
+	socklen_t len;
+	u_char rep;
+	int error = ETIMEDOUT;
+
+	if (ev & EV_WRITE) {
+		len = sizeof(error);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+			error = errno;
+	}
+
+	rep = error == 0 ? 0x00 : socks5_rep(error);
+	tunnel_send(tc, TUNNEL_OPENED, ts->id, &rep, 1);
+
+	if (error != 0) {
+		errno = error;
+		warnv(2, "Tunnel connect()");
+		tunnel_stream_free(ts);
+		return;
+	}
+
+	ts->state = TS_OPEN;
+	event_set(&ts->wev, fd, EV_WRITE, tunnel_stream_write, ts);
+	tunnel_stream_resume(ts);
+}
+
+/*
+ * The request from a child: SOCKS5 ATYP, address and port.
+ */
+static void
+tunnel_stream_request(struct tunnel_stream *ts)
+{
+	struct tunnel *t = ts->t;
+	struct tunnel_conn *tc;
+	struct sockaddr_storage ss;
+	socklen_t sslen;
+	u_char req[32], rep = 0x01;
+	ssize_t ret;
+
+	if ((ret = recv(ts->fd, req, sizeof(req), 0)) == -1 &&
+	    (errno == EINTR || errno == EAGAIN))
+		return;
+
+	/* The child closed, or did not need the tunnel */
+	if (ret <= 0 || tunnel_addr(req, ret, &ss, &sslen) == -1) {
+		tunnel_stream_free(ts);
+		return;
+	}
+
+	tunnel_stream_pause(ts);
+
+	if ((tc = tunnel_pick(t)) == NULL) {
+		warnxv(1, "No tunnel to %s", t->peer);
+		ts->flags |= TS_LOCALEOF | TS_PEEREOF;
+		tunnel_stream_append(ts, &rep, 1);
+		tunnel_stream_flush(ts);
+		return;
+	}
+
+	TAILQ_REMOVE(&t->waiting, ts, next);
+	ts->tc = tc;
+	ts->id = tc->nextid;
+	tc->nextid += 2;
+	TAILQ_INSERT_TAIL(&tc->streams[ts->id % TUNNEL_HASHSZ], ts, next);
+	tc->nstreams++;
+
+	ts->state = TS_OPENING;
+	tunnel_send(tc, TUNNEL_OPEN, ts->id, req, ret);
+}
+
+static void
+tunnel_stream_read(int fd, short ev, void *data)
+{
+	struct tunnel_stream *ts = data;
+	struct tunnel_conn *tc = ts->tc;
+	u_char *p;
+	size_t len;
+	ssize_t ret;
+
+	if (ts->state == TS_WAITING) {
+		tunnel_stream_request(ts);
+		return;
+	}
+
+	len = MIN(ts->sendwin, TUNNEL_MAXDATA);
+	if (tc->outlen + TUNNEL_HDRLEN + len > TUNNEL_BUFSZ) {
+		tc->blocked = 1;
+		tunnel_stream_pause(ts);
+		return;
+	}
+	if (len == 0) {
+		tunnel_stream_pause(ts);
+		return;
+	}
+
+	p = tunnel_reserve(tc, TUNNEL_HDRLEN + len);
+	ret = recv(fd, p + TUNNEL_HDRLEN, len, 0);
+	if (ret == -1) {
+		if (errno != EINTR && errno != EAGAIN)
+			tunnel_stream_reset(ts);
+		return;
+	}
+
+	if (ret == 0) {
+		ts->flags |= TS_LOCALEOF;
+		tunnel_stream_pause(ts);
+		tunnel_send(tc, TUNNEL_CLOSE, ts->id, NULL, 0);
+		tunnel_stream_flush(ts);
+		return;
+	}
+
+	/* The payload was read in place */
+	tunnel_hdr(p, TUNNEL_DATA, ts->id, ret);
+	tc->outlen += TUNNEL_HDRLEN + ret;
+	ts->sendwin -= ret;
+	tunnel_conn_schedule(tc);
+}
+
+static void
+tunnel_stream_write(int fd, short ev, void *data)
+{
+	tunnel_stream_flush(data);
+}
+
+/*
+ * Deliver what the peer sent, announcing the room made to it, and
+ * pass on an end of stream.  Frees the stream once both sides are
+ * done, returning -1 when it was.
+ */
+static int
+tunnel_stream_flush(struct tunnel_stream *ts)
+{
+	ssize_t ret;
+
+	while (ts->len > 0) {
+		ret = send(ts->fd, ts->buf + ts->off, ts->len, MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				if (event_add(&ts->wev, NULL) == -1)
+					warnv(0, "event_add()");
+				return (0);
+			}
+			tunnel_stream_reset(ts);
+			return (-1);
+		}
+		ts->off += ret;
+		ts->len -= ret;
+		if (ts->state == TS_OPEN)
+			ts->unacked += ret;
+	}
+	ts->off = 0;
+
+	if (ts->tc != NULL && ts->unacked >= TUNNEL_STREAMWIN / 2 &&
+	    !(ts->flags & TS_PEEREOF)) {
+		u_int32_t inc = htonl(ts->unacked);
+
+		tunnel_send(ts->tc, TUNNEL_WINDOW, ts->id, &inc, 4);
+		ts->unacked = 0;
+	}
+
+	if ((ts->flags & (TS_PEEREOF | TS_SHUTDOWN)) == TS_PEEREOF) {
+		shutdown(ts->fd, SHUT_WR);
+		ts->flags |= TS_SHUTDOWN;
+	}
+
+	if ((ts->flags & (TS_LOCALEOF | TS_PEEREOF)) ==
+	    (TS_LOCALEOF | TS_PEEREOF)) {
+		tunnel_stream_free(ts);
+		return (-1);
+	}
+
+	return (0);
+}
+
+static void
+tunnel_stream_resume(struct tunnel_stream *ts)
+{
+	if (ts->state != TS_OPEN || (ts->flags & (TS_READING | TS_LOCALEOF)) ||
+	    ts->sendwin == 0)
+		return;
+
+	if (event_add(&ts->rev, NULL) == -1) {
+		warnv(0, "event_add()");
+		return;
+	}
+	ts->flags |= TS_READING;
+}
+
+static void
+tunnel_stream_pause(struct tunnel_stream *ts)
+{
+	if (ts->state == TS_WAITING || (ts->flags & TS_READING)) {
+		event_del(&ts->rev);
+		ts->flags &= ~TS_READING;
+	}
+}
+
+static void
+tunnel_stream_append(struct tunnel_stream *ts, const u_char *p, size_t len)
+{
+	if (ts->off + ts->len + len > TUNNEL_STREAMWIN + 1) {
+		memmove(ts->buf, ts->buf + ts->off, ts->len);
+		ts->off = 0;
+	}
+	memcpy(ts->buf + ts->off + ts->len, p, len);
+	ts->len += len;
+}
+
+static int
+tunnel_addr(u_char *p, size_t len, struct sockaddr_storage *ss,
+    socklen_t *sslen)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+
+	memset(ss, 0, sizeof(*ss));
+
+	if (len == 7 && p[0] == 0x01) {
+		sin->sin_family = AF_INET;
+		memcpy(&sin->sin_addr, p + 1, 4);
+		memcpy(&sin->sin_port, p + 5, 2);
+		*sslen = sizeof(*sin);
+	} else if (len == 19 && p[0] == 0x04) {
+		sin6->sin6_family = AF_INET6;
+		memcpy(&sin6->sin6_addr, p + 1, 16);
+		memcpy(&sin6->sin6_port, p + 17, 2);
+		*sslen = sizeof(*sin6);
+	} else {
+		return (-1);
+	}
+
+	return (0);
+}
+
+static void
+tunnel_cleanup(void *data)
+{
+	struct tunnel *t = data;
+	struct tunnel_conn *tc;
+	struct tunnel_stream *ts;
+	int i;
+
+	/*
+	 * Close everything before deleting the events, see
+	 * mirror_cleanup().
+	 */
+	if (t->listensock != -1) {
+		close(t->listensock);
+		event_del(&t->listenev);
+	}
+	if (t->childsock != -1)
+		close(t->childsock);
+	if (t->peer_ai != NULL)
+		event_del(&t->retryev);
+
+	while ((ts = TAILQ_FIRST(&t->waiting)) != NULL) {
+		close(ts->fd);
+		event_del(&ts->rev);
+		event_del(&ts->wev);
+		TAILQ_REMOVE(&t->waiting, ts, next);
+	}
+
+	TAILQ_FOREACH(tc, &t->conns, next) {
+		close(tc->fd);
+		event_del(&tc->rev);
+		event_del(&tc->wev);
+		for (i = 0; i < TUNNEL_HASHSZ; i++)
+			TAILQ_FOREACH(ts, &tc->streams[i], next) {
+				close(ts->fd);
+				event_del(&ts->rev);
+				event_del(&ts->wev);
+			}
+	}
+}
@@ -0,0 +1,660 @@
+/*
+ * udp.c
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+/* For recvmmsg() and sendmmsg() */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <event.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "access.h"
+#include "cleanup.h"
+#include "hosts.h"
+#include "net.h"
+#include "accesslog.h"
+#include "nylon.h"
+#include "print.h"
+#include "stats.h"
+#include "udp.h"
+
+#define UDP_BATCH           16		/* Datagrams per syscall */
+#define UDP_DGRAMSZ         4096	/* Largest datagram relayed */
+#define UDP_HDRROOM         10		/* SOCKS5 UDP header, IPv4 */
+#define UDP_HASHSZ          64
+#define UDP_SESSIONS_MAX    256
+#define UDP_NAMES_MAX       1024	/* Indexed, over all sessions */
+#define UDP_SESSION_TIMEOUT 60		/* Seconds */
+#define UDP_SWEEP_INTERVAL  10		/* Seconds */
+
+#define SOCKS5_ATYP_IPV4    1
+#define SOCKS5_ATYP_FQDN    3
+
+#ifndef MSG_WAITFORONE
+/* No recvmmsg()/sendmmsg(); batches are moved one datagram at a time */
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int  msg_len;
+};
+#endif /* !MSG_WAITFORONE */
+
+/* A name a client sent to that led to a session */
+struct udp_name {
+	char                     *name;
+	struct udp_session       *s;
+	LIST_ENTRY(udp_name)      hashnext;
+	LIST_ENTRY(udp_name)      next;		/* Of the session */
+};
+
+LIST_HEAD(udp_nameh, udp_name);
+
+/*
+ * A destination the client has sent to.  Only sessions may send
+ * datagrams back to the client.
+ */
+struct udp_session {
+	struct sockaddr_in        dst;
+	struct udp_nameh          names;	/* FQDN requests only */
+	time_t                    last;
+	LIST_ENTRY(udp_session)   addrnext;
+};
+
+LIST_HEAD(udp_sessionh, udp_session);
+
+struct udp_assoc {
+	int                  clisock;		/* TCP control connection */
+	int                  relsock;		/* Facing the client */
+	int                  remsock;		/* Facing the destinations */
+	struct sockaddr_in   cli_in;		/* Client UDP address */
+	int                  cli_known;
+	struct event         ctlev;
+	struct event         relev;
+	struct event         remev;
+	struct event         sweepev;
+	u_int                nsessions;
+	u_int                nnames;
+	struct udp_sessionh  addrhash[UDP_HASHSZ];
+	struct udp_nameh     namehash[UDP_HASHSZ];
+};
+
+/* One association per process; both directions share the buffers */
+static u_char             udp_buf[UDP_BATCH][UDP_HDRROOM + UDP_DGRAMSZ];
+static struct sockaddr_in udp_names[UDP_BATCH];
+static struct iovec       udp_iov[UDP_BATCH], udp_oiov[UDP_BATCH];
+static struct mmsghdr     udp_msgs[UDP_BATCH], udp_omsgs[UDP_BATCH];
+
+extern cleanup_t *cleanup;
+
+/* From nylon.c */
+void signal_setup(void);
+
+static int                 udp_socket(struct sockaddr *, socklen_t, char *);
+static int                 udp_recvbatch(int, int);
+static int                 udp_sendbatch(int, int);
+static void                udp_fromclient(int, short, void *);
+static void                udp_fromremote(int, short, void *);
+static void                udp_control(int, short, void *);
+static void                udp_sweep(int, short, void *);
+static void                udp_cleanup(void *);
+static u_int               udp_addrhash(struct sockaddr_in *);
+static u_int               udp_namehash(const char *);
+static struct udp_session *udp_session_find(struct udp_assoc *,
+                               struct sockaddr_in *);
+static struct udp_session *udp_session_get(struct udp_assoc *,
+                               struct sockaddr_in *, const char *);
+static void                udp_session_free(struct udp_assoc *,
+                               struct udp_session *);
+
+/*
+ * Set up the relay for a UDP ASSOCIATE request.  The client facing
+ * socket is bound to the address the client reached us on; its
+ * address is returned in bnd_in for the reply.  expect holds the
+ * address the client said it will send from, 0 if unknown.
+ */
+struct udp_assoc *
+udp_setup(int clisock, struct sockaddr_in *expect, struct conndesc *conn,
+    struct sockaddr_in *bnd_in)
+{
+	struct udp_assoc *ua;
+	struct sockaddr_in local_in, any_in;
+	struct net_source *src;
+	socklen_t len;
+	int i;
+
+	if ((ua = calloc(1, sizeof(*ua))) == NULL) {
+		warnv(0, "calloc()");
+		return (NULL);
+	}
+
+	ua->clisock = clisock;
+	ua->relsock = ua->remsock = -1;
+	for (i = 0; i < UDP_HASHSZ; i++) {
+		LIST_INIT(&ua->addrhash[i]);
+		LIST_INIT(&ua->namehash[i]);
+	}
+
+	/* Only datagrams from the controlling client are relayed */
+	len = sizeof(ua->cli_in);
+	if (getpeername(clisock, (struct sockaddr *)&ua->cli_in, &len) == -1) {
+		warnv(0, "getpeername()");
+		goto fail;
+	}
+	if (expect->sin_addr.s_addr != INADDR_ANY)
+		ua->cli_in.sin_addr = expect->sin_addr;
+	ua->cli_in.sin_port = expect->sin_port;
+	ua->cli_known = ua->cli_in.sin_port != 0;
+
+	len = sizeof(local_in);
+	if (getsockname(clisock, (struct sockaddr *)&local_in, &len) == -1) {
+		warnv(0, "getsockname()");
+		goto fail;
+	}
+	local_in.sin_port = 0;
+
+	if ((ua->relsock = udp_socket((struct sockaddr *)&local_in,
+		 sizeof(local_in), NULL)) == -1)
+		goto fail;
+
+	if ((src = net_source(conn, NULL, NULL)) != NULL) {
+		ua->remsock = udp_socket(src->ai->ai_addr, src->ai->ai_addrlen,
+		    src->if_name);
+	} else {
+		memset(&any_in, 0, sizeof(any_in));
+		any_in.sin_family = AF_INET;
+		ua->remsock = udp_socket((struct sockaddr *)&any_in,
+		    sizeof(any_in), NULL);
+	}
+	if (ua->remsock == -1)
+		goto fail;
+
+	len = sizeof(*bnd_in);
+	if (getsockname(ua->relsock, (struct sockaddr *)bnd_in, &len) == -1) {
+		warnv(0, "getsockname()");
+		goto fail;
+	}
+
+	return (ua);
+
+ fail:
+	if (ua->relsock != -1)
+		close(ua->relsock);
+	if (ua->remsock != -1)
+		close(ua->remsock);
+	free(ua);
+	return (NULL);
+}
+
+/*
+ * Relay datagrams until the client closes the TCP connection.
+ * Like the TCP relay, this does not return.
+ */
+void
+udp_relay(struct udp_assoc *ua)
+{
+	struct timeval tv;
+	int i;
+
+	for (i = 0; i < UDP_BATCH; i++) {
+		udp_msgs[i].msg_hdr.msg_name = &udp_names[i];
+		udp_msgs[i].msg_hdr.msg_iov = &udp_iov[i];
+		udp_msgs[i].msg_hdr.msg_iovlen = 1;
+		udp_omsgs[i].msg_hdr.msg_iov = &udp_oiov[i];
+		udp_omsgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	cleanup_cleanup(cleanup);
+	cleanup_free(cleanup);
+
+	if ((cleanup = cleanup_new()) == NULL)
+		errxv(0, 1, "Failed setting up cleanup functionality");
+
+	/* Create new event loop */
+	event_init();
+
+	event_set(&ua->ctlev, ua->clisock, EV_READ | EV_PERSIST,
+	    udp_control, ua);
+	event_set(&ua->relev, ua->relsock, EV_READ | EV_PERSIST,
+	    udp_fromclient, ua);
+	event_set(&ua->remev, ua->remsock, EV_READ | EV_PERSIST,
+	    udp_fromremote, ua);
+	evtimer_set(&ua->sweepev, udp_sweep, ua);
+
+	timerclear(&tv);
+	tv.tv_sec = UDP_SWEEP_INTERVAL;
+
+	if (event_add(&ua->ctlev, NULL) == -1 ||
+	    event_add(&ua->relev, NULL) == -1 ||
+	    event_add(&ua->remev, NULL) == -1 ||
+	    evtimer_add(&ua->sweepev, &tv) == -1)
+		errv(0, 1, "event_add()");
+
+	if (cleanup_add(cleanup, udp_cleanup, ua) == -1)
+		errxv(0, 1, "cleanup_add()");
+
+	warnxv(4, "UDP association for %s", inet_ntoa(ua->cli_in.sin_addr));
+
+	signal_setup();
+	event_dispatch();
+	errxv(0, 1, "Event error");
+}
+
+static void
+udp_cleanup(void *_ua)
+{
+	struct udp_assoc *ua = _ua;
+	struct udp_session *s;
+	int i;
+
+	event_del(&ua->ctlev);
+	event_del(&ua->relev);
+	event_del(&ua->remev);
+	evtimer_del(&ua->sweepev);
+
+	for (i = 0; i < UDP_HASHSZ; i++)
+		while ((s = LIST_FIRST(&ua->addrhash[i])) != NULL)
+			udp_session_free(ua, s);
+
+	close(ua->clisock);
+	close(ua->relsock);
+	close(ua->remsock);
+	free(ua);
+}
+
+static int
+udp_socket(struct sockaddr *sa, socklen_t salen, char *ifname)
+{
+	int sock;
+
+	if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+		warnv(0, "socket()");
+		return (-1);
+	}
+
+#ifdef SO_BINDTODEVICE
+	if (ifname != NULL &&
+	    setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, ifname,
+		IFNAMSIZ - 1) == -1) {
+		warnv(0, "bind device()");
+		goto fail;
+	}
+#endif /* SO_BINDTODEVICE */
+
+	if (bind(sock, sa, salen) == -1) {
+		warnv(0, "bind()");
+		goto fail;
+	}
+
+	if (fcntl(sock, F_SETFL, O_NONBLOCK) == -1) {
+		warnv(0, "fcntl()");
+		goto fail;
+	}
+
+	return (sock);
+
+ fail:
+	close(sock);
+	return (-1);
+}
+
+/*
+ * Receive up to a batch of datagrams into udp_buf, leaving room for
+ * a SOCKS5 header in front of each if hdrroom is set.
+ */
+static int
+udp_recvbatch(int sock, int hdrroom)
+{
+	int i, n;
+
+	for (i = 0; i < UDP_BATCH; i++) {
+		udp_iov[i].iov_base = udp_buf[i] + hdrroom;
+		udp_iov[i].iov_len = sizeof(udp_buf[i]) - hdrroom;
+		udp_msgs[i].msg_hdr.msg_namelen = sizeof(udp_names[i]);
+		udp_msgs[i].msg_hdr.msg_flags = 0;
+	}
+
+#ifdef MSG_WAITFORONE
+	n = recvmmsg(sock, udp_msgs, UDP_BATCH, 0, NULL);
+#else
+	for (n = 0; n < UDP_BATCH; n++) {
+		ssize_t ret;
+
+		if ((ret = recvmsg(sock, &udp_msgs[n].msg_hdr, 0)) == -1)
+			break;
+		udp_msgs[n].msg_len = ret;
+	}
+	if (n == 0)
+		n = -1;
+#endif /* MSG_WAITFORONE */
+
+	if (n == -1 && errno != EAGAIN && errno != EINTR)
+		warnv(1, "recvmmsg()");
+
+	return (n);
+}
+
+static int
+udp_sendbatch(int sock, int n)
+{
+	int i, sent;
+
+	for (i = 0; i < n; i += sent) {
+#ifdef MSG_WAITFORONE
+		sent = sendmmsg(sock, udp_omsgs + i, n - i, 0);
+#else
+		sent = sendmsg(sock, &udp_omsgs[i].msg_hdr, 0) == -1 ? -1 : 1;
+#endif /* MSG_WAITFORONE */
+
+		if (sent == -1) {
+			if (errno == EINTR)
+				sent = 0;
+			else if (errno == EAGAIN || errno == ENOBUFS)
+				return (i);	/* Dropped, as UDP would */
+			else {
+				/* Skip a datagram that cannot be sent */
+				warnv(2, "sendmmsg()");
+				sent = 1;
+			}
+		}
+	}
+
+	return (n);
+}
+
+/*
+ * Datagrams from the client: strip the SOCKS5 header and send the
+ * payload on to the destination.
+ */
+static void
+udp_fromclient(int fd, short ev, void *data)
+{
+	struct udp_assoc *ua = data;
+	struct udp_session *s;
+	struct sockaddr_in *from, dst_in;
+	char name[256];
+	u_char *p;
+	size_t len, hlen;
+	int i, n, out = 0;
+
+	if ((n = udp_recvbatch(fd, 0)) <= 0)
+		return;
+
+	for (i = 0; i < n; i++) {
+		from = &udp_names[i];
+		p = udp_buf[i];
+		len = udp_msgs[i].msg_len;
+
+		/* Same access rules as for the TCP connection */
+		if (from->sin_addr.s_addr != ua->cli_in.sin_addr.s_addr ||
+		    (ua->cli_known && from->sin_port != ua->cli_in.sin_port) ||
+		    !access_host(from))
+			continue;
+		if (!ua->cli_known) {
+			ua->cli_in.sin_port = from->sin_port;
+			ua->cli_known = 1;
+		}
+
+		/* RSV RSV FRAG ATYP; fragments are not supported */
+		if (ISSET(udp_msgs[i].msg_hdr.msg_flags, MSG_TRUNC) ||
+		    len < 4 || p[2] != 0)
+			continue;
+
+		memset(&dst_in, 0, sizeof(dst_in));
+		dst_in.sin_family = AF_INET;
+
+		switch (p[3]) {
+		case SOCKS5_ATYP_IPV4:
+			hlen = 4 + 4 + 2;
+			if (len < hlen)
+				continue;
+			memcpy(&dst_in.sin_addr, p + 4, 4);
+			memcpy(&dst_in.sin_port, p + 8, 2);
+			s = udp_session_get(ua, &dst_in, NULL);
+			break;
+		case SOCKS5_ATYP_FQDN:
+			if (len < 5 || len < (hlen = 5 + p[4] + 2))
+				continue;
+			memcpy(name, p + 5, p[4]);
+			name[p[4]] = '\0';
+			memcpy(&dst_in.sin_port, p + hlen - 2, 2);
+			s = udp_session_get(ua, &dst_in, name);
+			break;
+		default:
+			continue;
+		}
+
+		if (s == NULL)
+			continue;
+
+		udp_omsgs[out].msg_hdr.msg_name = &s->dst;
+		udp_omsgs[out].msg_hdr.msg_namelen = sizeof(s->dst);
+		udp_oiov[out].iov_base = p + hlen;
+		udp_oiov[out].iov_len = len - hlen;
+		out++;
+		stats_add(STATS_BYTES_CLIENT, len - hlen);
+	}
+
+	if (out > 0)
+		udp_sendbatch(ua->remsock, out);
+}
+
+/*
+ * Datagrams from destinations: prepend the SOCKS5 header and send
+ * them back to the client.
+ */
+static void
+udp_fromremote(int fd, short ev, void *data)
+{
+	struct udp_assoc *ua = data;
+	struct udp_session *s;
+	u_char *p;
+	int i, n, out = 0;
+
+	if ((n = udp_recvbatch(fd, UDP_HDRROOM)) <= 0 || !ua->cli_known)
+		return;
+
+	for (i = 0; i < n; i++) {
+		if (ISSET(udp_msgs[i].msg_hdr.msg_flags, MSG_TRUNC) ||
+		    (s = udp_session_find(ua, &udp_names[i])) == NULL)
+			continue;
+
+		s->last = time(NULL);
+
+		p = udp_buf[i];
+		p[0] = p[1] = p[2] = 0;
+		p[3] = SOCKS5_ATYP_IPV4;
+		memcpy(p + 4, &udp_names[i].sin_addr, 4);
+		memcpy(p + 8, &udp_names[i].sin_port, 2);
+
+		udp_omsgs[out].msg_hdr.msg_name = &ua->cli_in;
+		udp_omsgs[out].msg_hdr.msg_namelen = sizeof(ua->cli_in);
+		udp_oiov[out].iov_base = p;
+		udp_oiov[out].iov_len = UDP_HDRROOM + udp_msgs[i].msg_len;
+		out++;
+		stats_add(STATS_BYTES_REMOTE, udp_msgs[i].msg_len);
+	}
+
+	if (out > 0)
+		udp_sendbatch(ua->relsock, out);
+}
+
+/*
+ * The association lives as long as the TCP connection it arrived on.
+ */
+static void
+udp_control(int fd, short ev, void *data)
+{
+	u_char junk[512];
+	ssize_t ret;
+
+	if ((ret = read(fd, junk, sizeof(junk))) > 0 ||
+	    (ret == -1 && (errno == EINTR || errno == EAGAIN)))
+		return;
+
+	cleanup_cleanup(cleanup);
+	accesslog_reason(ACCESSLOG_CLOSED);
+	errxv(2, 0, "Terminated UDP association");
+}
+
+static void
+udp_sweep(int fd, short ev, void *data)
+{
+	struct udp_assoc *ua = data;
+	struct udp_session *s, *next;
+	struct timeval tv;
+	time_t now = time(NULL);
+	int i;
+
+	for (i = 0; i < UDP_HASHSZ; i++)
+		for (s = LIST_FIRST(&ua->addrhash[i]); s != NULL; s = next) {
+			next = LIST_NEXT(s, addrnext);
+			if (now - s->last > UDP_SESSION_TIMEOUT)
+				udp_session_free(ua, s);
+		}
+
+	timerclear(&tv);
+	tv.tv_sec = UDP_SWEEP_INTERVAL;
+	if (evtimer_add(&ua->sweepev, &tv) == -1)
+		warnv(0, "evtimer_add()");
+}
+
+static u_int
+udp_addrhash(struct sockaddr_in *in)
+{
+	return ((ntohl(in->sin_addr.s_addr) * 31 + ntohs(in->sin_port)) %
+	    UDP_HASHSZ);
+}
+
+static u_int
+udp_namehash(const char *name)
+{
+	u_int h = 0;
+
+	while (*name != '\0')
+		h = h * 31 + (u_char)*name++;
+
+	return (h % UDP_HASHSZ);
+}
+
+static struct udp_session *
+udp_session_find(struct udp_assoc *ua, struct sockaddr_in *in)
+{
+	struct udp_session *s;
+
+	LIST_FOREACH(s, &ua->addrhash[udp_addrhash(in)], addrnext)
+		if (s->dst.sin_addr.s_addr == in->sin_addr.s_addr &&
+		    s->dst.sin_port == in->sin_port)
+			return (s);
+
+	return (NULL);
+}
+
+/*
+ * Look up the session for a destination, creating it if needed.
+ * Names are resolved once per session rather than per datagram; a
+ * session may be reached by several.
+ */
+static struct udp_session *
+udp_session_get(struct udp_assoc *ua, struct sockaddr_in *in,
+    const char *name)
+{
+	struct udp_session *s;
+	struct udp_name *un;
+
+	if (name != NULL) {
+		LIST_FOREACH(un, &ua->namehash[udp_namehash(name)], hashnext)
+			if (un->s->dst.sin_port == in->sin_port &&
+			    strcmp(un->name, name) == 0) {
+				s = un->s;
+				goto found;
+			}
+
+		if (hosts_resolve(name, &in->sin_addr) == -1) {
+			warnxv(1, "Unable to resolve host: %s", name);
+			return (NULL);
+		}
+
+		/* A name may be denied even where its address has a session */
+		if (!access_dest(in, name))
+			return (NULL);
+	}
+
+	if ((s = udp_session_find(ua, in)) == NULL) {
+		/* Checked once per destination, like the name lookup */
+		if (name == NULL && !access_dest(in, NULL))
+			return (NULL);
+		if (ua->nsessions >= UDP_SESSIONS_MAX) {
+			warnxv(1, "Too many UDP destinations");
+			return (NULL);
+		}
+
+		if ((s = calloc(1, sizeof(*s))) == NULL) {
+			warnv(0, "calloc()");
+			return (NULL);
+		}
+		memcpy(&s->dst, in, sizeof(s->dst));
+		LIST_INIT(&s->names);
+		LIST_INSERT_HEAD(&ua->addrhash[udp_addrhash(in)], s, addrnext);
+		ua->nsessions++;
+	}
+
+	/* Past the limit, the name is just looked up again next time */
+	if (name != NULL && ua->nnames < UDP_NAMES_MAX) {
+		if ((un = calloc(1, sizeof(*un))) == NULL)
+			warnv(0, "calloc()");
+		else if ((un->name = strdup(name)) == NULL) {
+			warnv(0, "strdup()");
+			free(un);
+		} else {
+			un->s = s;
+			LIST_INSERT_HEAD(&ua->namehash[udp_namehash(name)],
+			    un, hashnext);
+			LIST_INSERT_HEAD(&s->names, un, next);
+			ua->nnames++;
+		}
+	}
+
+ found:
+	s->last = time(NULL);
+	return (s);
+}
+
+static void
+udp_session_free(struct udp_assoc *ua, struct udp_session *s)
+{
+	struct udp_name *un;
+
+	LIST_REMOVE(s, addrnext);
+	while ((un = LIST_FIRST(&s->names)) != NULL) {
+		LIST_REMOVE(un, next);
+		LIST_REMOVE(un, hashnext);
+		free(un->name);
+		free(un);
+		ua->nnames--;
+	}
+	ua->nsessions--;
+	free(s);
+}
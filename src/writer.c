@@ -0,0 +1,113 @@
+/*
+ * writer.c
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "print.h"
+#include "writer.h"
+
+/*
+ * The log, the access log and the capture each have a process of
+ * their own that does the writing, fed by the listening process and
+ * every child over a socket pair, so that a slow disk holds up the
+ * writer and not the relays.  Without one, the callers write
+ * directly.
+ */
+
+/*
+ * Start a writer running fn on one end of a new socket pair, and
+ * return the other end, or -1 if there can be no writer.  sndbuf, if
+ * not 0, is how much the other processes may queue.
+ */
+int
+writer_spawn(const char *what, int sndbuf, void (*fn)(int))
+{
+	int fds[2];
+
+	/* Not everywhere has Unix SOCK_SEQPACKET */
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == -1) {
+		warnv(1, "socketpair(); writing %s directly", what);
+		return (-1);
+	}
+	if (sndbuf > 0 && setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &sndbuf,
+		sizeof(sndbuf)) == -1)
+		warnv(1, "setsockopt(SO_SNDBUF)");
+
+	switch (fork()) {
+	case -1:
+		warnv(0, "fork(); writing %s directly", what);
+		close(fds[0]);
+		close(fds[1]);
+		return (-1);
+	case 0:
+		close(fds[1]);
+		/*
+		 * Stays for the last words of the others, even when
+		 * the whole process group is told to quit.
+		 */
+		signal(SIGTERM, SIG_IGN);
+		signal(SIGINT, SIG_IGN);
+		signal(SIGHUP, SIG_IGN);
+		signal(SIGUSR1, SIG_IGN);
+		fn(fds[0]);
+		_exit(0);
+	default:
+		break;
+	}
+
+	close(fds[0]);
+	/* A restart on SIGHUP starts writers of its own */
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	return (fds[1]);
+}
+
+/*
+ * Run by a writer: waits for a message, takes up to max - 1 more of
+ * those that have already arrived, handing each to put, then has
+ * flush write out the batch.  Messages are at most msgsz bytes.
+ * Returns once every process that could send one is gone.
+ */
+void
+writer_loop(int sock, size_t msgsz, int max, void (*put)(u_char *, size_t),
+    void (*flush)(void))
+{
+	u_char *msg;
+	ssize_t ret;
+	int n;
+
+	if ((msg = malloc(msgsz)) == NULL)
+		errv(0, 1, "malloc()");
+
+	do {
+		for (n = 0; n < max; n++) {
+			ret = recv(sock, msg, msgsz, n == 0 ? 0 : MSG_DONTWAIT);
+			if (ret == -1 && errno == EINTR) {
+				n--;
+				continue;
+			}
+			if (ret <= 0)
+				break;
+			put(msg, ret);
+		}
+		if (n > 0)
+			flush();
+	} while (n > 0);
+
+	free(msg);
+}